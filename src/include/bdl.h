@@ -40,6 +40,32 @@ struct bdl_io_sync_queue {
 	int count;
 };
 
+struct bdl_arena_chunk;
+struct bdl_shared_page;
+
+struct bdl_arena {
+	struct bdl_arena_chunk *first;
+	struct bdl_arena_chunk *current;
+};
+
+/* Region with the newest block, kept between writes. See write_find_location */
+struct bdl_head_cache {
+	int valid;
+	unsigned long int hintblock_position;
+
+	/* Head hint block position when the region following it was last prepared */
+	unsigned long int prepared_position;
+};
+
+/* Timestamps of new records, see bdl_set_time_source */
+struct bdl_time_source {
+	int clock;
+	int nanoseconds;
+
+	/* Newest timestamp handed out */
+	uint64_t last;
+};
+
 struct bdl_io_file {
 	FILE *file;
 	unsigned long long int size;
@@ -47,25 +73,225 @@ struct bdl_io_file {
 	unsigned long int unsynced_write_bytes;
 	void *memorymap;
 	struct bdl_io_sync_queue sync_queue;
+
+	/* Buffers for blocks read from or written to the device */
+	struct bdl_arena arena;
+
+	/* Discard regions which are taken over, see bdl_set_discard */
+	int discard;
+
+	/* Opened without write access, see BDL_SESSION_READONLY */
+	int readonly;
+
+	/* Page shared with other processes, NULL unless BDL_SESSION_SHARED was given */
+	struct bdl_shared_page *shared_page;
+	int shared_fd;
+	unsigned long int shared_size;
+	int shared_writer;
+
+	struct bdl_head_cache head_cache;
+};
+
+/* Master header at the start of a device */
+struct bdl_header {
+	uint8_t header_begin_message[32];
+
+	/* Version number to detect incompatibilities */
+	int16_t blocksystem_version;
+
+	/* Usually 0xff or 0x00 */
+	uint8_t pad_character;
+
+	/* For future use, currently 0=CRC32 */
+	uint8_t default_hash_algorithm;
+
+	/* Size of a block in bytes */
+	uint64_t block_size;
+
+	/* Total size to write after the header before we wrap */
+	uint64_t total_size;
+
+	/* Size of header including padding */
+	uint32_t header_size;
+
+	/* Hash of all parameters with hash being zero */
+	uint32_t hash;
 };
 
 /* ****
  * Struct for holding session data. Should not be modified manually.
  * ****/
+/* Upper timestamp bound and application data of records to read, see bdl_set_read_filter */
+struct bdl_read_filter {
+	uint64_t timestamp_lt;
+	uint64_t appdata_mask;
+	uint64_t appdata_value;
+};
+
 struct bdl_session {
 	struct bdl_io_file device;
 	int usercount;
+
+	/* Master header, validated on first use in the session */
+	struct bdl_header master_header;
+	int master_header_valid;
+
+	/* Compression of new records, see bdl_set_compression */
+	int compression;
+
+	struct bdl_time_source time_source;
+
+	/* Threads used when reading, see bdl_set_threads */
+	int threads;
+
+	/* Format of records read to STDOUT, see bdl_set_read_format */
+	int read_format;
+
+	/* Read newest records first, see bdl_set_read_reverse */
+	int read_reverse;
+
+	/* Records returned when reading, see bdl_set_read_filter */
+	struct bdl_read_filter read_filter;
 };
 
 /* ****
  * First run these to open device and initialize session (not close untill the end doh).
  * Multiple start_session may be called on the same session, in which the same number
  * of close commands must be called before the session is actually closed.
+ *
+ * Flags are OR'ed. BDL_SESSION_NO_MMAP reads and writes with standard IO instead of
+ * a memory map. BDL_SESSION_READONLY opens the device without write access, so any
+ * number of processes may read while one process writes. Damaged hint blocks are then
+ * not recovered on the device, their backups are used instead, and hint blocks which
+ * change while they are read are read again. Writing in such a session fails.
+ *
+ * BDL_SESSION_SHARED makes processes using the device coordinate through a small page
+ * in /dev/shm named after the device. Only one session on a device which is not
+ * read-only may have this flag at a time, and starting another one fails. The writer
+ * publishes its head in the page after each hint block update, and cursors of other
+ * processes waiting for records are woken at once. Processes not using the flag are
+ * not stopped from writing.
  * ****/
+#define BDL_SESSION_NO_MMAP			(1<<0)
+#define BDL_SESSION_READONLY		(1<<1)
+#define BDL_SESSION_SHARED			(1<<2)
+
 void bdl_init_session (struct bdl_session *session);
-int bdl_start_session (struct bdl_session *session, const char *device_path, int no_mmap);
+int bdl_start_session (struct bdl_session *session, const char *device_path, int flags);
 void bdl_close_session (struct bdl_session *session);
 
+/* ****
+ * Get the head last published in the shared page of a session started with
+ * BDL_SESSION_SHARED, without reading the device or taking any lock. The generation
+ * increases with every publish. Positions of zero mean that the head is not known,
+ * like before anything was written or after the device was cleared. *result is set
+ * to 1 if the session has no shared page or if no consistent copy could be taken.
+ * ****/
+struct bdl_shared_head {
+	uint64_t generation;
+	uint64_t hintblock_position;
+	uint64_t block_position;
+
+	/* Timestamp of the newest record */
+	uint64_t timestamp;
+
+	/* Process which has the writer lock, zero if none */
+	int writer_pid;
+};
+
+int bdl_get_shared_head (struct bdl_session *session, struct bdl_shared_head *head, int *result);
+
+/* ****
+ * Compress data of records written in this session. Records which do not get
+ * smaller are stored uncompressed. Compressed records are decompressed
+ * transparently when reading, and devices may hold both kinds. Default is
+ * BDL_COMPRESSION_NONE. Returns 1 if the compression is unknown.
+ * ****/
+#define BDL_COMPRESSION_NONE		0
+#define BDL_COMPRESSION_LZ			1
+
+int bdl_set_compression (struct bdl_session *session, int compression);
+
+/* ****
+ * Choose the clock used for timestamps of records written without one, and whether
+ * they are in nanoseconds instead of microseconds. Timestamps are always larger than
+ * the ones given out before in the session, and records written in a batch are
+ * stamped from one read of the clock. A device should always be written with the
+ * same clock and unit, or else newer records may be refused. A monotonic clock
+ * restarts at boot. Default is BDL_CLOCK_REALTIME in microseconds. Returns 1 if
+ * the clock is unknown.
+ * ****/
+#define BDL_CLOCK_REALTIME			0
+#define BDL_CLOCK_TAI				1
+#define BDL_CLOCK_MONOTONIC			2
+
+int bdl_set_time_source (struct bdl_session *session, int clock, int nanoseconds);
+
+/* ****
+ * Read with this many threads. Regions of the device are read and validated in
+ * parallel, and the records are still returned in order from the calling thread.
+ * Default is 1, which reads without starting any threads. Returns 1 if threads is
+ * less than 1. At most 64 threads are used. Without a memory map, every region read
+ * ahead has its own buffer, and threads are reduced to keep these below 256MB.
+ * ****/
+int bdl_set_threads (struct bdl_session *session, int threads);
+
+/* ****
+ * Format of records printed by bdl_read_blocks. Text lines begin with
+ * BLOCK:POSITION:TIMESTAMP:APPDATA:LENGTH:FLAGS:HASH: followed by the data and a
+ * newline. Binary records begin with struct bdl_read_binary_header in little
+ * endian followed by the data. Raw records begin with the block header like it
+ * is stored on the device followed by the data. For packed, chained and
+ * compressed blocks the header describes only the record, with those flags and
+ * the hash zero. Default is BDL_READ_FORMAT_TEXT. Returns 1 if the format is
+ * unknown.
+ * ****/
+#define BDL_READ_FORMAT_TEXT		0
+#define BDL_READ_FORMAT_BINARY		1
+#define BDL_READ_FORMAT_RAW			2
+
+struct bdl_read_binary_header {
+	uint64_t block_position;
+	uint64_t timestamp;
+	uint64_t application_data;
+	uint64_t data_length;
+	uint32_t flags;
+	uint32_t hash;
+};
+
+int bdl_set_read_format (struct bdl_session *session, int format);
+
+/* ****
+ * Read newest records first. Reading starts at the last written block and walks
+ * the device backwards, so a limit gives the newest records without going through
+ * the older ones. Records older than ts_gteq end the read. Reverse reading is done
+ * from the calling thread only. Default is 0, which reads oldest records first.
+ * ****/
+void bdl_set_read_reverse (struct bdl_session *session, int reverse);
+
+/* ****
+ * Only read records with timestamp less than timestamp_lt, 0 meaning no bound, and
+ * with application data which AND'ed with appdata_mask equals appdata_value. Reading
+ * stops at the first record at or after timestamp_lt instead of going on to the end,
+ * and blocks which cannot hold matching records are skipped without looking at their
+ * records. Used by bdl_read_blocks, bdl_read_blocks_cb and bdl_follow. Default is no
+ * filter. Returns 1 if appdata_value has bits outside of appdata_mask.
+ * ****/
+int bdl_set_read_filter (
+		struct bdl_session *session,
+		uint64_t timestamp_lt, uint64_t appdata_mask, uint64_t appdata_value
+);
+
+/* ****
+ * Discard unused space, useful for flash memory. Must be called after the session
+ * is started. When the oldest region is taken over, the blocks in it which are not
+ * overwritten yet are discarded as soon as the hint block pointing to the new
+ * blocks has been synced to the device. Clear discards all regions. Block devices
+ * get BLKDISCARD and files get holes punched. If the device does not support it, a
+ * warning is printed and discarding is turned off.
+ * ****/
+int bdl_set_discard (struct bdl_session *session, int discard);
+
 /* ****
  * Then these may be run after session is created. They return 1 on error
  * or 0 on success.
@@ -81,13 +307,155 @@ int bdl_clear_dev (struct bdl_session *session, int *result);
 /* This checks if a device is initialized and read/writeable */
 int bdl_validate_dev (struct bdl_session *session, int *result);
 
+/*
+ * The master header is validated when the session starts and is kept in the session.
+ * If the header on the device changes, it is validated again automatically. Call this
+ * to force validation.
+ */
+int bdl_revalidate_header (struct bdl_session *session, int *result);
+
+/* ****
+ * Summarize how the device is used from its hint blocks, without reading records.
+ * Only the hint block and the last block of each region are read, and the first
+ * block of the oldest region to find the oldest timestamp. If that block is damaged,
+ * the newest timestamp of the oldest region is used instead.
+ *
+ * When the head region is full, writing continues in the next region, and the
+ * records in it are overwritten if it is used. The callback may be NULL, or else it
+ * is called for every region in the order they are placed on the device. It returns
+ * 0 to continue or anything else to stop with an error. *result is set to 1 if the
+ * device is not initialized.
+ * ****/
+struct bdl_region_stats {
+	uint64_t hintblock_position;
+
+	/* Set if the region holds blocks, or else the counts are zero */
+	int used;
+	uint64_t block_count;
+
+	/* Timestamp of the last block in the region */
+	uint64_t highest_timestamp;
+};
+
+struct bdl_stats {
+	uint64_t block_size;
+	uint64_t region_count;
+
+	/* Blocks each region has room for */
+	uint64_t region_capacity;
+
+	uint64_t regions_used;
+	uint64_t regions_free;
+	uint64_t blocks_used;
+
+	/* Timestamps of the oldest and newest records, zero if the device is empty */
+	uint64_t oldest_timestamp;
+	uint64_t newest_timestamp;
+
+	/* Region and block written last, zero if the device is empty */
+	uint64_t head_hintblock_position;
+	uint64_t head_block_position;
+
+	/* Region written to when the head is full, and if this overwrites older records */
+	uint64_t next_hintblock_position;
+	int next_region_used;
+};
+
+int bdl_get_stats (
+		struct bdl_session *session,
+		struct bdl_stats *stats,
+		int (*callback)(void *arg, const struct bdl_region_stats *region),
+		void *arg,
+		int *result
+);
+
 /* Read blocks to STDOUT */
 int bdl_read_blocks (
 		struct bdl_session *session,
 		uint64_t timestamp_gteq, unsigned long int limit
 );
 
-// TODO : Read blocks to callback function
+/* ****
+ * Read records to a callback function instead of STDOUT, oldest first. The data
+ * points directly into the buffers of the library and is only valid until the
+ * callback returns. The callback returns 0 to continue, BDL_READ_BREAK to stop
+ * reading or anything else to stop with an error, in which case 1 is returned.
+ * ****/
+#define BDL_READ_BREAK				1
+
+struct bdl_read_callback_data {
+	unsigned long int block_position;
+	uint64_t timestamp;
+	uint64_t application_data;
+	uint32_t flags;
+	uint32_t hash;
+	uint64_t data_length;
+	const char *data;
+};
+
+int bdl_read_blocks_cb (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq, unsigned long int limit,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+);
+
+/* ****
+ * Read records one at a time with a cursor, oldest first. A cursor keeps its place
+ * between calls and may be used while records are written, in which case it
+ * continues with the new records. bdl_cursor_next sets *result to 0 and fills in
+ * the record, or sets it to 1 if there are no more records at the moment. The
+ * data is valid until the next call on the cursor. A session must be started before
+ * opening a cursor, and the cursor must be used from the same thread as the session.
+ *
+ * The position can be saved and restored later with another cursor on the same
+ * device. If the records after the position have been overwritten since, the cursor
+ * continues with the oldest record newer than the one returned last. A zeroed position
+ * starts at the oldest record, and bdl_cursor_seek_head moves past the newest record
+ * on the device so that only records written later are returned.
+ *
+ * bdl_cursor_wait waits until bdl_cursor_next has a record, and sets *result to 0,
+ * or sets it to 1 when timeout_ms passes first. A timeout of 0 waits forever. The
+ * device is checked every few milliseconds while waiting, and files written to
+ * with write() wake the cursor at once. So do writers of sessions started with
+ * BDL_SESSION_SHARED when the session of the cursor has this flag as well.
+ * ****/
+struct bdl_cursor;
+
+struct bdl_cursor_position {
+	uint64_t hintblock_position;
+	uint64_t block_position;
+
+	/* Timestamp of the last record returned */
+	uint64_t timestamp;
+};
+
+int bdl_cursor_open (struct bdl_session *session, uint64_t timestamp_gteq, struct bdl_cursor **cursor);
+int bdl_cursor_next (struct bdl_cursor *cursor, struct bdl_read_callback_data *record, int *result);
+void bdl_cursor_get_position (const struct bdl_cursor *cursor, struct bdl_cursor_position *position);
+int bdl_cursor_seek (struct bdl_cursor *cursor, const struct bdl_cursor_position *position);
+int bdl_cursor_seek_head (struct bdl_cursor *cursor);
+int bdl_cursor_wait (struct bdl_cursor *cursor, unsigned long int timeout_ms, int *result);
+void bdl_cursor_close (struct bdl_cursor *cursor);
+
+/* ****
+ * Follow the device and give records to the callback as they are written, like
+ * bdl_read_blocks_cb does. With from_head set, only records written after the call
+ * are given, or else the records with timestamp >= timestamp_gteq already on the
+ * device come first. Returns when the callback returns BDL_READ_BREAK or after
+ * limit records, 0 meaning no limit. bdl_follow prints records to STDOUT in the
+ * read format of the session, and does not return unless limit is set.
+ * ****/
+int bdl_follow (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq, int from_head, unsigned long int limit
+);
+int bdl_follow_cb (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq, int from_head, unsigned long int limit,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+);
 
 /* ****
  * Write a block and update hint block and backup hint block. Arguments after data_length
@@ -105,6 +473,47 @@ int bdl_write_block (
 #define BDL_WRITE_ERR_IO			4 // IO error
 #define BDL_WRITE_ERR_CORRUPT		5 // Corrupt device
 
+/* ****
+ * Write many records at once, packing as many of them as possible into each block.
+ * Records with zero timestamp get the current time, and timestamps of records must
+ * be increasing. Records which do not fit together with others are written to normal
+ * blocks. Returns > 0 on error like bdl_write_block, in which case some of the first
+ * records might have been written.
+ * ****/
+struct bdl_write_entry {
+	const char *data;
+	unsigned long int data_length;
+	uint64_t appdata;
+	uint64_t timestamp;
+};
+
+int bdl_write_blocks_packed (
+		struct bdl_session *session,
+		const struct bdl_write_entry *entries, unsigned long int entry_count,
+		unsigned long int faketimestamp
+);
+
+/* ****
+ * Write from many threads at once. Producers submit records to a lock-free queue,
+ * and a writer thread writes them in batches like bdl_write_blocks_packed, giving
+ * them timestamps in the order they were submitted. A session must be started
+ * first, and no other functions may be called on it until the writer is stopped.
+ *
+ * bdl_writer_submit copies the data and returns without waiting for the device.
+ * If the writer thread fails, records are discarded and submit and stop return
+ * the error like bdl_write_block. Stop writes all submitted records before it
+ * returns, and producers must not submit after it is called.
+ * ****/
+struct bdl_writer;
+
+int bdl_writer_start (struct bdl_session *session, struct bdl_writer **writer);
+int bdl_writer_submit (
+		struct bdl_writer *writer,
+		const char *data, unsigned long int data_length,
+		uint64_t appdata
+);
+int bdl_writer_stop (struct bdl_writer *writer);
+
 /* ****
  * Update the application data field in blocks. Specify the lowest timestamp to search,
  * and a match function which returns the below defined update struct with a new appdata
@@ -138,13 +547,25 @@ int bdl_read_update_application_data (
 /* ****
  * Initialize a new device (must be opened first with bdl_start_session). Device must
  * contain zeros at the beginning for a couple of kBs. Arguments after session may
- * be zero.
+ * be zero. Block size and header pad which are zero are chosen to align blocks and
+ * regions with the physical blocks and erase units of a block device.
  * ****/
 int bdl_init_dev (
 		struct bdl_session *session,
 		unsigned long int blocksize, unsigned long int header_pad, char padchar
 );
 
+/* ****
+ * Like bdl_init_dev, but the device does not need to be zeroed first. Anything
+ * on the device is overwritten. The start of the device and all positions of hint
+ * blocks and their backups are zeroed, by the device itself if it supports it,
+ * so that no data from an earlier structure is found after initialization.
+ * ****/
+int bdl_init_dev_force (
+		struct bdl_session *session,
+		unsigned long int blocksize, unsigned long int header_pad, char padchar
+);
+
 /* ****
  * Call commands like if they were written on the command line. Usually only
  * used from BDL command line program.
@@ -0,0 +1,124 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "../include/bdl.h"
+
+//#define BDL_DBG_ARENA
+
+void arena_init (struct bdl_arena *arena) {
+	arena->first = NULL;
+	arena->current = NULL;
+}
+
+void arena_cleanup (struct bdl_arena *arena) {
+	struct bdl_arena_chunk *chunk = arena->first;
+	while (chunk != NULL) {
+		struct bdl_arena_chunk *next = chunk->next;
+		free (chunk->data);
+		free (chunk);
+		chunk = next;
+	}
+
+	arena_init (arena);
+}
+
+struct bdl_arena_chunk *arena_new_chunk (unsigned long int size) {
+	struct bdl_arena_chunk *chunk = malloc (sizeof(*chunk));
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	if (size < BDL_ARENA_CHUNK_SIZE) {
+		size = BDL_ARENA_CHUNK_SIZE;
+	}
+
+	if (posix_memalign ((void **) &chunk->data, BDL_ARENA_ALIGNMENT, size) != 0) {
+		free (chunk);
+		return NULL;
+	}
+
+#ifdef BDL_DBG_ARENA
+	printf ("Arena allocated new chunk of %lu bytes\n", size);
+#endif
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+void *arena_alloc (struct bdl_arena *arena, unsigned long int size) {
+	size = (size + BDL_ARENA_ALIGNMENT - 1) & ~((unsigned long int) BDL_ARENA_ALIGNMENT - 1);
+
+	struct bdl_arena_chunk *chunk = arena->current;
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		struct bdl_arena_chunk **next = (chunk == NULL ? &arena->first : &chunk->next);
+
+		// Chunks after the current one are unused, replace them if they are too small
+		while (*next != NULL && (*next)->size < size) {
+			struct bdl_arena_chunk *small = *next;
+			*next = small->next;
+			free (small->data);
+			free (small);
+		}
+
+		if (*next == NULL) {
+			if ((*next = arena_new_chunk (size)) == NULL) {
+				fprintf (stderr, "Could not allocate %lu bytes of memory for arena\n", size);
+				return NULL;
+			}
+		}
+
+		chunk = *next;
+		arena->current = chunk;
+	}
+
+	void *ret = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ret;
+}
+
+void arena_get_mark (const struct bdl_arena *arena, struct bdl_arena_mark *mark) {
+	mark->chunk = arena->current;
+	mark->used = (arena->current != NULL ? arena->current->used : 0);
+}
+
+void arena_release (struct bdl_arena *arena, const struct bdl_arena_mark *mark) {
+	struct bdl_arena_chunk *chunk = (mark->chunk == NULL ? arena->first : mark->chunk->next);
+
+	for (; chunk != NULL; chunk = chunk->next) {
+		chunk->used = 0;
+	}
+
+	if (mark->chunk != NULL) {
+		mark->chunk->used = mark->used;
+	}
+
+	arena->current = mark->chunk;
+}
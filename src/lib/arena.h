@@ -0,0 +1,58 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_ARENA_H
+#define BDL_ARENA_H
+
+#include "../include/bdl.h"
+
+/*
+ * Scratch memory for block buffers. Memory is taken from large chunks which are
+ * kept until the arena is cleaned up. Get a mark before allocating and release
+ * it when the buffers are no longer needed, everything allocated after the mark
+ * is then freed at once. Marks must be released in reverse order.
+ */
+
+/* Smallest chunk to allocate */
+#define BDL_ARENA_CHUNK_SIZE (256 * 1024)
+
+/* All allocations are aligned to this */
+#define BDL_ARENA_ALIGNMENT 16
+
+struct bdl_arena_chunk {
+	struct bdl_arena_chunk *next;
+	unsigned long int size;
+	unsigned long int used;
+	char *data;
+};
+
+struct bdl_arena_mark {
+	struct bdl_arena_chunk *chunk;
+	unsigned long int used;
+};
+
+void arena_init (struct bdl_arena *arena);
+void arena_cleanup (struct bdl_arena *arena);
+void *arena_alloc (struct bdl_arena *arena, unsigned long int size);
+void arena_get_mark (const struct bdl_arena *arena, struct bdl_arena_mark *mark);
+void arena_release (struct bdl_arena *arena, const struct bdl_arena_mark *mark);
+
+#endif
@@ -19,8 +19,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
-#include <sys/time.h>
+#include <time.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <errno.h>
@@ -28,23 +29,97 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 
 #include "bdltime.h"
+#include "defaults.h"
+#include "../include/bdl.h"
 
 //#define DBL_DBG_TIME
 
-uint64_t time_get_64() {
-	struct timeval tv;
-	double time_tmp;
+uint64_t time_read_clock(clockid_t clock, int nanoseconds) {
+	struct timespec ts;
 
-	if (gettimeofday(&tv, NULL) != 0) {
+	if (clock_gettime(clock, &ts) != 0) {
 		fprintf (stderr, "Error while getting time, cannot recover from this: %s\n", strerror(errno));
 		exit (EXIT_FAILURE);
 	}
 
-	time_tmp = (tv.tv_sec * 1000000.0) + (tv.tv_usec);
+	// Integer arithmetic, precision is not lost for large values
+	uint64_t time_tmp = (nanoseconds ?
+			(uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec :
+			(uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000
+	);
 
 #ifdef DBL_DBG_TIME
-	printf ("Get time: %lf\n", time_tmp);
+	printf ("Get time: %" PRIu64 "\n", time_tmp);
 #endif
 
 	return time_tmp;
 }
+
+uint64_t time_get_64() {
+	return time_read_clock(CLOCK_REALTIME, 0);
+}
+
+/* For measuring elapsed time, steps of the wall clock don't affect it */
+uint64_t time_get_monotonic_64() {
+	return time_read_clock(CLOCK_MONOTONIC, 0);
+}
+
+void time_source_init (struct bdl_time_source *source) {
+	source->clock = BDL_CLOCK_REALTIME;
+	source->nanoseconds = 0;
+	source->last = 0;
+}
+
+int time_source_set (struct bdl_time_source *source, int clock, int nanoseconds) {
+	if (clock != BDL_CLOCK_REALTIME && clock != BDL_CLOCK_TAI && clock != BDL_CLOCK_MONOTONIC) {
+		fprintf (stderr, "Unknown clock %i\n", clock);
+		return 1;
+	}
+
+	source->clock = clock;
+	source->nanoseconds = (nanoseconds != 0);
+
+	// Values from another clock or unit can't be compared
+	source->last = 0;
+
+	return 0;
+}
+
+/*
+ * Get the first of count consecutive timestamps from one read of the clock. Timestamps
+ * are always larger than those handed out earlier, ties caused by the resolution of
+ * the clock are solved by bumping. If newest is slightly ahead of the clock, like when
+ * another process wrote a record during the same tick, the timestamps are also placed
+ * after it. If the clock is further behind, the caller must detect it.
+ */
+uint64_t time_source_get (struct bdl_time_source *source, unsigned long int count, uint64_t newest) {
+	clockid_t clock = CLOCK_REALTIME;
+	if (source->clock == BDL_CLOCK_TAI) {
+		clock = CLOCK_TAI;
+	}
+	else if (source->clock == BDL_CLOCK_MONOTONIC) {
+		clock = CLOCK_MONOTONIC;
+	}
+
+	uint64_t timestamp = time_read_clock(clock, source->nanoseconds);
+
+	if (timestamp <= source->last) {
+		timestamp = source->last + 1;
+	}
+
+	uint64_t tolerance = BDL_TIME_TIE_TOLERANCE * (source->nanoseconds ? 1000 : 1);
+	if (timestamp <= newest && newest - timestamp < tolerance) {
+		timestamp = newest + 1;
+	}
+
+	time_source_update (source, timestamp + (count > 0 ? count - 1 : 0));
+
+	return timestamp;
+}
+
+/* Timestamps handed out later will be larger than this one */
+void time_source_update (struct bdl_time_source *source, uint64_t timestamp) {
+	if (timestamp > source->last) {
+		source->last = timestamp;
+	}
+}
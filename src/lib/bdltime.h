@@ -19,6 +19,18 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#ifndef BDL_TIME_H
+#define BDL_TIME_H
+
 #include <stdint.h>
 
+#include "../include/bdl.h"
+
 uint64_t time_get_64();
+uint64_t time_get_monotonic_64();
+void time_source_init (struct bdl_time_source *source);
+int time_source_set (struct bdl_time_source *source, int clock, int nanoseconds);
+uint64_t time_source_get (struct bdl_time_source *source, unsigned long int count, uint64_t newest);
+void time_source_update (struct bdl_time_source *source, uint64_t timestamp);
+
+#endif
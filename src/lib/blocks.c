@@ -21,13 +21,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <endian.h>
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include "../include/bdl.h"
 #include "blocks.h"
+#include "arena.h"
 #include "defaults.h"
 #include "crypt.h"
 #include "io.h"
@@ -43,23 +47,36 @@ int block_hintblock_get_last_block (
 		struct bdl_block_header *block,
 		int *result
 ) {
-	char temp_block_data[master_header->block_size];
-	struct bdl_block_header *block_tmp = (struct bdl_block_header *) temp_block_data;
+	int ret = 0;
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&file->arena, &mark);
 
 	*result = 1;
+
+	char *temp_block_data = arena_alloc (&file->arena, master_header->block_size);
+	if (temp_block_data == NULL) {
+		fprintf (stderr, "Could not allocate block buffer while getting last block\n");
+		ret = 1;
+		goto out;
+	}
+
 	if (io_read_block (file, state->hintblock.previous_block_pos, temp_block_data, master_header->block_size) != 0) {
-		fprintf (stderr, "Could not read block at %i\n", (int)state->hintblock.previous_block_pos);
-		return 1;
+		fprintf (stderr, "Could not read block at %lu\n", (unsigned long int) state->hintblock.previous_block_pos);
+		ret = 1;
+		goto out;
 	}
 
 	if (validate_block(temp_block_data, master_header, result) != 0) {
 		*result = 1;
-		return 0;
+		goto out;
 	}
 
 	memcpy (block, temp_block_data, sizeof(*block));
 
-	return 0;
+	out:
+	arena_release (&file->arena, &mark);
+	return ret;
 }
 
 int block_get_validate_block (
@@ -146,7 +163,7 @@ int block_hintblock_recover_backup (
 			state->hintblock.previous_block_pos,
 			state->hintblock.previous_tagged_block_pos,
 			state->location,
-			state->location - BDL_HINTBLOCK_BACKUP_POSITION,
+			state->backup_location,
 			master_header
 	) != 0) {
 		*result = 1;
@@ -159,7 +176,7 @@ int block_hintblock_recover_backup (
 	return 0;
 }
 
-int block_get_hintblock_state (
+int block_get_hintblock_state_once (
 		struct bdl_io_file *file,
 		unsigned long int pos,
 		const struct bdl_header *master_header,
@@ -180,7 +197,18 @@ int block_get_hintblock_state (
 		return 1;
 	}
 
-	if (result != 0) {
+	if (result != 0 && file->readonly) {
+		// Devices opened read-only are not repaired, the backup is used as it is
+		if (block_get_valid_hintblock(file, state->backup_location, master_header, &state->hintblock, &result) != 0) {
+			fprintf (stderr, "Error while reading backup hint block area at %lu\n", state->backup_location);
+			return 1;
+		}
+
+		if (result != 0) {
+			return 0;
+		}
+	}
+	else if (result != 0) {
 		if (block_hintblock_recover_backup(file, master_header, state, &result) != 0) {
 			fprintf (stderr, "Error while recovering hintblock backup while getting hintblock state\n");
 			return 1;
@@ -196,11 +224,11 @@ int block_get_hintblock_state (
 			return 0;
 		}
 	}
-	else if (state->hintblock.previous_block_pos > blockstart_max || state->hintblock.previous_block_pos < blockstart_min) {
+
+	if (state->hintblock.previous_block_pos > blockstart_max || state->hintblock.previous_block_pos < blockstart_min) {
 		return 0;
 	}
 
-
 	int block_result;
 	struct bdl_block_header block;
 	if (block_hintblock_get_last_block (file, state, master_header, &block, &block_result) != 0) {
@@ -222,6 +250,124 @@ int block_get_hintblock_state (
 	return 0;
 }
 
+/*
+ * Reads the hint block from the device itself and not from the stdio buffer, which
+ * also makes the reads following it see the device as it is now.
+ */
+int block_read_hintblock_fresh (
+		struct bdl_io_file *file,
+		unsigned long int pos,
+		struct bdl_hint_block *hintblock
+) {
+	char *data;
+
+	if (io_refresh (file) != 0 || io_read_block_concurrent (file, pos, (char *) hintblock, sizeof(*hintblock), &data) != 0) {
+		fprintf (stderr, "Error while reading hint block area at %lu\n", pos);
+		return 1;
+	}
+
+	if (data != (char *) hintblock) {
+		memcpy (hintblock, data, sizeof(*hintblock));
+	}
+
+	return 0;
+}
+
+/*
+ * A writer in another process may update the region while we look at it, and then the
+ * hint block and the block it points to might not agree. The state is read again if
+ * the hint block changed meanwhile. Only read-only sessions run beside a writer, as
+ * shared sessions which are not read-only hold the writer lock of the device.
+ */
+int block_get_hintblock_state (
+		struct bdl_io_file *file,
+		unsigned long int pos,
+		const struct bdl_header *master_header,
+		unsigned long int blockstart_min,
+		unsigned long int blockstart_max,
+		struct bdl_hintblock_state *state
+) {
+	if (!file->readonly) {
+		return block_get_hintblock_state_once (file, pos, master_header, blockstart_min, blockstart_max, state);
+	}
+
+	for (int attempt = 1; ; attempt++) {
+		struct bdl_hint_block before;
+		struct bdl_hint_block after;
+
+		if (block_read_hintblock_fresh (file, pos, &before) != 0) {
+			return 1;
+		}
+
+		if (block_get_hintblock_state_once (file, pos, master_header, blockstart_min, blockstart_max, state) != 0) {
+			return 1;
+		}
+
+		if (state->valid == 1 || attempt == BDL_HINTBLOCK_READ_ATTEMPTS) {
+			break;
+		}
+
+		if (block_read_hintblock_fresh (file, pos, &after) != 0) {
+			return 1;
+		}
+
+		if (memcmp (&before, &after, sizeof(before)) == 0) {
+			break;
+		}
+
+#ifdef BDL_DBG_BLOCKS
+		printf ("Hint block at %lu changed while reading it, reading again\n", pos);
+#endif
+	}
+
+	return 0;
+}
+
+/* Get the state of the region ending with the hint block at pos, like the hint block loop does */
+int block_get_region_state (
+		struct bdl_io_file *file,
+		unsigned long int pos,
+		const struct bdl_header *master_header,
+		struct bdl_hintblock_state *state
+) {
+	return block_get_hintblock_state (
+			file, pos, master_header,
+			pos - BDL_DEFAULT_HINTBLOCK_SPACING + master_header->block_size,
+			pos - master_header->block_size,
+			state
+	);
+}
+
+/* Position of the hint block of the region following the one at pos, wraps to the first region */
+unsigned long int block_next_hintblock_position (
+		const struct bdl_io_file *file,
+		const struct bdl_header *master_header,
+		unsigned long int pos
+) {
+	unsigned long int next = pos + BDL_DEFAULT_HINTBLOCK_SPACING;
+
+	if (next >= file->size) {
+		next = master_header->header_size + BDL_DEFAULT_HINTBLOCK_SPACING;
+	}
+
+	return next;
+}
+
+/* Position of the hint block of the region preceding the one at pos, wraps to the last region */
+unsigned long int block_previous_hintblock_position (
+		const struct bdl_io_file *file,
+		const struct bdl_header *master_header,
+		unsigned long int pos
+) {
+	unsigned long int first = master_header->header_size + BDL_DEFAULT_HINTBLOCK_SPACING;
+
+	if (pos > first) {
+		return pos - BDL_DEFAULT_HINTBLOCK_SPACING;
+	}
+
+	return first + ((file->size - 1 - first) / BDL_DEFAULT_HINTBLOCK_SPACING) * BDL_DEFAULT_HINTBLOCK_SPACING;
+}
+
 int block_loop_hintblocks_worker (
 		struct bdl_io_file *file,
 		const struct bdl_header *header,
@@ -426,6 +572,110 @@ int block_loop_blocks (
 	return 0;
 }
 
+/* Position of the block following the given block inside a region */
+unsigned long int block_next_position (
+	const struct bdl_hintblock_state *state,
+	const struct bdl_header *header,
+	unsigned long int position
+) {
+	position += header->block_size;
+
+	if (position == state->backup_location) {
+		position += header->block_size;
+	}
+
+	return position;
+}
+
+/* Position of the block preceding the given block inside a region, less than blockstart_min if there is none */
+unsigned long int block_previous_position (
+	const struct bdl_hintblock_state *state,
+	const struct bdl_header *header,
+	unsigned long int position
+) {
+	position -= header->block_size;
+
+	if (position == state->backup_location) {
+		position -= header->block_size;
+	}
+
+	return position;
+}
+
+/* Number of blocks inside one region, the hint block and its backup excluded */
+unsigned long int block_region_capacity (const struct bdl_header *header) {
+	return (BDL_DEFAULT_HINTBLOCK_SPACING / header->block_size) - 2;
+}
+
+/* Hash a block header with the hash being zero followed by data, without copying the data */
+int block_hash (
+	const struct bdl_block_header *header,
+	const char *data, unsigned long int data_length,
+	uint8_t algorithm,
+	uint32_t *dest
+) {
+	const uint32_t zero_hash = 0;
+	struct crypt_hash_state state;
+
+	if (crypt_hash_init (&state, algorithm) != 0) {
+		return 1;
+	}
+
+	// The hash is the last field of the header
+	crypt_hash_update (&state, (const char *) header, offsetof(struct bdl_block_header, hash));
+	crypt_hash_update (&state, (const char *) &zero_hash, sizeof(zero_hash));
+	crypt_hash_update (&state, data, data_length);
+	crypt_hash_final (&state, dest);
+
+	return 0;
+}
+
+/*
+ * Update the hash of a block after length bytes at offset have been changed from old_data to
+ * new_data, without reading the rest of the block. The offset counts from the start of the
+ * block header. The hash is read from and written back to *hash, which allows more than one
+ * change to be applied. Returns 1 if the hash algorithm cannot do this.
+ */
+int block_hash_patch (
+	const struct bdl_block_header *header,
+	unsigned long int offset,
+	const char *old_data, const char *new_data, unsigned long int length,
+	uint8_t algorithm,
+	uint32_t *hash
+) {
+	unsigned long int total_length = sizeof(*header) + header->data_length;
+	char xor_data[32];
+
+	if (offset + length > total_length) {
+		fprintf (stderr, "Bug: Hash patch outside of block in block_hash_patch\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (offset < sizeof(*header) && offset + length > offsetof(struct bdl_block_header, hash)) {
+		fprintf (stderr, "Bug: Hash patch overlaps hash field in block_hash_patch\n");
+		exit (EXIT_FAILURE);
+	}
+
+	while (length > 0) {
+		unsigned long int chunk = (length > sizeof(xor_data) ? sizeof(xor_data) : length);
+
+		for (unsigned long int i = 0; i < chunk; i++) {
+			xor_data[i] = old_data[i] ^ new_data[i];
+		}
+
+		if (crypt_hash_patch (algorithm, hash, xor_data, chunk, total_length - offset - chunk) != 0) {
+			return 1;
+		}
+
+		offset += chunk;
+		old_data += chunk;
+		new_data += chunk;
+		length -= chunk;
+	}
+
+	return 0;
+}
+
 int block_get_validate_master_header(struct bdl_io_file *file, struct bdl_header *header, int *result) {
 	if (io_read_block(file, 0, (char *) header, sizeof(*header)) != 0) {
 		fprintf (stderr, "Error while reading header from file\n");
@@ -440,44 +690,155 @@ int block_get_validate_master_header(struct bdl_io_file *file, struct bdl_header
 	return 0;
 }
 
-void block_dump (const struct bdl_block_header *header, unsigned long int position, const char *data) {
-	char buf[1024 + header->data_length];
-
-	int bytes = snprintf (buf, 1024,
-			"BLOCK:%lu:%" PRIu64 ":%" PRIu64 ":%" PRIu64 ":%" PRIu32 ":%" PRIu32 ":",
-			position,
-			header->timestamp,
-			header->application_data,
-			header->data_length,
-			header->pad,
-			header->hash
-	);
-	if (bytes >= 1024 - 1) {
-		fprintf (stderr, "Bug: Block dump buffer got full\n");
-		exit (EXIT_FAILURE);
+int block_dump_init (struct bdl_dump_buffer *buffer, int fd, int format) {
+	buffer->fd = fd;
+	buffer->format = format;
+	buffer->length = 0;
+	buffer->size = BDL_DUMP_BUFFER_SIZE;
+	buffer->data = malloc (buffer->size);
+
+	if (buffer->data == NULL) {
+		fprintf (stderr, "Could not allocate buffer for block dump\n");
+		return 1;
 	}
 
-	memcpy(buf + bytes, data, header->data_length);
+	return 0;
+}
 
-	/* TODO this writing stuff is probably slow (if it matters) */
+void block_dump_cleanup (struct bdl_dump_buffer *buffer) {
+	free (buffer->data);
+	buffer->data = NULL;
+	buffer->length = 0;
+}
+
+/* Write everything, continuing after partial writes */
+int block_dump_writev (int fd, struct iovec *iov, int count) {
+	// Text printed by others must come first
 	if (fflush(stdout) != 0) {
 		fprintf (stderr, "Error while flushing stdout buffer: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+		return 1;
 	}
 
-	buf[bytes + header->data_length] = '\n';
-	bytes++;
+	while (count > 0) {
+		ssize_t res = writev (fd, iov, count);
 
-	int res = write (fileno(stdout), buf, bytes + header->data_length);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf (stderr, "Error while writing block data: %s\n", strerror(errno));
+			return 1;
+		}
+
+		while (count > 0 && (size_t) res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
 
-	if (res == -1) {
-		fprintf (stderr, "Error while write block data to stdout: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+		if (count > 0) {
+			iov->iov_base = (char *) iov->iov_base + res;
+			iov->iov_len -= res;
+		}
 	}
-	if (res != bytes + header->data_length) {
-		fprintf (stderr, "Did not write all block data bytes for some reason\n");
-		exit(EXIT_FAILURE);
+
+	return 0;
+}
+
+int block_dump_flush (struct bdl_dump_buffer *buffer) {
+	if (buffer->length == 0) {
+		return 0;
 	}
+
+	struct iovec iov[1];
+	iov[0].iov_base = buffer->data;
+	iov[0].iov_len = buffer->length;
+
+	buffer->length = 0;
+
+	return block_dump_writev (buffer->fd, iov, 1);
+}
+
+/*
+ * Records are formatted into the buffer, which is written when it gets full. Data which
+ * does not fit is written directly from where it is together with the buffer.
+ */
+int block_dump (struct bdl_dump_buffer *buffer, const struct bdl_block_header *header, unsigned long int position, const char *data) {
+	if (buffer->size - buffer->length < BDL_DUMP_HEADER_MAX && block_dump_flush (buffer) != 0) {
+		return 1;
+	}
+
+	char *pos = buffer->data + buffer->length;
+	int bytes = 0;
+
+	// Only text lines are terminated
+	int terminator_length = 0;
+
+	if (buffer->format == BDL_READ_FORMAT_BINARY) {
+		struct bdl_read_binary_header binary_header;
+		binary_header.block_position = htole64(position);
+		binary_header.timestamp = htole64(header->timestamp);
+		binary_header.application_data = htole64(header->application_data);
+		binary_header.data_length = htole64(header->data_length);
+		binary_header.flags = htole32(header->flags);
+		binary_header.hash = htole32(header->hash);
+
+		memcpy (pos, &binary_header, sizeof(binary_header));
+		bytes = sizeof(binary_header);
+	}
+	else if (buffer->format == BDL_READ_FORMAT_RAW) {
+		struct bdl_block_header raw_header = *header;
+
+		/* The data is a single uncompressed record, and the hash of the block
+		 * does not cover it if it had to be unpacked or decompressed */
+		if ((raw_header.flags & BDL_BLOCK_FLAGS_ALL) != 0) {
+			raw_header.flags &= ~BDL_BLOCK_FLAGS_ALL;
+			raw_header.hash = 0;
+		}
+
+		memcpy (pos, &raw_header, sizeof(raw_header));
+		bytes = sizeof(raw_header);
+	}
+	else {
+		bytes = snprintf (pos, BDL_DUMP_HEADER_MAX,
+				"BLOCK:%lu:%" PRIu64 ":%" PRIu64 ":%" PRIu64 ":%" PRIu32 ":%" PRIu32 ":",
+				position,
+				header->timestamp,
+				header->application_data,
+				header->data_length,
+				header->flags,
+				header->hash
+		);
+		if (bytes >= BDL_DUMP_HEADER_MAX - 1) {
+			fprintf (stderr, "Bug: Block dump buffer got full\n");
+			exit (EXIT_FAILURE);
+		}
+		terminator_length = 1;
+	}
+
+	buffer->length += bytes;
+
+	if (header->data_length + terminator_length <= buffer->size - buffer->length) {
+		memcpy (buffer->data + buffer->length, data, header->data_length);
+		buffer->length += header->data_length;
+		if (terminator_length > 0) {
+			buffer->data[buffer->length] = '\n';
+			buffer->length++;
+		}
+		return 0;
+	}
+
+	struct iovec iov[3];
+	iov[0].iov_base = buffer->data;
+	iov[0].iov_len = buffer->length;
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = header->data_length;
+	iov[2].iov_base = "\n";
+	iov[2].iov_len = terminator_length;
+
+	buffer->length = 0;
+
+	return block_dump_writev (buffer->fd, iov, (terminator_length > 0 ? 3 : 2));
 }
 
 struct block_find_smallest_hintblock_loop_data {
@@ -493,8 +854,9 @@ int block_find_oldest_hintblock_loop_callback (
 	struct block_find_smallest_hintblock_loop_data *loop_data = (struct block_find_smallest_hintblock_loop_data *) data->argument_ptr;
 	const struct bdl_hintblock_state *state = &data->location->hintblock_state;
 
+	// Unused or damaged regions are passed over, valid ones may follow them
 	if (state->valid != 1) {
-		*result = BDL_BLOCK_LOOP_BREAK;
+		*result = BDL_BLOCK_LOOP_OK;
 		return 0;
 	}
 
@@ -542,3 +904,60 @@ int block_find_oldest_hintblock (
 
 	return 0;
 }
+
+struct block_find_largest_hintblock_loop_data {
+	uint64_t largest_timestamp;
+	struct bdl_hintblock_state largest_state;
+};
+
+int block_find_newest_hintblock_loop_callback (
+	struct bdl_hintblock_loop_callback_data *data,
+	int *result
+) {
+	struct block_find_largest_hintblock_loop_data *loop_data = (struct block_find_largest_hintblock_loop_data *) data->argument_ptr;
+	const struct bdl_hintblock_state *state = &data->location->hintblock_state;
+
+	// The head might come after a region with a damaged hint block
+	if (state->valid != 1) {
+		*result = BDL_BLOCK_LOOP_OK;
+		return 0;
+	}
+
+	if (state->highest_timestamp > loop_data->largest_timestamp) {
+		loop_data->largest_timestamp = state->highest_timestamp;
+		loop_data->largest_state = *state;
+	}
+
+	return 0;
+}
+
+/* Find the region holding the most recently written block, location is not valid if the device is empty */
+int block_find_newest_hintblock (
+	struct bdl_io_file *device,
+	const struct bdl_header *master_header,
+	struct bdl_block_location *location,
+	int *result
+) {
+	struct block_find_largest_hintblock_loop_data loop_data;
+
+	memset (&loop_data.largest_state, '\0', sizeof(loop_data.largest_state));
+	loop_data.largest_timestamp = 0;
+
+	struct bdl_hintblock_loop_callback_data callback_data;
+	callback_data.argument_int = 0;
+	callback_data.argument_ptr = (void*) &loop_data;
+
+	if (block_loop_hintblocks_large_device (
+			device, master_header, NULL,
+			block_find_newest_hintblock_loop_callback, &callback_data,
+			location,
+			result
+	) != 0) {
+		fprintf (stderr, "Error while looping hintblocks while finding newest hint block\n");
+		return 1;
+	}
+
+	location->hintblock_state = loop_data.largest_state;
+
+	return 0;
+}
@@ -30,32 +30,31 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define BDL_BLOCK_LOOP_ERR		1
 #define BDL_BLOCK_LOOP_BREAK	2
 
-struct bdl_io_file;
-
-struct bdl_header {
-	uint8_t header_begin_message[32];
-
-	/* Version number to detect incompatibilities */
-	int16_t blocksystem_version;
-
-	/* Usually 0xff or 0x00 */
-	uint8_t pad_character;
+/* Flags in the block header. A block without flags holds a single record. */
+#define BDL_BLOCK_FLAG_PACKED			(1<<0)
 
-	/* For future use, currently 0=CRC32 */
-	uint8_t default_hash_algorithm;
+/*
+ * Records too large for one block are split into a chain of blocks written after
+ * each other inside one region. All blocks in a chain have the same timestamp and
+ * application data, and each has exactly one of these flags set.
+ */
+#define BDL_BLOCK_FLAG_CHAIN_FIRST		(1<<1)
+#define BDL_BLOCK_FLAG_CHAIN_CONTINUE	(1<<2)
+#define BDL_BLOCK_FLAG_CHAIN_LAST		(1<<3)
 
-	/* Size of a block in bytes */
-	uint64_t block_size;
+#define BDL_BLOCK_FLAGS_CHAIN	(BDL_BLOCK_FLAG_CHAIN_FIRST|BDL_BLOCK_FLAG_CHAIN_CONTINUE|BDL_BLOCK_FLAG_CHAIN_LAST)
 
-	/* Total size to write after the header before we wrap */
-	uint64_t total_size;
+/*
+ * Record data is compressed, see struct bdl_compressed_header. Headers and the
+ * directory of packed blocks are never compressed. All blocks of a chain carry
+ * the flag, and the chain is decompressed after it has been put back together.
+ */
+#define BDL_BLOCK_FLAG_COMPRESSED_LZ	(1<<4)
 
-	/* Size of header including padding */
-	uint32_t header_size;
+#define BDL_BLOCK_FLAGS_COMPRESSED	(BDL_BLOCK_FLAG_COMPRESSED_LZ)
+#define BDL_BLOCK_FLAGS_ALL		(BDL_BLOCK_FLAG_PACKED|BDL_BLOCK_FLAGS_CHAIN|BDL_BLOCK_FLAGS_COMPRESSED)
 
-	/* Hash of all parameters with hash being zero */
-	uint32_t hash;
-};
+struct bdl_io_file;
 
 struct bdl_block_header {
 	uint64_t timestamp;
@@ -66,13 +65,49 @@ struct bdl_block_header {
 	/* Length of actual data, the rest up to the block size defined in the header is padded */
 	uint64_t data_length;
 
-	/* Future use? */
-	uint32_t pad;
+	/* Block type, see BDL_BLOCK_FLAG_* */
+	uint32_t flags;
 
 	/* Hash of header and data with hash itself being zero */
 	uint32_t hash;
 };
 
+/*
+ * The data of a packed block starts with this header followed by one directory
+ * entry per record. The data of the records follow the directory in the same order.
+ * The timestamp of a packed block is the timestamp of its newest record, and the
+ * application data of the block is all application data of the records OR'ed.
+ */
+struct bdl_packed_header {
+	uint32_t record_count;
+
+	/* Future use? */
+	uint32_t pad;
+};
+
+struct bdl_packed_record {
+	/* Subtract from the timestamp of the block to get the timestamp of the record */
+	uint32_t timestamp_delta;
+
+	/* Length of data of this record */
+	uint32_t data_length;
+
+	/* Usable for applications */
+	uint64_t application_data;
+};
+
+/*
+ * Compressed record data starts with this header. In packed blocks it is placed
+ * after the directory and covers the data of all records.
+ */
+struct bdl_compressed_header {
+	/* Length of data after decompression */
+	uint32_t data_length;
+
+	/* Future use? */
+	uint32_t pad;
+};
+
 struct bdl_hint_block {
 	uint64_t previous_block_pos;
 
@@ -119,6 +154,15 @@ struct bdl_hintblock_loop_callback_data {
 	unsigned long int blockstart_max;
 };
 
+/* Output of block_dump is collected here */
+struct bdl_dump_buffer {
+	int fd;
+	int format;
+	char *data;
+	unsigned long int size;
+	unsigned long int length;
+};
+
 struct bdl_block_loop_callback_data {
 	// May be initialized before looping, not used by the loop
 	int argument_int;
@@ -131,7 +175,7 @@ struct bdl_block_loop_callback_data {
 
 	unsigned long int block_position;
 	const struct bdl_block_header *block;
-	const char *block_data;
+	char *block_data;
 };
 
 int block_get_valid_hintblock (
@@ -171,8 +215,71 @@ int block_find_oldest_hintblock (
 	struct bdl_block_location *location,
 	int *result
 );
+int block_find_newest_hintblock (
+	struct bdl_io_file *device,
+	const struct bdl_header *master_header,
+	struct bdl_block_location *location,
+	int *result
+);
+
+int block_get_region_state (
+	struct bdl_io_file *file,
+	unsigned long int pos,
+	const struct bdl_header *master_header,
+	struct bdl_hintblock_state *state
+);
+unsigned long int block_next_hintblock_position (
+	const struct bdl_io_file *file,
+	const struct bdl_header *master_header,
+	unsigned long int pos
+);
+unsigned long int block_previous_hintblock_position (
+	const struct bdl_io_file *file,
+	const struct bdl_header *master_header,
+	unsigned long int pos
+);
+unsigned long int block_next_position (
+	const struct bdl_hintblock_state *state,
+	const struct bdl_header *header,
+	unsigned long int position
+);
+unsigned long int block_previous_position (
+	const struct bdl_hintblock_state *state,
+	const struct bdl_header *header,
+	unsigned long int position
+);
+unsigned long int block_region_capacity (const struct bdl_header *header);
+int block_hash (
+	const struct bdl_block_header *header,
+	const char *data, unsigned long int data_length,
+	uint8_t algorithm,
+	uint32_t *dest
+);
+int block_hash_patch (
+	const struct bdl_block_header *header,
+	unsigned long int offset,
+	const char *old_data, const char *new_data, unsigned long int length,
+	uint8_t algorithm,
+	uint32_t *hash
+);
+
+int block_get_validate_block (
+	struct bdl_io_file *file,
+	unsigned long int pos,
+	const struct bdl_header *master_header,
+
+	char *buf,
+	unsigned long int data_length,
+	struct bdl_block_header **block_header,
+	char **data,
+
+	int *result
+);
 
 int block_get_validate_master_header(struct bdl_io_file *file, struct bdl_header *header, int *result);
-void block_dump (const struct bdl_block_header *header, unsigned long int position, const char *data);
+int block_dump_init (struct bdl_dump_buffer *buffer, int fd, int format);
+void block_dump_cleanup (struct bdl_dump_buffer *buffer);
+int block_dump_flush (struct bdl_dump_buffer *buffer);
+int block_dump (struct bdl_dump_buffer *buffer, const struct bdl_block_header *header, unsigned long int position, const char *data);
 
 #endif
@@ -27,6 +27,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "clear.h"
 #include "blocks.h"
 #include "write.h"
+#include "defaults.h"
 
 int clear_hintblocks_loop_callback (
 		struct bdl_hintblock_loop_callback_data *data,
@@ -35,39 +36,34 @@ int clear_hintblocks_loop_callback (
 	struct bdl_hint_block new_hintblock;
 	memset (&new_hintblock, '\0', sizeof(new_hintblock));
 
+	// The backup must also be blanked, or else it is recovered
 	if (write_put_and_pad_block (
 			data->file,
 			data->hintblock_position,
 			(const char *) &new_hintblock, sizeof(new_hintblock),
 			data->master_header->pad_character, data->master_header->block_size
+	) != 0 || write_put_and_pad_block (
+			data->file,
+			data->location->hintblock_state.backup_location,
+			(const char *) &new_hintblock, sizeof(new_hintblock),
+			data->master_header->pad_character, data->master_header->block_size
 	) != 0)  {
 		fprintf (stderr, "Error while putting blank hint block\n");
 		*result = BDL_BLOCK_LOOP_ERR;
 		return 1;
 	}
+
 	return BDL_BLOCK_LOOP_OK;
 }
 
-int clear_dev(struct bdl_io_file *file, int *result) {
-	struct bdl_header master_header;
-
-	if (block_get_validate_master_header(file, &master_header, result) != 0) {
-		fprintf (stderr, "Could not validate master header while reading it for clearing\n");
-		return 1;
-	}
-
-	if (*result != 0) {
-		fprintf (stderr, "Header was not valid, device must be initialized.\n");
-		return 0;
-	}
-
+int clear_dev(struct bdl_io_file *file, const struct bdl_header *master_header, int *result) {
 	struct bdl_hintblock_loop_callback_data callback_data;
 	struct bdl_block_location location;
 	callback_data.argument_int = 0;
 	callback_data.argument_ptr = NULL;
 
 	if (block_loop_hintblocks_large_device (
-			file, &master_header, NULL,
+			file, master_header, NULL,
 			clear_hintblocks_loop_callback, &callback_data,
 			&location,
 			result
@@ -76,5 +72,19 @@ int clear_dev(struct bdl_io_file *file, int *result) {
 		return 1;
 	}
 
+	if (file->discard == 0) {
+		return 0;
+	}
+
+	// All blocks are unreachable now, sync the blank hint blocks once and discard every region
+	if (io_sync_durable (file) != 0) {
+		fprintf (stderr, "Warning: Could not sync device, regions were not discarded\n");
+		return 0;
+	}
+
+	for (unsigned long int pos = master_header->header_size + BDL_DEFAULT_HINTBLOCK_SPACING; pos < file->size; pos += BDL_DEFAULT_HINTBLOCK_SPACING) {
+		write_discard_region_synced (file, master_header, pos, pos - BDL_DEFAULT_HINTBLOCK_SPACING);
+	}
+
 	return 0;
 }
@@ -25,6 +25,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "../include/bdl.h"
 #include "io.h"
 
-int clear_dev(struct bdl_io_file *io, int *result);
+int clear_dev(struct bdl_io_file *io, const struct bdl_header *master_header, int *result);
 
 #endif
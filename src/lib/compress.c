@@ -0,0 +1,247 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "compress.h"
+
+//#define BDL_DBG_COMPRESS
+
+static inline uint32_t compress_read_32 (const uint8_t *pos) {
+	uint32_t ret;
+	memcpy (&ret, pos, sizeof(ret));
+	return ret;
+}
+
+static inline uint32_t compress_hash (uint32_t sequence) {
+	return (sequence * 2654435761U) >> (32 - BDL_COMPRESS_LZ_HASH_BITS);
+}
+
+/* Write a length nibble overflow, returns 1 if there is no room */
+static inline int compress_put_length (uint8_t **out, const uint8_t *out_end, unsigned long int length) {
+	while (length >= 255) {
+		if (*out >= out_end) {
+			return 1;
+		}
+		*((*out)++) = 255;
+		length -= 255;
+	}
+
+	if (*out >= out_end) {
+		return 1;
+	}
+	*((*out)++) = length;
+
+	return 0;
+}
+
+/* Write literals and an optional match, returns 1 if there is no room */
+static int compress_put_sequence (
+		uint8_t **out, const uint8_t *out_end,
+		const uint8_t *literals, unsigned long int literal_length,
+		unsigned long int offset, unsigned long int match_length
+) {
+	unsigned long int match_nibble = (match_length == 0 ? 0 : match_length - BDL_COMPRESS_LZ_MIN_MATCH);
+
+	if (*out >= out_end) {
+		return 1;
+	}
+
+	*((*out)++) = ((literal_length < 15 ? literal_length : 15) << 4) | (match_nibble < 15 ? match_nibble : 15);
+
+	if (literal_length >= 15 && compress_put_length (out, out_end, literal_length - 15) != 0) {
+		return 1;
+	}
+
+	if ((unsigned long int) (out_end - *out) < literal_length) {
+		return 1;
+	}
+
+	memcpy (*out, literals, literal_length);
+	*out += literal_length;
+
+	if (match_length == 0) {
+		return 0;
+	}
+
+	if (out_end - *out < 2) {
+		return 1;
+	}
+
+	*((*out)++) = offset & 0xff;
+	*((*out)++) = offset >> 8;
+
+	if (match_nibble >= 15 && compress_put_length (out, out_end, match_nibble - 15) != 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 0 on success and 1 if the result did not fit in dst. The caller
+ * should store data uncompressed if it does not compress.
+ */
+int compress_lz (
+		const char *src, unsigned long int src_length,
+		char *dst, unsigned long int dst_size,
+		unsigned long int *dst_length
+) {
+	uint32_t table[1 << BDL_COMPRESS_LZ_HASH_BITS];
+	memset (table, '\0', sizeof(table));
+
+	const uint8_t *in = (const uint8_t *) src;
+	uint8_t *out = (uint8_t *) dst;
+	const uint8_t *out_end = out + dst_size;
+
+	unsigned long int pos = 0;
+	unsigned long int anchor = 0;
+
+	*dst_length = 0;
+
+	while (pos + BDL_COMPRESS_LZ_MIN_MATCH <= src_length) {
+		uint32_t sequence = compress_read_32 (in + pos);
+		uint32_t hash = compress_hash (sequence);
+		unsigned long int candidate = table[hash];
+
+		table[hash] = pos;
+
+		if (	candidate >= pos ||
+				pos - candidate > BDL_COMPRESS_LZ_MAX_OFFSET ||
+				compress_read_32 (in + candidate) != sequence
+		) {
+			pos++;
+			continue;
+		}
+
+		unsigned long int match_length = BDL_COMPRESS_LZ_MIN_MATCH;
+		while (pos + match_length < src_length && in[candidate + match_length] == in[pos + match_length]) {
+			match_length++;
+		}
+
+		if (compress_put_sequence (
+				&out, out_end,
+				in + anchor, pos - anchor,
+				pos - candidate, match_length
+		) != 0) {
+			return 1;
+		}
+
+		pos += match_length;
+		anchor = pos;
+	}
+
+	if (compress_put_sequence (&out, out_end, in + anchor, src_length - anchor, 0, 0) != 0) {
+		return 1;
+	}
+
+	*dst_length = out - (uint8_t *) dst;
+
+#ifdef BDL_DBG_COMPRESS
+	printf ("Compressed %lu bytes to %lu bytes\n", src_length, *dst_length);
+#endif
+
+	return 0;
+}
+
+static inline int decompress_get_length (const uint8_t **in, const uint8_t *in_end, unsigned long int *length) {
+	uint8_t byte;
+	do {
+		if (*in >= in_end) {
+			return 1;
+		}
+		byte = *((*in)++);
+		*length += byte;
+	} while (byte == 255);
+
+	return 0;
+}
+
+/* Returns 1 if the input is corrupt or does not fit in dst */
+int decompress_lz (
+		const char *src, unsigned long int src_length,
+		char *dst, unsigned long int dst_size,
+		unsigned long int *dst_length
+) {
+	const uint8_t *in = (const uint8_t *) src;
+	const uint8_t *in_end = in + src_length;
+	uint8_t *out = (uint8_t *) dst;
+	uint8_t *out_end = out + dst_size;
+
+	*dst_length = 0;
+
+	while (in < in_end) {
+		uint8_t token = *(in++);
+
+		unsigned long int literal_length = token >> 4;
+		if (literal_length == 15 && decompress_get_length (&in, in_end, &literal_length) != 0) {
+			return 1;
+		}
+
+		if (	(unsigned long int) (in_end - in) < literal_length ||
+				(unsigned long int) (out_end - out) < literal_length
+		) {
+			return 1;
+		}
+
+		memcpy (out, in, literal_length);
+		in += literal_length;
+		out += literal_length;
+
+		// The last sequence has no match
+		if (in == in_end) {
+			break;
+		}
+
+		if (in_end - in < 2) {
+			return 1;
+		}
+
+		unsigned long int offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		unsigned long int match_length = token & 0x0f;
+		if (match_length == 15 && decompress_get_length (&in, in_end, &match_length) != 0) {
+			return 1;
+		}
+		match_length += BDL_COMPRESS_LZ_MIN_MATCH;
+
+		if (	offset == 0 ||
+				offset > (unsigned long int) (out - (uint8_t *) dst) ||
+				(unsigned long int) (out_end - out) < match_length
+		) {
+			return 1;
+		}
+
+		// Matches may overlap with the output
+		const uint8_t *match = out - offset;
+		for (unsigned long int i = 0; i < match_length; i++) {
+			out[i] = match[i];
+		}
+		out += match_length;
+	}
+
+	*dst_length = out - (uint8_t *) dst;
+
+	return 0;
+}
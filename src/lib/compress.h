@@ -0,0 +1,54 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_COMPRESS_H
+#define BDL_COMPRESS_H
+
+#include <stdint.h>
+
+/*
+ * Simple LZ77 compressor in the style of LZ4. The output is a series of
+ * sequences, each made of a token byte, literals and a match:
+ *
+ * - Token with literal count in the high nibble and match length minus
+ *   four in the low nibble. A nibble of 15 is followed by bytes which are
+ *   added to it until a byte less than 255 is found.
+ * - Literals copied as-is.
+ * - Offset of the match as two bytes little endian, not present after the
+ *   last sequence which only holds literals.
+ */
+
+#define BDL_COMPRESS_LZ_MIN_MATCH		4
+#define BDL_COMPRESS_LZ_MAX_OFFSET		65535
+#define BDL_COMPRESS_LZ_HASH_BITS		12
+
+int compress_lz (
+		const char *src, unsigned long int src_length,
+		char *dst, unsigned long int dst_size,
+		unsigned long int *dst_length
+);
+int decompress_lz (
+		const char *src, unsigned long int src_length,
+		char *dst, unsigned long int dst_size,
+		unsigned long int *dst_length
+);
+
+#endif
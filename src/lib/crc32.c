@@ -100,14 +100,105 @@ static uint32_t crc_32_tab[] = { /* CRC polynomial 0xedb88320 */
 
 #define UPDC32(octet, crc) (crc_32_tab[((crc) ^ (octet)) & 0xff] ^ ((crc) >> 8))
 
+/* Incremental interface, feed the value from init through update and finish with final */
+uint32_t crc32_init (void) {
+	return 0xFFFFFFFF;
+}
+
+uint32_t crc32_update (uint32_t crc32, const char *buf, unsigned long int len) {
+	for (unsigned long int i = 0; i < len; i++) {
+		crc32 = UPDC32(*(buf + i), crc32);
+	}
+
+	return crc32;
+}
+
+uint32_t crc32_final (uint32_t crc32) {
+	return ~crc32;
+}
+
 uint32_t crc32buf (const char *buf, int len) {
-      uint32_t crc32 = 0xFFFFFFFF;
+	return crc32_final(crc32_update(crc32_init(), buf, len));
+}
+
+/*
+ * The CRC register is linear over GF(2). Feeding zero bytes into it is a
+ * 32x32 bit matrix operation, and the matrix for n zero bytes is found by
+ * repeated squaring like it is done in zlib crc32_combine.
+ */
 
-      for (int i = 0; i < len; i++) {
-    	  crc32 = UPDC32(*(buf + i), crc32);
-      }
+static uint32_t crc32_matrix_times (const uint32_t *matrix, uint32_t vector) {
+	uint32_t sum = 0;
+
+	while (vector) {
+		if (vector & 1) {
+			sum ^= *matrix;
+		}
+		vector >>= 1;
+		matrix++;
+	}
+
+	return sum;
+}
+
+static void crc32_matrix_square (uint32_t *square, const uint32_t *matrix) {
+	for (int n = 0; n < 32; n++) {
+		square[n] = crc32_matrix_times (matrix, matrix[n]);
+	}
+}
+
+/* Raw register value after feeding length zero bytes, without pre- or post-conditioning */
+uint32_t crc32_zeros (uint32_t crc32, unsigned long int length) {
+	uint32_t even[32];
+	uint32_t odd[32];
+
+	if (length == 0) {
+		return crc32;
+	}
+
+	// Operator for one zero bit
+	odd[0] = 0xedb88320;
+	uint32_t row = 1;
+	for (int n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	// Two and four zero bits
+	crc32_matrix_square (even, odd);
+	crc32_matrix_square (odd, even);
+
+	// First pass gives the operator for one zero byte
+	do {
+		crc32_matrix_square (even, odd);
+		if (length & 1) {
+			crc32 = crc32_matrix_times (even, crc32);
+		}
+		length >>= 1;
+
+		if (length == 0) {
+			break;
+		}
+
+		crc32_matrix_square (odd, even);
+		if (length & 1) {
+			crc32 = crc32_matrix_times (odd, crc32);
+		}
+		length >>= 1;
+	} while (length != 0);
+
+	return crc32;
+}
 
-      return ~crc32;
+/*
+ * Find the CRC of a buffer after some of its bytes have changed. xor_data is
+ * the old bytes XOR'ed with the new ones, and trailing_length is the number
+ * of bytes in the buffer following the changed bytes. The bytes in front of
+ * the change do not matter.
+ */
+uint32_t crc32_patch (uint32_t crc32, const char *xor_data, unsigned long int xor_length, unsigned long int trailing_length) {
+	uint32_t difference = crc32_update (0, xor_data, xor_length);
+	return crc32 ^ crc32_zeros (difference, trailing_length);
 }
 
 int crc32cmp (const char *buf, int len, uint32_t crc32) {
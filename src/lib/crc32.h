@@ -24,6 +24,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 
+uint32_t crc32_init (void);
+uint32_t crc32_update (uint32_t crc32, const char *buf, unsigned long int len);
+uint32_t crc32_final (uint32_t crc32);
+uint32_t crc32_zeros (uint32_t crc32, unsigned long int length);
+uint32_t crc32_patch (uint32_t crc32, const char *xor_data, unsigned long int xor_length, unsigned long int trailing_length);
 uint32_t crc32buf (const char *buf, int len);
 int crc32cmp (const char *buf, int len, uint32_t crc32);
 
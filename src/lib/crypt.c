@@ -37,32 +37,81 @@ const char *crypt_get_algorithm_name (BDL_HASH_ALGORITHM algorithm) {
 	return algorithm_names[algorithm];
 }
 
-int crypt_hash_data(const char *data, int length, BDL_HASH_ALGORITHM algorithm, uint32_t *dest) {
+int crypt_hash_init(struct crypt_hash_state *state, BDL_HASH_ALGORITHM algorithm) {
 	const char *algorithm_name = crypt_get_algorithm_name (algorithm);
 
 	if (algorithm_name == NULL) {
 		return 1;
 	}
 
+	state->algorithm = algorithm;
+
 	if (algorithm == BDL_HASH_ALGORITHM_CRC32) {
-		*dest = crc32buf (data, length);
+		state->crc32 = crc32_init ();
 	}
 	else {
 		fprintf (stderr, "Bug: Unknown algorithm\n");
 		return 1;
 	}
 
+	return 0;
+}
+
+void crypt_hash_update(struct crypt_hash_state *state, const char *data, unsigned long int length) {
+	if (state->algorithm == BDL_HASH_ALGORITHM_CRC32) {
+		state->crc32 = crc32_update (state->crc32, data, length);
+	}
+
 #ifdef BDL_DEBUG_HASHING
-	printf ("Hashed %i bytes of data, result was: %u", length, *dest);
-	for (int i = 0; i < length; i++) {
+	printf ("Hashing %lu bytes of data", length);
+	for (unsigned long int i = 0; i < length; i++) {
 		printf ("%s%02x-", (i % 32 == 0 ? "\n" : ""), (unsigned char) data[i]);
 	}
 	printf ("\n");
 #endif
+}
+
+void crypt_hash_final(struct crypt_hash_state *state, uint32_t *dest) {
+	if (state->algorithm == BDL_HASH_ALGORITHM_CRC32) {
+		*dest = crc32_final (state->crc32);
+	}
+
+#ifdef BDL_DEBUG_HASHING
+	printf ("Hash result was: %u\n", *dest);
+#endif
+}
+
+int crypt_hash_data(const char *data, int length, BDL_HASH_ALGORITHM algorithm, uint32_t *dest) {
+	struct crypt_hash_state state;
+
+	if (crypt_hash_init (&state, algorithm) != 0) {
+		return 1;
+	}
+
+	crypt_hash_update (&state, data, length);
+	crypt_hash_final (&state, dest);
 
 	return 0;
 }
 
+/*
+ * Update a hash after bytes of the hashed data have been changed, see crc32_patch. Returns 1
+ * if the algorithm cannot do this, the caller must then hash all the data again.
+ */
+int crypt_hash_patch (
+		BDL_HASH_ALGORITHM algorithm,
+		uint32_t *hash,
+		const char *xor_data, unsigned long int xor_length,
+		unsigned long int trailing_length
+) {
+	if (algorithm == BDL_HASH_ALGORITHM_CRC32) {
+		*hash = crc32_patch (*hash, xor_data, xor_length, trailing_length);
+		return 0;
+	}
+
+	return 1;
+}
+
 int crypt_check_hash(const char *data, int length, BDL_HASH_ALGORITHM algorithm, uint32_t hash, int *result) {
 	uint32_t test;
 
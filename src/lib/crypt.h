@@ -37,7 +37,24 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 typedef uint8_t BDL_HASH_ALGORITHM;
 
+/* For hashing data in more than one piece */
+struct crypt_hash_state {
+	BDL_HASH_ALGORITHM algorithm;
+	uint32_t crc32;
+};
+
+int crypt_hash_init(struct crypt_hash_state *state, BDL_HASH_ALGORITHM algorithm);
+void crypt_hash_update(struct crypt_hash_state *state, const char *data, unsigned long int length);
+void crypt_hash_final(struct crypt_hash_state *state, uint32_t *dest);
+
 int crypt_hash_data(const char *data, int length, BDL_HASH_ALGORITHM algorithm, uint32_t *dest);
+int crypt_hash_patch (
+		BDL_HASH_ALGORITHM algorithm,
+		uint32_t *hash,
+		const char *xor_data, unsigned long int xor_length,
+		unsigned long int trailing_length
+);
+
 int crypt_check_hash(const char *data, int length, BDL_HASH_ALGORITHM algorithm, uint32_t hash, int *result);
 
 #endif
@@ -0,0 +1,607 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "cursor.h"
+#include "blocks.h"
+#include "record.h"
+#include "session.h"
+#include "defaults.h"
+#include "io.h"
+#include "bdltime.h"
+#include "shared.h"
+#include "../include/bdl.h"
+
+//#define BDL_DBG_CURSOR
+
+/* Records older than this are not returned */
+uint64_t cursor_min_timestamp (const struct bdl_cursor *cursor) {
+	if (cursor->last_timestamp != 0 && cursor->last_timestamp >= cursor->timestamp_gteq) {
+		return cursor->last_timestamp + 1;
+	}
+	return cursor->timestamp_gteq;
+}
+
+int cursor_get_master_header (struct bdl_cursor *cursor, const struct bdl_header **header) {
+	int result;
+
+	if (session_get_master_header (cursor->session, header, &result) != 0) {
+		fprintf (stderr, "Could not get header from device for cursor\n");
+		return 1;
+	}
+
+	if (result != 0) {
+		fprintf (stderr, "Invalid header of device while using cursor\n");
+		return 1;
+	}
+
+	if ((*header)->block_size != cursor->block_size) {
+		fprintf (stderr, "Device was initialized again after cursor was opened\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Blocks of a region are written from its beginning, so if the first block is newer than
+ * what the cursor has returned while the cursor is further out in the region, the region
+ * was taken over by the writer.
+ */
+int cursor_region_taken_over (
+		struct bdl_cursor *cursor,
+		const struct bdl_header *header,
+		const struct bdl_hintblock_state *state,
+		unsigned long int block_position,
+		int *taken_over
+) {
+	*taken_over = 0;
+
+	if (block_position <= state->blockstart_min) {
+		return 0;
+	}
+
+	struct bdl_block_header *block_header;
+	char *block_data;
+	int result;
+
+	if (block_get_validate_block (
+			&cursor->session->device, state->blockstart_min, header,
+			cursor->block_buf, cursor->block_size,
+			&block_header, &block_data,
+			&result
+	) != 0) {
+		fprintf (stderr, "Error while reading first block of region at %lu for cursor\n", state->location);
+		return 1;
+	}
+
+	if (result != 0 || block_header->timestamp >= cursor_min_timestamp (cursor)) {
+		*taken_over = 1;
+	}
+
+	return 0;
+}
+
+int cursor_find_oldest (struct bdl_cursor *cursor, const struct bdl_header *header) {
+	struct bdl_block_location location;
+	int result;
+
+	if (block_find_oldest_hintblock (
+			&cursor->session->device, header,
+			cursor_min_timestamp (cursor),
+			&location,
+			&result
+	) != 0) {
+		fprintf (stderr, "Error while finding oldest hint block for cursor\n");
+		return 1;
+	}
+
+	if (location.hintblock_state.valid != 1) {
+		return 0;
+	}
+
+#ifdef BDL_DBG_CURSOR
+	printf ("Cursor starts at region with hint block at %lu\n", location.hintblock_state.location);
+#endif
+
+	cursor->hintblock_state = location.hintblock_state;
+	cursor->block_position = location.hintblock_state.blockstart_min;
+	cursor->positioned = 1;
+	record_state_reset (&cursor->record_state);
+
+	return 0;
+}
+
+int cursor_record_callback (struct bdl_record_loop_callback_data *data, int *result) {
+	struct bdl_cursor *cursor = (struct bdl_cursor *) data->argument_ptr;
+	const struct bdl_block_header *record_header = &data->record_header;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	if (record_header->timestamp < cursor_min_timestamp (cursor)) {
+		return 0;
+	}
+
+	if (cursor->record_count == cursor->record_max) {
+		fprintf (stderr, "Bug: Too many records in block at %lu for cursor\n", data->block_position);
+		exit (EXIT_FAILURE);
+	}
+
+	struct bdl_read_callback_data *record = &cursor->records[cursor->record_count];
+
+	record->block_position = data->block_position;
+	record->timestamp = record_header->timestamp;
+	record->application_data = record_header->application_data;
+	record->flags = record_header->flags;
+	record->hash = record_header->hash;
+	record->data_length = record_header->data_length;
+	record->data = data->record_data;
+
+	cursor->record_count++;
+
+	return 0;
+}
+
+/* Load blocks until one has records for us, sets *found to 0 if there are no more records yet */
+int cursor_load_block (struct bdl_cursor *cursor, const struct bdl_header *header, int *found) {
+	struct bdl_io_file *file = &cursor->session->device;
+	struct bdl_hintblock_state *state = &cursor->hintblock_state;
+	int refreshed = 0;
+
+	*found = 0;
+	cursor->record_count = 0;
+	cursor->record_next = 0;
+
+	if (cursor->positioned == 0) {
+		if (cursor_find_oldest (cursor, header) != 0) {
+			return 1;
+		}
+		if (cursor->positioned == 0) {
+			return 0;
+		}
+		refreshed = 1;
+	}
+
+	while (1) {
+		if (cursor->block_position == state->backup_location) {
+			cursor->block_position += header->block_size;
+		}
+
+		if (	cursor->block_position > state->blockstart_max ||
+				cursor->block_position > state->hintblock.previous_block_pos
+		) {
+			// More blocks might have been written to the region after we read its hint block
+			if (refreshed == 0) {
+				refreshed = 1;
+
+				if (block_get_region_state (file, state->location, header, state) != 0) {
+					fprintf (stderr, "Error while reading hint block at %lu for cursor\n", state->location);
+					return 1;
+				}
+
+				int taken_over = 0;
+				if (state->valid == 1 && cursor_region_taken_over (
+						cursor, header, state, cursor->block_position, &taken_over
+				) != 0) {
+					return 1;
+				}
+
+				// Search again if the region is gone
+				if (state->valid != 1 || taken_over == 1) {
+#ifdef BDL_DBG_CURSOR
+					printf ("Region at %lu was invalidated or taken over, searching again\n", state->location);
+#endif
+					cursor->positioned = 0;
+					return 0;
+				}
+
+				continue;
+			}
+
+			// Look past invalid regions, the writer finds its head beyond damaged ones
+			struct bdl_hintblock_state next_state;
+			unsigned long int next = state->location;
+
+			next_state.valid = 0;
+			while (next_state.valid != 1) {
+				next = block_next_hintblock_position (file, header, next);
+				if (next == state->location) {
+					break;
+				}
+
+				if (block_get_region_state (file, next, header, &next_state) != 0) {
+					fprintf (stderr, "Error while reading next hint block for cursor\n");
+					return 1;
+				}
+			}
+
+			// This is the head region if the next one is older, wait for more records
+			if (next_state.valid != 1 || next_state.highest_timestamp <= state->highest_timestamp) {
+				return 0;
+			}
+
+#ifdef BDL_DBG_CURSOR
+			printf ("Cursor moves on to region with hint block at %lu\n", next_state.location);
+#endif
+
+			// Chains never cross regions
+			*state = next_state;
+			cursor->block_position = state->blockstart_min;
+			record_state_reset (&cursor->record_state);
+
+			continue;
+		}
+
+		struct bdl_block_header *block_header;
+		char *block_data;
+		int result;
+
+		if (block_get_validate_block (
+				file, cursor->block_position, header,
+				cursor->block_buf, cursor->block_size,
+				&block_header, &block_data,
+				&result
+		) != 0) {
+			fprintf (stderr, "Error while reading block at %lu for cursor\n", cursor->block_position);
+			return 1;
+		}
+
+		unsigned long int position = cursor->block_position;
+
+		// An invalid block ends the region, like when looping blocks
+		if (result != 0) {
+			cursor->block_position = state->blockstart_max + header->block_size;
+			continue;
+		}
+
+		cursor->block_position += header->block_size;
+
+		// Packed blocks have the timestamp of their newest record
+		if (block_header->timestamp < cursor_min_timestamp (cursor)) {
+			continue;
+		}
+
+		struct bdl_record_loop_callback_data callback_data;
+		callback_data.argument_int = 0;
+		callback_data.argument_ptr = (void *) cursor;
+
+		if (record_loop_block (
+				&cursor->record_state,
+				block_header, block_data, position,
+				cursor_record_callback, &callback_data,
+				&result
+		) != 0) {
+			fprintf (stderr, "Error while looping records of block at %lu for cursor\n", position);
+			return 1;
+		}
+
+		if (cursor->record_count > 0) {
+			*found = 1;
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+int bdl_cursor_open (struct bdl_session *session, uint64_t timestamp_gteq, struct bdl_cursor **result) {
+	*result = NULL;
+
+	// Keep the device open while the cursor exists
+	if (bdl_start_session (session, NULL, 0) != 0) {
+		fprintf (stderr, "A session must be started before opening a cursor\n");
+		return 1;
+	}
+
+	const struct bdl_header *header;
+	int header_result;
+	if (session_get_master_header (session, &header, &header_result) != 0 || header_result != 0) {
+		fprintf (stderr, "Could not get valid header from device for cursor\n");
+		bdl_close_session (session);
+		return 1;
+	}
+
+	struct bdl_cursor *cursor = malloc (sizeof(*cursor));
+	if (cursor == NULL) {
+		fprintf (stderr, "Could not allocate cursor\n");
+		bdl_close_session (session);
+		return 1;
+	}
+
+	memset (cursor, '\0', sizeof(*cursor));
+
+	cursor->session = session;
+	cursor->timestamp_gteq = timestamp_gteq;
+	cursor->block_size = header->block_size;
+	cursor->record_max = header->block_size / sizeof(struct bdl_packed_record) + 1;
+	cursor->watch_fd = -1;
+	cursor->poll_interval_ms = BDL_CURSOR_POLL_MIN_MS;
+	cursor->block_buf = malloc (cursor->block_size);
+	cursor->records = malloc (cursor->record_max * sizeof(*cursor->records));
+	record_state_init (&cursor->record_state);
+
+	if (cursor->block_buf == NULL || cursor->records == NULL) {
+		fprintf (stderr, "Could not allocate buffers for cursor\n");
+		bdl_cursor_close (cursor);
+		return 1;
+	}
+
+	*result = cursor;
+
+	return 0;
+}
+
+int bdl_cursor_next (struct bdl_cursor *cursor, struct bdl_read_callback_data *record, int *result) {
+	*result = 1;
+
+	if (cursor->record_next >= cursor->record_count) {
+		const struct bdl_header *header;
+		if (cursor_get_master_header (cursor, &header) != 0) {
+			return 1;
+		}
+
+		int found;
+		if (cursor_load_block (cursor, header, &found) != 0) {
+			return 1;
+		}
+
+		if (found == 0) {
+			return 0;
+		}
+	}
+
+	*record = cursor->records[cursor->record_next];
+	cursor->record_next++;
+	cursor->last_timestamp = record->timestamp;
+
+	*result = 0;
+
+	return 0;
+}
+
+void bdl_cursor_get_position (const struct bdl_cursor *cursor, struct bdl_cursor_position *position) {
+	memset (position, '\0', sizeof(*position));
+
+	position->timestamp = cursor->last_timestamp;
+
+	if (cursor->positioned == 0) {
+		return;
+	}
+
+	position->hintblock_position = cursor->hintblock_state.location;
+
+	// Records left from the loaded block are found again by their timestamps
+	if (cursor->record_next < cursor->record_count) {
+		position->block_position = cursor->records[cursor->record_next].block_position;
+	}
+	else {
+		position->block_position = cursor->block_position;
+	}
+}
+
+int bdl_cursor_seek (struct bdl_cursor *cursor, const struct bdl_cursor_position *position) {
+	struct bdl_io_file *file = &cursor->session->device;
+
+	const struct bdl_header *header;
+	if (cursor_get_master_header (cursor, &header) != 0) {
+		return 1;
+	}
+
+	cursor->last_timestamp = position->timestamp;
+	cursor->positioned = 0;
+	cursor->record_count = 0;
+	cursor->record_next = 0;
+	record_state_reset (&cursor->record_state);
+
+	// Without a region, the oldest region with newer records is searched for on the next read
+	if (position->hintblock_position == 0) {
+		return 0;
+	}
+
+	unsigned long int first_hintblock_position = header->header_size + BDL_DEFAULT_HINTBLOCK_SPACING;
+	if (	position->hintblock_position < first_hintblock_position ||
+			position->hintblock_position >= file->size ||
+			(position->hintblock_position - first_hintblock_position) % BDL_DEFAULT_HINTBLOCK_SPACING != 0
+	) {
+		fprintf (stderr, "Invalid hint block position %" PRIu64 " of cursor position\n", position->hintblock_position);
+		return 1;
+	}
+
+	struct bdl_hintblock_state state;
+	if (block_get_region_state (file, position->hintblock_position, header, &state) != 0) {
+		fprintf (stderr, "Error while reading hint block at %" PRIu64 " for cursor\n", position->hintblock_position);
+		return 1;
+	}
+
+	if (	position->block_position < state.blockstart_min ||
+			position->block_position > state.blockstart_max + header->block_size ||
+			(position->block_position - state.blockstart_min) % header->block_size != 0
+	) {
+		fprintf (stderr, "Invalid block position %" PRIu64 " of cursor position\n", position->block_position);
+		return 1;
+	}
+
+	if (state.valid != 1) {
+		return 0;
+	}
+
+	int taken_over;
+	if (cursor_region_taken_over (cursor, header, &state, position->block_position, &taken_over) != 0) {
+		return 1;
+	}
+
+	if (taken_over == 1) {
+		return 0;
+	}
+
+	cursor->hintblock_state = state;
+	cursor->block_position = position->block_position;
+	cursor->positioned = 1;
+
+	return 0;
+}
+
+int bdl_cursor_seek_head (struct bdl_cursor *cursor) {
+	const struct bdl_header *header;
+	if (cursor_get_master_header (cursor, &header) != 0) {
+		return 1;
+	}
+
+	struct bdl_block_location location;
+	int result;
+
+	if (block_find_newest_hintblock (&cursor->session->device, header, &location, &result) != 0) {
+		fprintf (stderr, "Error while finding newest hint block for cursor\n");
+		return 1;
+	}
+
+	struct bdl_cursor_position position;
+	memset (&position, '\0', sizeof(position));
+
+	// An empty device has no head, the first record written is found by searching
+	if (location.hintblock_state.valid == 1) {
+		const struct bdl_hintblock_state *state = &location.hintblock_state;
+		position.hintblock_position = state->location;
+		position.block_position = block_next_position (state, header, state->hintblock.previous_block_pos);
+		position.timestamp = state->highest_timestamp;
+	}
+
+	return bdl_cursor_seek (cursor, &position);
+}
+
+/* Sleep until the timeout passes or the device is written to, if we can tell */
+int cursor_sleep (struct bdl_cursor *cursor, unsigned long int timeout_ms) {
+	struct pollfd pollfd;
+
+	// Negative descriptors are ignored, which makes this a plain sleep
+	pollfd.fd = cursor->watch_fd;
+	pollfd.events = POLLIN;
+	pollfd.revents = 0;
+
+	int ret = poll (&pollfd, 1, timeout_ms);
+	if (ret < 0 && errno != EINTR) {
+		fprintf (stderr, "Error while waiting for records for cursor: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (ret > 0) {
+		char events[4096];
+		while (read (cursor->watch_fd, events, sizeof(events)) > 0) {
+		}
+	}
+
+	return 0;
+}
+
+int bdl_cursor_wait (struct bdl_cursor *cursor, unsigned long int timeout_ms, int *result) {
+	*result = 1;
+
+	if (cursor->record_next < cursor->record_count) {
+		*result = 0;
+		return 0;
+	}
+
+	struct bdl_io_file *device = &cursor->session->device;
+
+	// Writers sharing the page wake us themselves
+	if (cursor->watch_initialized == 0 && device->shared_page == NULL) {
+		if (io_watch (device, &cursor->watch_fd) != 0) {
+			fprintf (stderr, "Could not watch device for cursor\n");
+			return 1;
+		}
+		cursor->watch_initialized = 1;
+	}
+
+	uint64_t start_time = time_get_monotonic_64();
+
+	while (1) {
+		// Take the generation first, a publish after it ends the wait below at once
+		uint32_t generation = 0;
+		if (device->shared_page != NULL) {
+			generation = shared_get_generation (device);
+		}
+
+		const struct bdl_header *header;
+		if (cursor_get_master_header (cursor, &header) != 0) {
+			return 1;
+		}
+
+		int found;
+		if (cursor_load_block (cursor, header, &found) != 0) {
+			return 1;
+		}
+
+		if (found == 1) {
+			cursor->poll_interval_ms = BDL_CURSOR_POLL_MIN_MS;
+			*result = 0;
+			return 0;
+		}
+
+		unsigned long int sleep_ms = cursor->poll_interval_ms;
+
+		if (timeout_ms != 0) {
+			uint64_t elapsed_ms = (time_get_monotonic_64() - start_time) / 1000;
+			if (elapsed_ms >= timeout_ms) {
+				return 0;
+			}
+			if (timeout_ms - elapsed_ms < sleep_ms) {
+				sleep_ms = timeout_ms - elapsed_ms;
+			}
+		}
+
+		if (device->shared_page != NULL) {
+			if (shared_wait (device, generation, sleep_ms) != 0) {
+				return 1;
+			}
+		}
+		else if (cursor_sleep (cursor, sleep_ms) != 0) {
+			return 1;
+		}
+
+		if (cursor->poll_interval_ms < BDL_CURSOR_POLL_MAX_MS) {
+			cursor->poll_interval_ms *= 2;
+			if (cursor->poll_interval_ms > BDL_CURSOR_POLL_MAX_MS) {
+				cursor->poll_interval_ms = BDL_CURSOR_POLL_MAX_MS;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void bdl_cursor_close (struct bdl_cursor *cursor) {
+	if (cursor->watch_fd >= 0) {
+		close (cursor->watch_fd);
+	}
+	record_state_cleanup (&cursor->record_state);
+	free (cursor->records);
+	free (cursor->block_buf);
+	bdl_close_session (cursor->session);
+	free (cursor);
+}
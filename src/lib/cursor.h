@@ -0,0 +1,73 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_CURSOR_H
+#define BDL_CURSOR_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+#include "record.h"
+#include "../include/bdl.h"
+
+/*
+ * A cursor reads the blocks of one region after each other, and moves on to the
+ * following region when it is newer than the current one. When no newer region
+ * exists, the cursor stays at the end of the head region and checks its hint
+ * block again on the next call, so it also picks up records written later.
+ * Records are filtered by timestamp, which also hides records of blocks which
+ * were partly returned already. A waiting cursor checks the head region again
+ * with a short interval, and is woken early by inotify for files written with
+ * write(), or by the writer through the shared page of the device if there is one.
+ */
+
+struct bdl_cursor {
+	struct bdl_session *session;
+	uint64_t timestamp_gteq;
+
+	/* Timestamp of the last record returned, zero if none */
+	uint64_t last_timestamp;
+
+	/* Set when the cursor has a region, else the oldest region is searched for again */
+	int positioned;
+	struct bdl_hintblock_state hintblock_state;
+
+	/* Next block to load */
+	unsigned long int block_position;
+
+	/* Block size when the cursor was opened, the device may be initialized again */
+	unsigned long int block_size;
+	char *block_buf;
+
+	/* Records of the last loaded block, pointing into the block buffer or the record state */
+	struct bdl_record_state record_state;
+	struct bdl_read_callback_data *records;
+	unsigned long int record_max;
+	unsigned long int record_count;
+	unsigned long int record_next;
+
+	/* Used by bdl_cursor_wait, the watch descriptor is -1 when polling only */
+	int watch_initialized;
+	int watch_fd;
+	unsigned long int poll_interval_ms;
+};
+
+#endif
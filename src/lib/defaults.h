@@ -22,13 +22,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef BDL_DEFAULTS_H
 #define BDL_DEFAULTS_H
 
-/* Blocksystem version */
-#define BDL_BLOCKSYSTEM_VERSION 4
+/*
+ * Blocksystem version, devices with another version are not accepted. Version 5
+ * added block flags, packed and chained blocks and compression.
+ */
+#define BDL_BLOCKSYSTEM_VERSION 5
 
-/* Blocks are allocated on the stack, don't make them too big */
+/*
+ * Block buffers are allocated from the arena of the device. A region must hold
+ * a few blocks, and the block size must divide half of the hint block spacing
+ * to keep backup hint blocks on block boundaries.
+ */
 #define BDL_DEFAULT_BLOCKSIZE 512
 #define BDL_MINIMUM_BLOCKSIZE 512
-#define BDL_MAXIMUM_BLOCKSIZE 8192
+#define BDL_MAXIMUM_BLOCKSIZE (1024 * 1024)
 #define BDL_BLOCKSIZE_DIVISOR 256
 
 /* Default header pad 2kB */
@@ -42,6 +49,60 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 /* How much to write to memory map before syncing */
 #define BDL_MMAP_SYNC_SIZE 65536
 
+/* Discards are done in whole sectors of this size */
+#define BDL_IO_SECTOR_SIZE 512
+
+/* Zeros are written in chunks of this size when the device cannot zero by itself */
+#define BDL_IO_ZERO_BUFFER_SIZE 65536
+
+/* Input buffer of the ingest command, grows if a record is larger */
+#define BDL_INGEST_BUFFER_SIZE (1024 * 1024)
+
+/* Defaults for when the ingest command writes records it has read */
+#define BDL_INGEST_DEFAULT_BATCH_SIZE 4096
+#define BDL_INGEST_DEFAULT_FLUSH_INTERVAL_MS 1000
+
+/* Maximum number of records the writer thread writes at once */
+#define BDL_WRITER_BATCH_SIZE 4096
+
+/*
+ * Parallel scans use at most this many threads, and read up to this many regions per
+ * thread ahead of the one being returned
+ */
+#define BDL_SCAN_THREADS_MAX 64
+#define BDL_SCAN_JOBS_PER_THREAD 2
+
+/*
+ * Without a memory map, regions read ahead are kept in buffers of one region each,
+ * which use at most this much memory. Fewer regions and threads are used if needed.
+ */
+#define BDL_SCAN_BUFFER_MAX (256 * 1024 * 1024)
+
+/*
+ * A cursor waiting for records checks the device again after the minimum interval,
+ * doubling it up to the maximum while nothing is written
+ */
+#define BDL_CURSOR_POLL_MIN_MS 1
+#define BDL_CURSOR_POLL_MAX_MS 4
+
+/* Times the state of a region is read while its hint block keeps changing */
+#define BDL_HINTBLOCK_READ_ATTEMPTS 3
+
+/* Times the head in the shared page is read while the writer keeps changing it */
+#define BDL_SHARED_READ_ATTEMPTS 1000
+
+/* Records printed when reading are written in chunks of this size */
+#define BDL_DUMP_BUFFER_SIZE (1024 * 1024)
+
+/* Room for the text before the data of a record when printing it */
+#define BDL_DUMP_HEADER_MAX 1024
+
+/* Records shorter than this are not compressed */
+#define BDL_COMPRESS_MINIMUM_LENGTH 64
+
+/* Try to fit this many blocks worth of records into a compressed packed block */
+#define BDL_COMPRESS_PACK_FACTOR 4
+
 /*
  * Hint blocks are spread around on the device and tells us where we wrote
  * the last block. The hint block after an area contains information about
@@ -55,12 +116,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define BDL_DEFAULT_HINTBLOCK_SPACING (8 * 1024 * 1024)
 #define BDL_HINTBLOCK_BACKUP_POSITION (-BDL_DEFAULT_HINTBLOCK_SPACING/2)
 
+/*
+ * When the head region has less room than this left, the region following it is read
+ * in the background so that switching to it does not wait for the device. This many
+ * bytes from the start of the region are read together with its hint blocks.
+ */
+#define BDL_WRITE_PREPARE_REMAINING (BDL_DEFAULT_HINTBLOCK_SPACING / 4)
+#define BDL_WRITE_PREPARE_SIZE (256 * 1024)
+
 /* For devices smaller than 256MB, use up to four blocks plus one at the end */
 #define BDL_SMALL_SIZE_THRESHOLD (256 * 1024 * 1024)
 #define BDL_DEFAULT_HINT_BLOCK_COUNT_SMALL 4
 
 #define BDL_DEFAULT_PAD_CHAR 0xff
 
+/*
+ * Automatic timestamps which are up to this many microseconds behind the newest
+ * record are placed after it, larger differences means that the clock is wrong
+ */
+#define BDL_TIME_TIE_TOLERANCE 1000
+
 #define BDL_NEW_DEVICE_BLANK_START_SIZE 1024
 
 #endif
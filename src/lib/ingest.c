@@ -0,0 +1,375 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "ingest.h"
+#include "write.h"
+#include "bdltime.h"
+#include "defaults.h"
+#include "io.h"
+#include "../include/bdl.h"
+
+//#define BDL_DBG_INGEST
+
+/*
+ * Records are read into a large buffer and written in batches with the packed
+ * writer, which also updates the hint blocks once per batch. Entries point into
+ * the buffer, and they are flushed before the buffer is moved or resized. Records
+ * are stamped when the data completing them was read, not when they are written.
+ */
+
+struct ingest_state {
+	int fd;
+	int delimiter;
+
+	char *buffer;
+	unsigned long int buffer_size;
+	unsigned long int buffer_length;
+	unsigned long int parse_pos;
+
+	struct bdl_write_entry *entries;
+	unsigned long int entry_count;
+
+	const struct bdl_header *header;
+
+	uint64_t appdata;
+	unsigned long int faketimestamp;
+	int compression;
+	struct bdl_time_source *time_source;
+	uint64_t last_flush_time;
+
+	// Newest timestamp on the device when we started
+	uint64_t newest_timestamp;
+
+	// Timestamp of the next record found, taken when the last chunk was read
+	uint64_t next_timestamp;
+};
+
+/* Sets *found to 1 if a complete record was found at the parse position */
+int ingest_next_record (struct ingest_state *state, const char **data, unsigned long int *data_length, int *found) {
+	const char *pos = state->buffer + state->parse_pos;
+	unsigned long int length = state->buffer_length - state->parse_pos;
+
+	*found = 0;
+
+	if (state->delimiter == BDL_INGEST_DELIMITER_LENGTH) {
+		if (length < 4) {
+			return 0;
+		}
+
+		const uint8_t *length_bytes = (const uint8_t *) pos;
+		unsigned long int record_length =
+				(uint32_t) length_bytes[0] |
+				(uint32_t) length_bytes[1] << 8 |
+				(uint32_t) length_bytes[2] << 16 |
+				(uint32_t) length_bytes[3] << 24;
+
+		if (length - 4 < record_length) {
+			return 0;
+		}
+
+		*data = pos + 4;
+		*data_length = record_length;
+		state->parse_pos += 4 + record_length;
+		*found = 1;
+
+		return 0;
+	}
+
+	while (length > 0) {
+		const char *newline = memchr (pos, '\n', length);
+		if (newline == NULL) {
+			return 0;
+		}
+
+		state->parse_pos += newline - pos + 1;
+
+		if (newline != pos) {
+			*data = pos;
+			*data_length = newline - pos;
+			*found = 1;
+			return 0;
+		}
+
+		// Skip empty line
+		pos++;
+		length--;
+	}
+
+	return 0;
+}
+
+void ingest_add_entry (struct ingest_state *state, const char *data, unsigned long int data_length) {
+	struct bdl_write_entry *entry = &state->entries[state->entry_count++];
+
+	entry->data = data;
+	entry->data_length = data_length;
+	entry->appdata = state->appdata;
+
+	// Records completed by the same chunk get consecutive timestamps
+	entry->timestamp = state->next_timestamp++;
+	time_source_update (state->time_source, entry->timestamp);
+}
+
+/* Take the timestamp of the records completed by a chunk just read */
+void ingest_stamp_chunk (struct ingest_state *state) {
+	state->next_timestamp = time_source_get (state->time_source, 1, state->newest_timestamp);
+
+	// Like the writer does for records without timestamp, place them after the newest one
+	if (state->next_timestamp <= state->newest_timestamp) {
+		state->next_timestamp = state->newest_timestamp + 1;
+	}
+}
+
+int ingest_flush (struct ingest_state *state, struct bdl_io_file *file) {
+	state->last_flush_time = time_get_monotonic_64();
+
+	if (state->entry_count == 0) {
+		return 0;
+	}
+
+#ifdef BDL_DBG_INGEST
+	printf ("Flushing %lu records\n", state->entry_count);
+#endif
+
+	int ret = write_put_packed_blocks (
+			file,
+			state->header,
+			state->entries, state->entry_count,
+			state->faketimestamp,
+			state->compression,
+			state->time_source
+	);
+
+	state->entry_count = 0;
+
+	if (ret != 0) {
+		fprintf (stderr, "Error while writing records from input\n");
+		return ret;
+	}
+
+	return io_sync (file);
+}
+
+/* Make room for more data at the end of the buffer, must be flushed first */
+int ingest_make_room (struct ingest_state *state) {
+	if (state->entry_count != 0) {
+		fprintf (stderr, "Bug: Ingest buffer was moved while entries were pending\n");
+		exit (EXIT_FAILURE);
+	}
+
+	unsigned long int remaining = state->buffer_length - state->parse_pos;
+
+	memmove (state->buffer, state->buffer + state->parse_pos, remaining);
+	state->buffer_length = remaining;
+	state->parse_pos = 0;
+
+	if (state->buffer_length < state->buffer_size) {
+		return 0;
+	}
+
+	// A single record fills the whole buffer
+	unsigned long int new_size = state->buffer_size * 2;
+	char *new_buffer = realloc (state->buffer, new_size);
+	if (new_buffer == NULL) {
+		fprintf (stderr, "Could not allocate %lu bytes for input buffer\n", new_size);
+		return 1;
+	}
+
+	state->buffer = new_buffer;
+	state->buffer_size = new_size;
+
+	return 0;
+}
+
+/* Wait for input, sets *timeout to 1 if pending entries have waited too long */
+int ingest_wait (struct ingest_state *state, unsigned long int flush_interval_ms, int *timeout) {
+	*timeout = 0;
+
+	if (state->entry_count == 0) {
+		return 0;
+	}
+
+	uint64_t elapsed_ms = (time_get_monotonic_64() - state->last_flush_time) / 1000;
+	if (elapsed_ms >= flush_interval_ms) {
+		*timeout = 1;
+		return 0;
+	}
+
+	struct pollfd pollfd;
+	pollfd.fd = state->fd;
+	pollfd.events = POLLIN;
+	pollfd.revents = 0;
+
+	int ret = poll (&pollfd, 1, flush_interval_ms - elapsed_ms);
+	if (ret < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+		fprintf (stderr, "Error while waiting for input: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (ret == 0) {
+		*timeout = 1;
+	}
+
+	return 0;
+}
+
+int ingest_stream (
+		struct bdl_io_file *file,
+		const struct bdl_header *header,
+		int fd,
+		int delimiter,
+		unsigned long int batch_size,
+		unsigned long int flush_interval_ms,
+		uint64_t appdata,
+		unsigned long int faketimestamp,
+		int compression,
+		struct bdl_time_source *time_source
+) {
+	struct ingest_state state;
+	memset (&state, '\0', sizeof(state));
+
+	state.header = header;
+	state.fd = fd;
+	state.delimiter = delimiter;
+	state.appdata = appdata;
+	state.faketimestamp = faketimestamp;
+	state.compression = compression;
+	state.time_source = time_source;
+	state.last_flush_time = time_get_monotonic_64();
+
+	int ret = 0;
+	int eof = 0;
+
+	struct bdl_block_location location;
+	if (write_find_location (file, header, 1, &location, &state.newest_timestamp) != 0) {
+		fprintf (stderr, "Error while finding write location for device\n");
+		return 1;
+	}
+
+	state.buffer_size = BDL_INGEST_BUFFER_SIZE;
+	state.buffer = malloc (state.buffer_size);
+	state.entries = malloc (batch_size * sizeof(*state.entries));
+	if (state.buffer == NULL || state.entries == NULL) {
+		fprintf (stderr, "Could not allocate buffers for input\n");
+		ret = 1;
+		goto out;
+	}
+
+	while (1) {
+		const char *data;
+		unsigned long int data_length;
+		int found = 1;
+
+		while (state.entry_count < batch_size && found == 1) {
+			ingest_next_record (&state, &data, &data_length, &found);
+			if (found == 1) {
+				ingest_add_entry (&state, data, data_length);
+			}
+		}
+
+		if (state.entry_count == batch_size) {
+			if ((ret = ingest_flush (&state, file)) != 0) {
+				goto out;
+			}
+			continue;
+		}
+
+		if (eof == 1) {
+			break;
+		}
+
+		if (state.buffer_length == state.buffer_size) {
+			if ((ret = ingest_flush (&state, file)) != 0) {
+				goto out;
+			}
+			if (ingest_make_room (&state) != 0) {
+				ret = 1;
+				goto out;
+			}
+		}
+
+		int timeout;
+		if (ingest_wait (&state, flush_interval_ms, &timeout) != 0) {
+			ret = 1;
+			goto out;
+		}
+
+		if (timeout == 1) {
+			if ((ret = ingest_flush (&state, file)) != 0) {
+				goto out;
+			}
+			continue;
+		}
+
+		ssize_t bytes = read (fd, state.buffer + state.buffer_length, state.buffer_size - state.buffer_length);
+		if (bytes < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			fprintf (stderr, "Error while reading input: %s\n", strerror(errno));
+			ret = 1;
+			goto out;
+		}
+
+		if (bytes == 0) {
+			eof = 1;
+		}
+		else {
+			ingest_stamp_chunk (&state);
+		}
+
+		state.buffer_length += bytes;
+	}
+
+	// Data after the last delimiter
+	if (state.parse_pos < state.buffer_length) {
+		if (delimiter == BDL_INGEST_DELIMITER_LENGTH) {
+			fprintf (stderr, "Input ended in the middle of a record, %lu bytes were discarded\n",
+					state.buffer_length - state.parse_pos
+			);
+			ret = 1;
+		}
+		else {
+			ingest_add_entry (&state, state.buffer + state.parse_pos, state.buffer_length - state.parse_pos);
+		}
+	}
+
+	int ret_tmp;
+	if ((ret_tmp = ingest_flush (&state, file)) != 0) {
+		ret = ret_tmp;
+	}
+
+	out:
+	free (state.buffer);
+	free (state.entries);
+	return ret;
+}
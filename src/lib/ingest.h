@@ -0,0 +1,49 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_INGEST_H
+#define BDL_INGEST_H
+
+#include <stdint.h>
+
+#include "../include/bdl.h"
+#include "io.h"
+
+/* Records are separated by newlines, empty lines are skipped */
+#define BDL_INGEST_DELIMITER_NEWLINE	0
+
+/* Records are preceded by their length as four bytes little endian */
+#define BDL_INGEST_DELIMITER_LENGTH		1
+
+int ingest_stream (
+		struct bdl_io_file *file,
+		const struct bdl_header *header,
+		int fd,
+		int delimiter,
+		unsigned long int batch_size,
+		unsigned long int flush_interval_ms,
+		uint64_t appdata,
+		unsigned long int faketimestamp,
+		int compression,
+		struct bdl_time_source *time_source
+);
+
+#endif
@@ -25,12 +25,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 
 #include "init.h"
+#include "arena.h"
 #include "defaults.h"
 #include "blocks.h"
 #include "crypt.h"
 #include "io.h"
 #include "../include/bdl.h"
 
+//#define BDL_DBG_INIT
+
 int check_blank_device (struct bdl_io_file *file) {
 	int item_count = BDL_NEW_DEVICE_BLANK_START_SIZE / sizeof(int);
 	int buf[item_count];
@@ -63,7 +66,100 @@ int check_blank_device (struct bdl_io_file *file) {
 	return 1;
 }
 
-int init_dev(struct bdl_io_file *session_file, long int blocksize, long int header_pad, char padchar) {
+/*
+ * Choose block size and header pad where they are zero. Blocks are made at least as
+ * large as the physical blocks of the device, and the header is padded so that hint
+ * blocks and regions start on erase unit boundaries. Region spacing is fixed by the
+ * format, so erase units larger than it or not a power of two are not aligned to.
+ */
+void init_choose_layout (
+		const struct bdl_io_geometry *geometry,
+		unsigned long int *blocksize,
+		unsigned long int *header_pad
+) {
+	if (*blocksize == 0) {
+		*blocksize = BDL_DEFAULT_BLOCKSIZE;
+
+		unsigned long int physical = geometry->physical_block_size;
+		if (	physical > *blocksize &&
+				physical <= BDL_MAXIMUM_BLOCKSIZE &&
+				(BDL_DEFAULT_HINTBLOCK_SPACING / 2) % physical == 0
+		) {
+			*blocksize = physical;
+		}
+	}
+
+	if (*header_pad != 0) {
+		return;
+	}
+
+	*header_pad = BDL_DEFAULT_HEADER_PAD;
+
+	unsigned long int sizes[] = {
+			geometry->physical_block_size,
+			geometry->optimal_io_size,
+			geometry->discard_granularity
+	};
+
+	unsigned long int alignment = 0;
+	for (int i = 0; i < 3; i++) {
+		unsigned long int size = sizes[i];
+		if (	size > alignment &&
+				size <= BDL_DEFAULT_HINTBLOCK_SPACING &&
+				(size & (size - 1)) == 0
+		) {
+			alignment = size;
+		}
+	}
+
+	if (alignment == 0) {
+		return;
+	}
+	if (alignment < *blocksize) {
+		alignment = *blocksize;
+	}
+
+	// Align the end of the header on the disk, partitions might not start aligned
+	unsigned long int header_end = geometry->start_offset + *header_pad;
+	header_end = ((header_end + alignment - 1) / alignment) * alignment;
+
+	*header_pad = header_end - geometry->start_offset;
+
+#ifdef BDL_DBG_INIT
+	printf ("Chose block size %lu and header pad %lu with alignment %lu\n", *blocksize, *header_pad, alignment);
+#endif
+}
+
+/*
+ * Zero the start of the device and every position where the new structure would look
+ * for hint blocks and their backups, so that nothing from an earlier structure is found.
+ */
+int init_wipe_dev (struct bdl_io_file *session_file, long int blocksize, long int header_pad) {
+	unsigned long int header_length = (header_pad > BDL_NEW_DEVICE_BLANK_START_SIZE ? header_pad : BDL_NEW_DEVICE_BLANK_START_SIZE);
+
+	if (io_zero (session_file, 0, header_length) != 0) {
+		fprintf (stderr, "Error while zeroing header area\n");
+		return 1;
+	}
+
+	for (unsigned long int i = header_pad + BDL_DEFAULT_HINTBLOCK_SPACING;
+			i + blocksize <= session_file->size;
+			i += BDL_DEFAULT_HINTBLOCK_SPACING
+	) {
+		if (	io_zero (session_file, i, blocksize) != 0 ||
+				io_zero (session_file, i + BDL_HINTBLOCK_BACKUP_POSITION, blocksize) != 0
+		) {
+			fprintf (stderr, "Error while zeroing hint blocks at %lu\n", i);
+			return 1;
+		}
+	}
+
+	io_sync (session_file);
+
+	return 0;
+}
+
+int init_dev(struct bdl_io_file *session_file, long int blocksize, long int header_pad, char padchar, int force) {
 	// These are redudant checks, but keep them for now
 	if (header_pad < BDL_MINIMUM_HEADER_PAD) {
 		fprintf (stderr, "Bug: init_dev called with too small header pad\n");
@@ -85,14 +181,14 @@ int init_dev(struct bdl_io_file *session_file, long int blocksize, long int head
 		fprintf(stderr, "Bug: init_dev blocksize needs to be dividable by %i\n", BDL_BLOCKSIZE_DIVISOR);
 		exit (EXIT_FAILURE);
 	}
+	if ((BDL_DEFAULT_HINTBLOCK_SPACING / 2) % blocksize != 0) {
+		fprintf(stderr, "Bug: init_dev blocksize needs to divide %i\n", BDL_DEFAULT_HINTBLOCK_SPACING / 2);
+		exit (EXIT_FAILURE);
+	}
 
 	struct bdl_header header;
 	memset (&header, '\0', sizeof(header));
 
-	int pad_size = header_pad - sizeof(header);
-	char header_pad_string[pad_size];
-	memset (header_pad_string, padchar, pad_size);
-
 	strncpy(header.header_begin_message, BDL_CONFIG_HEADER_START, 32);
 	header.blocksystem_version = BDL_BLOCKSYSTEM_VERSION;
 	header.block_size = blocksize;
@@ -102,12 +198,17 @@ int init_dev(struct bdl_io_file *session_file, long int blocksize, long int head
 	header.total_size = 0;
 	header.header_size = header_pad;
 
-	if (check_blank_device(session_file)) {
+	if (session_file->size < (header_pad + blocksize * 2)) {
+		fprintf(stderr, "The total size will be too small, minimum size is %ld\n", (header_pad + blocksize * 2));
 		return 1;
 	}
 
-	if (session_file->size < (header_pad + blocksize * 2)) {
-		fprintf(stderr, "The total size will be too small, minimum size is %ld\n", (header_pad + blocksize * 2));
+	if (force != 0) {
+		if (init_wipe_dev (session_file, blocksize, header_pad) != 0) {
+			return 1;
+		}
+	}
+	else if (check_blank_device(session_file)) {
 		return 1;
 	}
 
@@ -121,8 +222,22 @@ int init_dev(struct bdl_io_file *session_file, long int blocksize, long int head
 
 	header.hash = hash;
 
+	struct bdl_arena_mark mark;
+	arena_get_mark (&session_file->arena, &mark);
+
+	int pad_size = header_pad - sizeof(header);
+	char *header_pad_string = arena_alloc (&session_file->arena, pad_size);
+	if (header_pad_string == NULL) {
+		fprintf (stderr, "Could not allocate header pad\n");
+		return 1;
+	}
+
+	memset (header_pad_string, padchar, pad_size);
+
 	int write_result = io_write_block(session_file, 0, (const char *) &header, sizeof(header), header_pad_string, pad_size, 1);
 
+	arena_release (&session_file->arena, &mark);
+
 	if (write_result != 0) {
 		fprintf (stderr, "Failed to write header to device\n");
 		return 1;
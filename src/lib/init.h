@@ -22,4 +22,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "io.h"
 #include "../include/bdl.h"
 
-int init_dev(struct bdl_io_file *file, long int blocksize, long int header_pad, char padchar);
+void init_choose_layout (
+		const struct bdl_io_geometry *geometry,
+		unsigned long int *blocksize,
+		unsigned long int *header_pad
+);
+int init_dev(struct bdl_io_file *file, long int blocksize, long int header_pad, char padchar, int force);
@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 
 #include "../cmdlineparser/cmdline.h"
@@ -35,38 +36,173 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "read.h"
 #include "clear.h"
 #include "update.h"
+#include "ingest.h"
+#include "shared.h"
+#include "stats.h"
 #include "../include/bdl.h"
 
+int bdl_follow (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq, int from_head, unsigned long int limit
+) {
+	return read_follow(session, timestamp_gteq, from_head, limit, session->read_format, &session->read_filter, NULL, NULL);
+}
+
+int bdl_follow_cb (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq, int from_head, unsigned long int limit,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+) {
+	return read_follow(session, timestamp_gteq, from_head, limit, BDL_READ_FORMAT_TEXT, &session->read_filter, callback, arg);
+}
+
 int bdl_write_block (
 		struct bdl_session *session, const char *data, unsigned long int data_length,
 		uint64_t appdata, uint64_t timestamp, unsigned long int faketimestamp
 );
 
+/*
+ * Get the master header kept in the session. Returns BDL_WRITE_ERR_IO on error
+ * and BDL_WRITE_ERR_CORRUPT if the header is not valid.
+ */
+int interface_get_master_header (struct bdl_session *session, const struct bdl_header **header) {
+	int result;
+
+	if (session_get_master_header(session, header, &result) != 0) {
+		fprintf (stderr, "Could not get header from device\n");
+		return BDL_WRITE_ERR_IO;
+	}
+
+	if (result != 0) {
+		fprintf (stderr, "Invalid header of device\n");
+		return BDL_WRITE_ERR_CORRUPT;
+	}
+
+	return 0;
+}
+
 int bdl_clear_dev (struct bdl_session *session, int *result) {
-	return clear_dev(&session->device, result);
+	const struct bdl_header *header;
+	int ret = interface_get_master_header(session, &header);
+
+	if (ret == BDL_WRITE_ERR_CORRUPT) {
+		*result = 1;
+		return 0;
+	}
+	else if (ret != 0) {
+		return 1;
+	}
+
+	write_head_cache_reset (&session->device);
+
+	if (clear_dev(&session->device, header, result) != 0) {
+		return 1;
+	}
+
+	// Processes sharing the device must search for the head again
+	return shared_publish_head(&session->device, 0, 0, 0);
 }
 
 int bdl_validate_dev (struct bdl_session *session, int *result) {
-	return validate_dev(&session->device, result);
+	return session_revalidate_master_header(session, result);
+}
+
+int bdl_get_stats (
+		struct bdl_session *session,
+		struct bdl_stats *stats,
+		int (*callback)(void *arg, const struct bdl_region_stats *region),
+		void *arg,
+		int *result
+) {
+	const struct bdl_header *header;
+	int ret = interface_get_master_header(session, &header);
+
+	if (ret == BDL_WRITE_ERR_CORRUPT) {
+		*result = 1;
+		return 0;
+	}
+	else if (ret != 0) {
+		return 1;
+	}
+
+	return stats_get(&session->device, header, stats, callback, arg, result);
+}
+
+int interface_print_region_stats (void *arg, const struct bdl_region_stats *region) {
+	(void) arg;
+
+	printf ("REGION:%" PRIu64 ":%i:%" PRIu64 ":%" PRIu64 "\n",
+			region->hintblock_position, region->used, region->block_count, region->highest_timestamp);
+	return 0;
 }
 
 int bdl_read_blocks (
 		struct bdl_session *session,
 		uint64_t timestamp_gteq, unsigned long int limit
 ) {
-	return read_blocks(&session->device, timestamp_gteq, limit);
+	const struct bdl_header *header;
+	if (interface_get_master_header(session, &header) != 0) {
+		return 1;
+	}
+
+	return read_blocks(&session->device, header, timestamp_gteq, limit, session->threads, session->read_format, session->read_reverse, &session->read_filter);
+}
+
+int bdl_read_blocks_cb (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq, unsigned long int limit,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+) {
+	const struct bdl_header *header;
+	if (interface_get_master_header(session, &header) != 0) {
+		return 1;
+	}
+
+	return read_blocks_cb(&session->device, header, timestamp_gteq, limit, session->threads, BDL_READ_FORMAT_TEXT, session->read_reverse, &session->read_filter, callback, arg);
 }
 
 int bdl_write_block (
 		struct bdl_session *session, const char *data, unsigned long int data_length,
 		uint64_t appdata, uint64_t timestamp, unsigned long int faketimestamp
 ) {
+	const struct bdl_header *header;
+	int ret;
+	if ((ret = interface_get_master_header(session, &header)) != 0) {
+		return ret;
+	}
+
 	return write_put_block(
 		&session->device,
+		header,
 		data, data_length,
 		appdata,
 		timestamp,
-		faketimestamp
+		faketimestamp,
+		session->compression,
+		&session->time_source
+	);
+}
+
+int bdl_write_blocks_packed (
+		struct bdl_session *session,
+		const struct bdl_write_entry *entries, unsigned long int entry_count,
+		unsigned long int faketimestamp
+) {
+	const struct bdl_header *header;
+	int ret;
+	if ((ret = interface_get_master_header(session, &header)) != 0) {
+		return ret;
+	}
+
+	return write_put_packed_blocks (
+		&session->device,
+		header,
+		entries, entry_count,
+		faketimestamp,
+		session->compression,
+		&session->time_source
 	);
 }
 
@@ -78,18 +214,28 @@ int bdl_read_update_application_data (
 	void *arg,
 	int *result
 ) {
-	return update_application_data (&session->device, timestamp_min, application_data_and, test, arg, result);
+	const struct bdl_header *header;
+	int ret;
+	if ((ret = interface_get_master_header(session, &header)) != 0) {
+		*result = 0;
+		return ret;
+	}
+
+	return update_application_data (&session->device, header, timestamp_min, application_data_and, test, arg, result);
 }
 
-int bdl_init_dev (
+int interface_init_dev (
 		struct bdl_session *session,
-		unsigned long int blocksize, unsigned long int header_pad, char padchar
+		unsigned long int blocksize, unsigned long int header_pad, char padchar,
+		int force
 ) {
-	if (blocksize == 0) {
-		blocksize = BDL_DEFAULT_BLOCKSIZE;
-	}
-	if (header_pad == 0) {
-		header_pad = BDL_DEFAULT_HEADER_PAD;
+	if (blocksize == 0 || header_pad == 0) {
+		struct bdl_io_geometry geometry;
+		if (io_get_geometry(&session->device, &geometry) != 0) {
+			return 1;
+		}
+
+		init_choose_layout(&geometry, &blocksize, &header_pad);
 	}
 
 	if (blocksize > BDL_MAXIMUM_BLOCKSIZE) {
@@ -104,6 +250,10 @@ int bdl_init_dev (
 		fprintf(stderr, "Error: Blocksize needs to be dividable by %i\n", BDL_BLOCKSIZE_DIVISOR);
 		return 1;
 	}
+	if ((BDL_DEFAULT_HINTBLOCK_SPACING / 2) % blocksize != 0) {
+		fprintf(stderr, "Error: Blocksize needs to divide %i\n", BDL_DEFAULT_HINTBLOCK_SPACING / 2);
+		return 1;
+	}
 	if (header_pad < BDL_MINIMUM_HEADER_PAD) {
 		fprintf(stderr, "Error: Header pad was too small, minimum is %i\n", BDL_MINIMUM_HEADER_PAD);
 		return 1;
@@ -113,7 +263,137 @@ int bdl_init_dev (
 		return 1;
 	}
 
-	return init_dev(&session->device, blocksize, header_pad, padchar);
+	// The header kept in the session is replaced
+	session->master_header_valid = 0;
+
+	if (init_dev(&session->device, blocksize, header_pad, padchar, force) != 0) {
+		return 1;
+	}
+
+	// Processes sharing the device must search for the head again
+	return shared_publish_head(&session->device, 0, 0, 0);
+}
+
+int bdl_init_dev (
+		struct bdl_session *session,
+		unsigned long int blocksize, unsigned long int header_pad, char padchar
+) {
+	return interface_init_dev (session, blocksize, header_pad, padchar, 0);
+}
+
+int bdl_init_dev_force (
+		struct bdl_session *session,
+		unsigned long int blocksize, unsigned long int header_pad, char padchar
+) {
+	return interface_init_dev (session, blocksize, header_pad, padchar, 1);
+}
+
+int interface_parse_compression (const char *compress_string, int *compression) {
+	if (strcmp(compress_string, "lz") == 0) {
+		*compression = BDL_COMPRESSION_LZ;
+	}
+	else if (strcmp(compress_string, "none") == 0) {
+		*compression = BDL_COMPRESSION_NONE;
+	}
+	else {
+		fprintf(stderr, "Error: Unknown compression '%s', use compress=lz or compress=none\n", compress_string);
+		return 1;
+	}
+
+	return 0;
+}
+
+int interface_parse_read_format (const char *format_string, int *format) {
+	if (strcmp(format_string, "text") == 0) {
+		*format = BDL_READ_FORMAT_TEXT;
+	}
+	else if (strcmp(format_string, "binary") == 0) {
+		*format = BDL_READ_FORMAT_BINARY;
+	}
+	else if (strcmp(format_string, "raw") == 0) {
+		*format = BDL_READ_FORMAT_RAW;
+	}
+	else {
+		fprintf(stderr, "Error: Unknown format '%s', use format=text, format=binary or format=raw\n", format_string);
+		return 1;
+	}
+
+	return 0;
+}
+
+int interface_parse_yes_no (const char *key, const char *string, int *value) {
+	if (strcmp(string, "yes") == 0) {
+		*value = 1;
+	}
+	else if (strcmp(string, "no") == 0) {
+		*value = 0;
+	}
+	else {
+		fprintf(stderr, "Error: Could not interpret %s argument '%s', use %s=yes or %s=no\n", key, string, key, key);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The discard argument applies to one command only, the setting of the session is put
+ * back afterwards. If discarding failed during the command and was turned off for the
+ * session, it stays off.
+ */
+void interface_override_discard (struct bdl_session *session, const char *discard_string, int discard, int *discard_orig) {
+	*discard_orig = session->device.discard;
+
+	if (discard_string != NULL) {
+		bdl_set_discard(session, discard);
+	}
+}
+
+void interface_restore_discard (struct bdl_session *session, const char *discard_string, int discard, int discard_orig) {
+	if (discard_string != NULL && session->device.discard == discard) {
+		session->device.discard = discard_orig;
+	}
+}
+
+/* Parse the ts_lt, appdata and appdata_mask arguments of the read and follow commands */
+int interface_parse_read_filter (struct cmd_data *cmd_data, struct bdl_read_filter *filter) {
+	const char *timestamp_lt_string = cmd_get_value(cmd_data, "ts_lt");
+	const char *appdata_string = cmd_get_value(cmd_data, "appdata");
+	const char *appdata_mask_string = cmd_get_value(cmd_data, "appdata_mask");
+
+	memset (filter, '\0', sizeof(*filter));
+
+	if (timestamp_lt_string != NULL) {
+		if (cmd_convert_uint64_10(cmd_data, "ts_lt") != 0) {
+			fprintf(stderr, "Error: Could not interpret timestamp less than argument, use ts_lt=POSITIVE INTEGER\n");
+			return 1;
+		}
+		filter->timestamp_lt = cmd_get_uint64(cmd_data, "ts_lt");
+	}
+
+	// Without a mask, the application data must match exactly
+	if (appdata_string != NULL) {
+		if (cmd_convert_hex_64(cmd_data, "appdata") != 0) {
+			fprintf(stderr, "Error: Could not interpret application data argument, use appdata=HEXNUMBER\n");
+			return 1;
+		}
+		filter->appdata_value = cmd_get_hex_64(cmd_data, "appdata");
+		filter->appdata_mask = 0xffffffffffffffff;
+	}
+	if (appdata_mask_string != NULL) {
+		if (cmd_convert_hex_64(cmd_data, "appdata_mask") != 0) {
+			fprintf(stderr, "Error: Could not interpret application data mask argument, use appdata_mask=HEXNUMBER\n");
+			return 1;
+		}
+		filter->appdata_mask = cmd_get_hex_64(cmd_data, "appdata_mask");
+	}
+
+	if ((filter->appdata_value & ~filter->appdata_mask) != 0) {
+		fprintf(stderr, "Error: Application data argument has bits outside of appdata_mask\n");
+		return 1;
+	}
+
+	return 0;
 }
 
 void help() {
@@ -135,11 +415,22 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 	else if (cmd_match(&cmd_data, "open")) {
 		// Start a session, and write commands line by line (from STDIN)
 		const char *device_path = cmd_get_value(&cmd_data, "dev");
+		const char *readonly_string = cmd_get_value(&cmd_data, "readonly");
+		const char *shared_string = cmd_get_value(&cmd_data, "shared");
+
+		int readonly = 0;
+		int shared = 0;
 
 		if (device_path == NULL) {
 			fprintf(stderr, "Error: Device argument was missing for open command, use 'open dev=DEVICE'\n");
 			return 1;
 		}
+		if (readonly_string != NULL && interface_parse_yes_no("readonly", readonly_string, &readonly) != 0) {
+			return 1;
+		}
+		if (shared_string != NULL && interface_parse_yes_no("shared", shared_string, &shared) != 0) {
+			return 1;
+		}
 
 		if (cmd_check_all_args_used(&cmd_data)) {
 			return 1;
@@ -150,7 +441,7 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 			return 1;
 		}
 
-		if (bdl_start_session(session, device_path, 0) != 0) {
+		if (bdl_start_session(session, device_path, (readonly ? BDL_SESSION_READONLY : 0) | (shared ? BDL_SESSION_SHARED : 0)) != 0) {
 			fprintf (stderr, "Error while opening device for session use\n");
 			return 1;
 		}
@@ -166,6 +457,13 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 	}
 	else if (cmd_match(&cmd_data, "clear")) {
 		const char *device_string = cmd_get_value(&cmd_data, "dev");
+		const char *discard_string = cmd_get_value(&cmd_data, "discard");
+
+		int discard = 0;
+
+		if (discard_string != NULL && interface_parse_yes_no("discard", discard_string, &discard) != 0) {
+			return 1;
+		}
 
 		if (cmd_check_all_args_used(&cmd_data)) {
 			return 1;
@@ -176,8 +474,15 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 			return 1;
 		}
 
+		int discard_orig;
+		interface_override_discard(session, discard_string, discard, &discard_orig);
+
 		int result;
-		if (clear_dev(&session->device, &result) != 0) {
+		int ret = bdl_clear_dev(session, &result);
+
+		interface_restore_discard(session, discard_string, discard, discard_orig);
+
+		if (ret != 0) {
 			fprintf (stderr, "Error while clearing device\n");
 			bdl_close_session(session);
 			return 1;
@@ -206,7 +511,7 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 		}
 
 		int result;
-		if (validate_dev(&session->device, &result) != 0) {
+		if (bdl_validate_dev(session, &result) != 0) {
 			fprintf (stderr, "Error while validating device\n");
 			bdl_close_session(session);
 			return 1;
@@ -221,13 +526,82 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 
 		bdl_close_session(session);
 	}
+	else if (cmd_match(&cmd_data, "stats")) {
+		const char *device_string = cmd_get_value(&cmd_data, "dev");
+		const char *regions_string = cmd_get_value(&cmd_data, "regions");
+		const char *readonly_string = cmd_get_value(&cmd_data, "readonly");
+		const char *shared_string = cmd_get_value(&cmd_data, "shared");
+
+		int regions = 0;
+		int readonly = 0;
+		int shared = 0;
+
+		if (regions_string != NULL && interface_parse_yes_no("regions", regions_string, &regions) != 0) {
+			return 1;
+		}
+		if (readonly_string != NULL && interface_parse_yes_no("readonly", readonly_string, &readonly) != 0) {
+			return 1;
+		}
+		if (shared_string != NULL && interface_parse_yes_no("shared", shared_string, &shared) != 0) {
+			return 1;
+		}
+
+		if (cmd_check_all_args_used(&cmd_data)) {
+			return 1;
+		}
+
+		if (bdl_start_session (session, device_string, (readonly ? BDL_SESSION_READONLY : 0) | (shared ? BDL_SESSION_SHARED : 0)) != 0) {
+			fprintf (stderr, "Could not start session for stats command\n");
+			return 1;
+		}
+
+		int result;
+		struct bdl_stats stats;
+		if (bdl_get_stats(session, &stats, (regions ? interface_print_region_stats : NULL), NULL, &result) != 0) {
+			fprintf (stderr, "Error while getting statistics of device\n");
+			bdl_close_session(session);
+			return 1;
+		}
+
+		if (result != 0) {
+			fprintf (stderr, "Device was not valid, must be initialized\n");
+			bdl_close_session(session);
+			return 1;
+		}
+
+		printf ("block_size: %" PRIu64 "\n", stats.block_size);
+		printf ("region_count: %" PRIu64 "\n", stats.region_count);
+		printf ("region_capacity: %" PRIu64 "\n", stats.region_capacity);
+		printf ("regions_used: %" PRIu64 "\n", stats.regions_used);
+		printf ("regions_free: %" PRIu64 "\n", stats.regions_free);
+		printf ("blocks_used: %" PRIu64 "\n", stats.blocks_used);
+		printf ("oldest_timestamp: %" PRIu64 "\n", stats.oldest_timestamp);
+		printf ("newest_timestamp: %" PRIu64 "\n", stats.newest_timestamp);
+		printf ("head_hintblock_position: %" PRIu64 "\n", stats.head_hintblock_position);
+		printf ("head_block_position: %" PRIu64 "\n", stats.head_block_position);
+		printf ("next_hintblock_position: %" PRIu64 "\n", stats.next_hintblock_position);
+		printf ("next_region_used: %s\n", (stats.next_region_used ? "yes" : "no"));
+
+		bdl_close_session(session);
+	}
 	else if (cmd_match(&cmd_data, "read")) {
 		const char *device_string = cmd_get_value(&cmd_data, "dev");
 		const char *timestamp_gteq_string = cmd_get_value(&cmd_data, "ts_gteq");
 		const char *limit_string = cmd_get_value(&cmd_data, "limit");
+		const char *threads_string = cmd_get_value(&cmd_data, "threads");
+		const char *format_string = cmd_get_value(&cmd_data, "format");
+		const char *readonly_string = cmd_get_value(&cmd_data, "readonly");
+		const char *shared_string = cmd_get_value(&cmd_data, "shared");
+		const char *reverse_string = cmd_get_value(&cmd_data, "reverse");
 
 		uint64_t timestamp_gteq = 0;
 		unsigned long int limit = 0;
+		int threads = 0;
+		int format = BDL_READ_FORMAT_TEXT;
+		int readonly = 0;
+		int shared = 0;
+		int reverse = 0;
+		struct bdl_read_filter filter;
 
 		if (timestamp_gteq_string != NULL) {
 			if (cmd_convert_uint64_10(&cmd_data, "ts_gteq")) {
@@ -250,17 +624,68 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 
 			limit = limit_tmp;
 		}
+		if (threads_string != NULL) {
+			if (cmd_convert_integer_10 (&cmd_data, "threads") != 0) {
+				fprintf (stderr, "Error: Could not interpret threads argument, use threads=POSITIVE INTEGER\n");
+				return 1;
+			}
+
+			long int threads_tmp = cmd_get_integer(&cmd_data, "threads");
+			if (threads_tmp < 1 || threads_tmp > BDL_SCAN_THREADS_MAX) {
+				fprintf (stderr, "Error: Threads argument must be between 1 and %i\n", BDL_SCAN_THREADS_MAX);
+				return 1;
+			}
+
+			threads = threads_tmp;
+		}
+		if (format_string != NULL && interface_parse_read_format(format_string, &format) != 0) {
+			return 1;
+		}
+		if (reverse_string != NULL && interface_parse_yes_no("reverse", reverse_string, &reverse) != 0) {
+			return 1;
+		}
+		if (interface_parse_read_filter(&cmd_data, &filter) != 0) {
+			return 1;
+		}
+		if (readonly_string != NULL && interface_parse_yes_no("readonly", readonly_string, &readonly) != 0) {
+			return 1;
+		}
+		if (shared_string != NULL && interface_parse_yes_no("shared", shared_string, &shared) != 0) {
+			return 1;
+		}
 
 		if (cmd_check_all_args_used(&cmd_data)) {
 			return 1;
 		}
 
-		if (bdl_start_session (session, device_string, 0) != 0) {
+		if (bdl_start_session (session, device_string, (readonly ? BDL_SESSION_READONLY : 0) | (shared ? BDL_SESSION_SHARED : 0)) != 0) {
 			fprintf (stderr, "Could not start session for read command\n");
 			return 1;
 		}
 
-		if (read_blocks(&session->device, timestamp_gteq, limit) != 0) {
+		int threads_orig = session->threads;
+		int format_orig = session->read_format;
+		int reverse_orig = session->read_reverse;
+		struct bdl_read_filter filter_orig = session->read_filter;
+		if (threads != 0) {
+			bdl_set_threads(session, threads);
+		}
+		if (format_string != NULL) {
+			bdl_set_read_format(session, format);
+		}
+		if (reverse_string != NULL) {
+			bdl_set_read_reverse(session, reverse);
+		}
+		session->read_filter = filter;
+
+		int ret = bdl_read_blocks(session, timestamp_gteq, limit);
+
+		session->threads = threads_orig;
+		session->read_format = format_orig;
+		session->read_reverse = reverse_orig;
+		session->read_filter = filter_orig;
+
+		if (ret != 0) {
 			fprintf (stderr, "Error while reading blocks\n");
 			bdl_close_session(session);
 			return 1;
@@ -268,11 +693,93 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 
 		bdl_close_session(session);
 	}
+	else if (cmd_match(&cmd_data, "follow")) {
+		const char *device_string = cmd_get_value(&cmd_data, "dev");
+		const char *timestamp_gteq_string = cmd_get_value(&cmd_data, "ts_gteq");
+		const char *limit_string = cmd_get_value(&cmd_data, "limit");
+		const char *format_string = cmd_get_value(&cmd_data, "format");
+		const char *readonly_string = cmd_get_value(&cmd_data, "readonly");
+		const char *shared_string = cmd_get_value(&cmd_data, "shared");
+
+		uint64_t timestamp_gteq = 0;
+		unsigned long int limit = 0;
+		int format = BDL_READ_FORMAT_TEXT;
+		int readonly = 0;
+		int shared = 0;
+		struct bdl_read_filter filter;
+
+		if (timestamp_gteq_string != NULL) {
+			if (cmd_convert_uint64_10(&cmd_data, "ts_gteq")) {
+				fprintf(stderr, "Error: Could not interpret timestamp greater or equal argument, use ts_gteq=POSITIVE INTEGER\n");
+				return 1;
+			}
+			timestamp_gteq = cmd_get_uint64(&cmd_data, "ts_gteq");
+		}
+		if (limit_string != NULL) {
+			if (cmd_convert_integer_10 (&cmd_data, "limit") != 0) {
+				fprintf (stderr, "Error: Could not interpret limit argument, use limit=POSITIVE INTEGER\n");
+				return 1;
+			}
+
+			long int limit_tmp = cmd_get_integer(&cmd_data, "limit");
+			if (limit_tmp < 0) {
+				fprintf (stderr, "Error: Limit argument was less than zero\n");
+				return 1;
+			}
+
+			limit = limit_tmp;
+		}
+		if (format_string != NULL && interface_parse_read_format(format_string, &format) != 0) {
+			return 1;
+		}
+		if (interface_parse_read_filter(&cmd_data, &filter) != 0) {
+			return 1;
+		}
+		if (readonly_string != NULL && interface_parse_yes_no("readonly", readonly_string, &readonly) != 0) {
+			return 1;
+		}
+		if (shared_string != NULL && interface_parse_yes_no("shared", shared_string, &shared) != 0) {
+			return 1;
+		}
+
+		if (cmd_check_all_args_used(&cmd_data)) {
+			return 1;
+		}
+
+		if (bdl_start_session (session, device_string, (readonly ? BDL_SESSION_READONLY : 0) | (shared ? BDL_SESSION_SHARED : 0)) != 0) {
+			fprintf (stderr, "Could not start session for follow command\n");
+			return 1;
+		}
+
+		int format_orig = session->read_format;
+		struct bdl_read_filter filter_orig = session->read_filter;
+		if (format_string != NULL) {
+			bdl_set_read_format(session, format);
+		}
+		session->read_filter = filter;
+
+		// Without a timestamp, only records written from now on are printed
+		int ret = bdl_follow(session, timestamp_gteq, (timestamp_gteq_string == NULL), limit);
+
+		session->read_format = format_orig;
+		session->read_filter = filter_orig;
+
+		if (ret != 0) {
+			fprintf (stderr, "Error while following device\n");
+			bdl_close_session(session);
+			return 1;
+		}
+
+		bdl_close_session(session);
+	}
 	else if (cmd_match(&cmd_data, "write")) {
 		const char *device_string = cmd_get_value(&cmd_data, "dev");
 		const char *appdata_string = cmd_get_value(&cmd_data, "appdata");
 		const char *timestamp_string = cmd_get_value(&cmd_data, "timestamp");
 		const char *faketimestamp_string = cmd_get_value(&cmd_data, "faketimestamp");
+		const char *compress_string = cmd_get_value(&cmd_data, "compress");
+		const char *discard_string = cmd_get_value(&cmd_data, "discard");
+		const char *shared_string = cmd_get_value(&cmd_data, "shared");
 		const char *data = cmd_get_last_argument(&cmd_data);
 
 		// TODO : Create synced write argument, sync after every write
@@ -280,6 +787,9 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 		uint64_t appdata = 0;
 		uint64_t timestamp = 0;
 		unsigned long int faketimestamp = 0;
+		int compression = session->compression;
+		int discard = 0;
+		int shared = 0;
 
 		if (data == NULL || *data == '\0') {
 			fprintf(stderr, "Error: Data argument was missing for write command, use 'write dev=DEVICE [...] DATA'\n");
@@ -316,24 +826,192 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 
 			faketimestamp = faketimestamp_tmp;
 		}
+		if (compress_string != NULL && interface_parse_compression(compress_string, &compression) != 0) {
+			return 1;
+		}
+		if (discard_string != NULL && interface_parse_yes_no("discard", discard_string, &discard) != 0) {
+			return 1;
+		}
+		if (shared_string != NULL && interface_parse_yes_no("shared", shared_string, &shared) != 0) {
+			return 1;
+		}
 
 		// Check that the user hasn't specified anything funny at the command line
 		if (cmd_check_all_args_used(&cmd_data)) {
 			return 1;
 		}
 
-		if (bdl_start_session(session, device_string, 0) != 0) {
+		if (bdl_start_session(session, device_string, (shared ? BDL_SESSION_SHARED : 0)) != 0) {
 			fprintf (stderr, "Could not start session for write command\n");
 			return 1;
 		}
 
-		if (write_put_block(
+		const struct bdl_header *header;
+		if (interface_get_master_header(session, &header) != 0) {
+			bdl_close_session(session);
+			return 1;
+		}
+
+		int discard_orig;
+		interface_override_discard(session, discard_string, discard, &discard_orig);
+
+		int ret = write_put_block(
 				&session->device,
+				header,
 				data, strlen(data)+1,
 				appdata,
 				timestamp,
-				faketimestamp
-		) != 0) {
+				faketimestamp,
+				compression,
+				&session->time_source
+		);
+
+		interface_restore_discard(session, discard_string, discard, discard_orig);
+
+		if (ret != 0) {
+			bdl_close_session(session);
+			return 1;
+		}
+
+		bdl_close_session(session);
+	}
+	else if (cmd_match(&cmd_data, "ingest")) {
+		const char *device_string = cmd_get_value(&cmd_data, "dev");
+		const char *delimiter_string = cmd_get_value(&cmd_data, "delimiter");
+		const char *batch_string = cmd_get_value(&cmd_data, "batch");
+		const char *interval_string = cmd_get_value(&cmd_data, "interval");
+		const char *appdata_string = cmd_get_value(&cmd_data, "appdata");
+		const char *faketimestamp_string = cmd_get_value(&cmd_data, "faketimestamp");
+		const char *compress_string = cmd_get_value(&cmd_data, "compress");
+		const char *discard_string = cmd_get_value(&cmd_data, "discard");
+		const char *shared_string = cmd_get_value(&cmd_data, "shared");
+
+		int delimiter = BDL_INGEST_DELIMITER_NEWLINE;
+		unsigned long int batch_size = BDL_INGEST_DEFAULT_BATCH_SIZE;
+		unsigned long int flush_interval_ms = BDL_INGEST_DEFAULT_FLUSH_INTERVAL_MS;
+		uint64_t appdata = 0;
+		unsigned long int faketimestamp = 0;
+		int compression = session->compression;
+		int discard = 0;
+		int shared = 0;
+
+		if (delimiter_string != NULL) {
+			if (strcmp(delimiter_string, "newline") == 0) {
+				delimiter = BDL_INGEST_DELIMITER_NEWLINE;
+			}
+			else if (strcmp(delimiter_string, "length") == 0) {
+				delimiter = BDL_INGEST_DELIMITER_LENGTH;
+			}
+			else {
+				fprintf(stderr, "Error: Unknown delimiter '%s', use delimiter=newline or delimiter=length\n", delimiter_string);
+				return 1;
+			}
+		}
+		if (batch_string != NULL) {
+			if (cmd_convert_integer_10(&cmd_data, "batch") != 0) {
+				fprintf(stderr, "Error: Could not interpret batch argument, use batch=NUM\n");
+				return 1;
+			}
+
+			long int batch_tmp = cmd_get_integer(&cmd_data, "batch");
+
+			if (batch_tmp <= 0) {
+				fprintf (stderr, "Error: Batch size must be at least 1\n");
+				return 1;
+			}
+
+			batch_size = batch_tmp;
+		}
+		if (interval_string != NULL) {
+			if (cmd_convert_integer_10(&cmd_data, "interval") != 0) {
+				fprintf(stderr, "Error: Could not interpret interval argument, use interval=MS\n");
+				return 1;
+			}
+
+			long int interval_tmp = cmd_get_integer(&cmd_data, "interval");
+
+			if (interval_tmp < 0) {
+				fprintf (stderr, "Error: Flush interval was negative\n");
+				return 1;
+			}
+
+			flush_interval_ms = interval_tmp;
+		}
+		if (appdata_string != NULL) {
+			if (cmd_convert_hex_64(&cmd_data, "appdata") != 0) {
+				fprintf(stderr, "Error: Could not interpret appdata argument, use appdata=HEX64\n");
+				return 1;
+			}
+
+			appdata = cmd_get_hex_64(&cmd_data, "appdata");
+		}
+		if (faketimestamp_string != NULL) {
+			if (cmd_convert_integer_10(&cmd_data, "faketimestamp") != 0) {
+				fprintf(stderr, "Error: Could not interpret faketimestamp argument, use faketimestamp=NUM\n");
+				return 1;
+			}
+
+			long int faketimestamp_tmp = cmd_get_integer(&cmd_data, "faketimestamp");
+
+			if (faketimestamp_tmp < 0) {
+				fprintf (stderr, "Error: Fake timestamp was negative\n");
+				return 1;
+			}
+
+			faketimestamp = faketimestamp_tmp;
+		}
+		if (compress_string != NULL && interface_parse_compression(compress_string, &compression) != 0) {
+			return 1;
+		}
+
+		if (discard_string != NULL && interface_parse_yes_no("discard", discard_string, &discard) != 0) {
+			return 1;
+		}
+		if (shared_string != NULL && interface_parse_yes_no("shared", shared_string, &shared) != 0) {
+			return 1;
+		}
+
+		if (cmd_check_all_args_used(&cmd_data)) {
+			return 1;
+		}
+
+		// Commands of interactive sessions are also read from STDIN
+		if (session->usercount != 0) {
+			fprintf (stderr, "Error: ingest cannot be used while a device is open\n");
+			return 1;
+		}
+
+		if (bdl_start_session(session, device_string, (shared ? BDL_SESSION_SHARED : 0)) != 0) {
+			fprintf (stderr, "Could not start session for ingest command\n");
+			return 1;
+		}
+
+		const struct bdl_header *header;
+		if (interface_get_master_header(session, &header) != 0) {
+			bdl_close_session(session);
+			return 1;
+		}
+
+		int discard_orig;
+		interface_override_discard(session, discard_string, discard, &discard_orig);
+
+		int ret = ingest_stream (
+				&session->device,
+				header,
+				fileno(stdin),
+				delimiter,
+				batch_size,
+				flush_interval_ms,
+				appdata,
+				faketimestamp,
+				compression,
+				&session->time_source
+		);
+
+		interface_restore_discard(session, discard_string, discard, discard_orig);
+
+		if (ret != 0) {
+			fprintf (stderr, "Error while ingesting records\n");
 			bdl_close_session(session);
 			return 1;
 		}
@@ -345,10 +1023,13 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 		const char *bs_string = cmd_get_value(&cmd_data, "bs");
 		const char *hpad_string = cmd_get_value(&cmd_data, "hpad");
 		const char *padchar_string = cmd_get_value(&cmd_data, "padchar");
+		const char *force_string = cmd_get_value(&cmd_data, "force");
 
-		unsigned long int blocksize = BDL_DEFAULT_BLOCKSIZE;
-		unsigned long int header_pad = BDL_DEFAULT_HEADER_PAD;
+		// Chosen from the geometry of the device if not given
+		unsigned long int blocksize = 0;
+		unsigned long int header_pad = 0;
 		char padchar = BDL_DEFAULT_PAD_CHAR;
+		int force = 0;
 
 		// Parse block size argument
 		if (bs_string != NULL) {
@@ -394,6 +1075,10 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 			padchar = cmd_get_hex_byte(&cmd_data, "padchar");
 		}
 
+		if (force_string != NULL && interface_parse_yes_no("force", force_string, &force) != 0) {
+			return 1;
+		}
+
 		// Check that the user hasn't specified anything funny at the command line
 		if (cmd_check_all_args_used(&cmd_data)) {
 			return 1;
@@ -405,7 +1090,7 @@ int bdl_interpret_command (struct bdl_session *session, int argc, const char *ar
 		}
 
 		/* Don't call init_dev directly as we need to perform more checks */
-		if (bdl_init_dev(session, blocksize, header_pad, padchar)) {
+		if (interface_init_dev(session, blocksize, header_pad, padchar, force)) {
 			fprintf (stderr, "Device intialization failed\n");
 			bdl_close_session(session);
 			return 1;
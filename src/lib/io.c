@@ -19,6 +19,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+// For fallocate
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -26,13 +29,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <sys/mman.h>
+#include <sys/inotify.h>
 
 #include "io.h"
+#include "arena.h"
 #include "defaults.h"
 #include "../include/bdl.h"
 
@@ -72,23 +79,97 @@ int io_get_file_size(FILE *file, const char *filepath, unsigned long long int *s
 	return 0;
 }
 
+/* Returns 1 if the value does not exist */
+int io_read_sysfs_value (const char *path, unsigned long int *value) {
+	FILE *file = fopen (path, "r");
+	if (file == NULL) {
+		return 1;
+	}
+
+	int ret = (fscanf (file, "%lu", value) == 1 ? 0 : 1);
+
+	fclose (file);
+
+	return ret;
+}
+
+/*
+ * Probe a block device in sysfs for its block and erase unit sizes. Partitions have no
+ * queue directory of their own, the one of the disk is used instead. Nothing is found
+ * for regular files.
+ */
+int io_get_geometry (struct bdl_io_file *file, struct bdl_io_geometry *geometry) {
+	memset (geometry, '\0', sizeof(*geometry));
+
+	struct stat params;
+	if (fstat (fileno(file->file), &params) != 0) {
+		fprintf (stderr, "Could not stat device while probing geometry: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!S_ISBLK(params.st_mode)) {
+		return 0;
+	}
+
+	const char *names[] = { "physical_block_size", "optimal_io_size", "discard_granularity" };
+	unsigned long int *values[] = {
+			&geometry->physical_block_size,
+			&geometry->optimal_io_size,
+			&geometry->discard_granularity
+	};
+
+	char path[128];
+	for (int i = 0; i < 3; i++) {
+		sprintf (path, "/sys/dev/block/%u:%u/queue/%s", major(params.st_rdev), minor(params.st_rdev), names[i]);
+		if (io_read_sysfs_value (path, values[i]) == 0) {
+			continue;
+		}
+
+		sprintf (path, "/sys/dev/block/%u:%u/../queue/%s", major(params.st_rdev), minor(params.st_rdev), names[i]);
+		if (io_read_sysfs_value (path, values[i]) != 0) {
+			*values[i] = 0;
+		}
+	}
+
+	// Partition start is given in 512 byte sectors
+	unsigned long int start;
+	sprintf (path, "/sys/dev/block/%u:%u/start", major(params.st_rdev), minor(params.st_rdev));
+	if (io_read_sysfs_value (path, &start) == 0) {
+		geometry->start_offset = start * 512;
+	}
+
+#ifdef BDL_DEBUG_IO
+	printf ("Geometry: physical block size %lu optimal io size %lu discard granularity %lu start %lu\n",
+			geometry->physical_block_size, geometry->optimal_io_size,
+			geometry->discard_granularity, geometry->start_offset
+	);
+#endif
+
+	return 0;
+}
+
 int io_close (struct bdl_io_file *file) {
 	int ret = 0;
 
-	if (file->memorymap != NULL) {
+	// Syncing a read-only map would only flush what other processes wrote
+	if (file->memorymap != NULL && !file->readonly) {
 		if (msync(file->memorymap, file->size, MS_SYNC) != 0) {
 			ret = 1;
 			fprintf (stderr, "Warning: Error while syncing with device, changes might have been lost: %s\n", strerror(errno));
 		}
+	}
 
+	if (file->memorymap != NULL) {
 		munmap(file->memorymap, file->size);
 	}
 
 	fclose (file->file);
+	arena_cleanup (&file->arena);
+
 	return ret;
 }
 
-int io_open(const char *path, struct bdl_io_file *file, int no_mmap) {
+int io_open(const char *path, struct bdl_io_file *file, int no_mmap, int readonly) {
 	char new_path[strlen(path) + 1];
 	sprintf (new_path, "%s", path);
 
@@ -99,14 +180,20 @@ int io_open(const char *path, struct bdl_io_file *file, int no_mmap) {
 		*at = '\0';
 	}
 
-	file->file = fopen(new_path, "r+");
+	file->file = fopen(new_path, (readonly ? "r" : "r+"));
 	file->seek = 0;
 	file->unsynced_write_bytes = 0;
 
 	file->sync_queue.count = 0;
+	file->discard = 0;
+	file->readonly = readonly;
+	file->shared_page = NULL;
+	file->shared_fd = -1;
+	arena_init (&file->arena);
+	memset (&file->head_cache, '\0', sizeof(file->head_cache));
 
 	if (file->file == NULL) {
-		fprintf (stderr, "Could not open device %s in mode r/w: %s\n", new_path, strerror(errno));
+		fprintf (stderr, "Could not open device %s in mode %s: %s\n", new_path, (readonly ? "r" : "r/w"), strerror(errno));
 		return 1;
 	}
 
@@ -167,7 +254,7 @@ int io_open(const char *path, struct bdl_io_file *file, int no_mmap) {
 	}
 
 	if (no_mmap == 0) {
-		file->memorymap = mmap(NULL, file->size, PROT_READ|PROT_WRITE, MAP_SHARED, fileno(file->file), 0);
+		file->memorymap = mmap(NULL, file->size, (readonly ? PROT_READ : PROT_READ|PROT_WRITE), MAP_SHARED, fileno(file->file), 0);
 		if (file->memorymap == MAP_FAILED) {
 			fprintf (stderr, "Memory mapping failed, file might be too big: %s\n", strerror(errno));
 			fprintf (stderr, "Fallback to standard IO\n");
@@ -257,6 +344,8 @@ int io_update_sync_queue(struct bdl_io_sync_queue *sync_queue, void *start, void
 }
 
 int io_sync(struct bdl_io_file *file) {
+	int ret = 0;
+
 	for (int i = 0; i < file->sync_queue.count; i++) {
 		struct bdl_io_sync_queue_entry *entry = &file->sync_queue.entries[i];
 
@@ -279,15 +368,56 @@ int io_sync(struct bdl_io_file *file) {
 
 		if (msync(entry->start_address, entry->end_address - entry->start_address, MS_SYNC) != 0) {
 			fprintf (stderr, "Warning: Error while syncing with device, changes might have been lost: %s\n", strerror(errno));
+			ret = 1;
 		}
 	}
 	file->unsynced_write_bytes = 0;
 	file->sync_queue.count = 0;
 
+	return ret;
+}
+
+/*
+ * Make everything written so far durable on the device. A memory map is synced like
+ * io_sync does, and buffered writes are flushed and synced with the device.
+ */
+int io_sync_durable(struct bdl_io_file *file) {
+	if (file->memorymap != NULL) {
+		return io_sync(file);
+	}
+
+	if (fflush (file->file) != 0 || fdatasync (fileno(file->file)) != 0) {
+		fprintf (stderr, "Error while syncing with device: %s\n", strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Without memory mapping, stdio answers reads from its buffer even after another
+ * process changed the device. Flushing writes out our own changes and drops what
+ * was read ahead, so the following reads see the device as it is now.
+ */
+int io_refresh(struct bdl_io_file *file) {
+	if (file->memorymap != NULL) {
+		return 0;
+	}
+
+	if (fflush (file->file) != 0) {
+		fprintf (stderr, "Error while flushing buffer of device: %s\n", strerror(errno));
+		return 1;
+	}
+
 	return 0;
 }
 
 int io_write(struct bdl_io_file *file, const void *source, unsigned int length) {
+	if (file->readonly) {
+		fprintf (stderr, "Attempted to write to device opened read-only\n");
+		return 1;
+	}
+
 	if (file->seek + length >= file->size) {
 		fprintf (stderr, "Attempted to write outside file\n");
 		return 1;
@@ -333,6 +463,10 @@ int io_write_block(
 		return 1;
 	}
 
+	if (padding_length == 0) {
+		return 0;
+	}
+
 	// Write padding
 	unsigned long int padding_pos = position + data_length;
 	if (io_seek (file, padding_pos) != 0) {
@@ -347,6 +481,226 @@ int io_write_block(
 	return 0;
 }
 
+/*
+ * Tell the kernel that an area will be used soon so that it is read in the background.
+ * This is only advice, errors are ignored.
+ */
+void io_advise_willneed (struct bdl_io_file *file, unsigned long int position, unsigned long int length) {
+	if (position >= file->size) {
+		return;
+	}
+	if (position + length > file->size) {
+		length = file->size - position;
+	}
+
+	if (file->memorymap != NULL) {
+		unsigned long int page_size = sysconf(_SC_PAGESIZE);
+		unsigned long int start = position - (position % page_size);
+		madvise ((char *) file->memorymap + start, position + length - start, MADV_WILLNEED);
+	}
+	else {
+		posix_fadvise (fileno(file->file), position, length, POSIX_FADV_WILLNEED);
+	}
+}
+
+/*
+ * Get an inotify descriptor which becomes readable when a regular file is written with
+ * write(). Writes through a memory map and to block devices are not seen, and
+ * *watch_fd is -1 if watching is not possible.
+ */
+int io_watch (struct bdl_io_file *file, int *watch_fd) {
+	*watch_fd = -1;
+
+	struct stat params;
+	if (fstat (fileno(file->file), &params) != 0) {
+		fprintf (stderr, "Could not stat file/device: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (!S_ISREG(params.st_mode)) {
+		return 0;
+	}
+
+	int fd = inotify_init1 (IN_NONBLOCK|IN_CLOEXEC);
+	if (fd < 0) {
+		return 0;
+	}
+
+	// The path we were opened with is not kept, go through our descriptor
+	char path[64];
+	sprintf (path, "/proc/self/fd/%i", fileno(file->file));
+
+	if (inotify_add_watch (fd, path, IN_MODIFY) < 0) {
+		close (fd);
+		return 0;
+	}
+
+	*watch_fd = fd;
+
+	return 0;
+}
+
+/*
+ * Tell the device that an area is not used anymore, only whole sectors inside it are
+ * discarded. Block devices get BLKDISCARD and regular files get a hole punched in them.
+ * Returns 1 if the device does not support this.
+ */
+int io_discard (struct bdl_io_file *file, unsigned long int position, unsigned long int length) {
+	if (file->readonly) {
+		fprintf (stderr, "Attempted to discard area of device opened read-only\n");
+		return 1;
+	}
+
+	unsigned long int begin = (position + BDL_IO_SECTOR_SIZE - 1) & ~((unsigned long int) BDL_IO_SECTOR_SIZE - 1);
+	unsigned long int end = (position + length) & ~((unsigned long int) BDL_IO_SECTOR_SIZE - 1);
+
+	if (end > file->size) {
+		end = file->size & ~((unsigned long int) BDL_IO_SECTOR_SIZE - 1);
+	}
+	if (end <= begin) {
+		return 0;
+	}
+
+#ifdef BDL_DEBUG_IO
+	printf ("Discard %lu bytes at %lu\n", end - begin, begin);
+#endif
+
+	// Buffered writes must reach the device first
+	if (file->memorymap == NULL) {
+		fflush (file->file);
+	}
+
+	struct stat params;
+	if (fstat (fileno(file->file), &params) != 0) {
+		fprintf (stderr, "Could not stat device while discarding: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (S_ISBLK(params.st_mode)) {
+		uint64_t range[2] = { begin, end - begin };
+		if (ioctl (fileno(file->file), BLKDISCARD, &range) != 0) {
+			fprintf (stderr, "Could not discard %lu bytes at %lu: %s\n", end - begin, begin, strerror(errno));
+			return 1;
+		}
+	}
+	else if (fallocate (fileno(file->file), FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, begin, end - begin) != 0) {
+		fprintf (stderr, "Could not punch hole of %lu bytes at %lu: %s\n", end - begin, begin, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill an area with zeros without writing them when possible, using BLKZEROOUT on
+ * block devices or by letting the filesystem zero a range of a file. Areas which are
+ * not aligned to sectors and devices without support are written to.
+ */
+int io_zero (struct bdl_io_file *file, unsigned long int position, unsigned long int length) {
+	static const char zeros[BDL_IO_ZERO_BUFFER_SIZE];
+
+	if (file->readonly) {
+		fprintf (stderr, "Attempted to zero area of device opened read-only\n");
+		return 1;
+	}
+
+	if (position + length > file->size) {
+		fprintf (stderr, "Attempted to zero area outside file\n");
+		return 1;
+	}
+
+	// Buffered writes must reach the device first
+	if (file->memorymap == NULL) {
+		fflush (file->file);
+	}
+
+	struct stat params;
+	if (fstat (fileno(file->file), &params) != 0) {
+		fprintf (stderr, "Could not stat device while zeroing: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (S_ISBLK(params.st_mode)) {
+		if (position % BDL_IO_SECTOR_SIZE == 0 && length % BDL_IO_SECTOR_SIZE == 0) {
+			uint64_t range[2] = { position, length };
+			if (ioctl (fileno(file->file), BLKZEROOUT, &range) == 0) {
+				return 0;
+			}
+		}
+	}
+	else if (	fallocate (fileno(file->file), FALLOC_FL_ZERO_RANGE|FALLOC_FL_KEEP_SIZE, position, length) == 0 ||
+				fallocate (fileno(file->file), FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, position, length) == 0
+	) {
+		return 0;
+	}
+
+#ifdef BDL_DEBUG_IO
+	printf ("Writing %lu bytes of zeros at %lu\n", length, position);
+#endif
+
+	while (length > 0) {
+		unsigned long int chunk = (length > sizeof(zeros) ? sizeof(zeros) : length);
+
+		if (io_write_block (file, position, zeros, chunk, NULL, 0, 1) != 0) {
+			fprintf (stderr, "Error while writing zeros at %lu\n", position);
+			return 1;
+		}
+
+		position += chunk;
+		length -= chunk;
+	}
+
+	return 0;
+}
+
+int io_is_mapped (const struct bdl_io_file *file) {
+	return file->memorymap != NULL;
+}
+
+/*
+ * Read without using the position of the file, may be called from many threads at once.
+ * With a memory map, *data points into the map and buf is not used, otherwise the data
+ * is read into buf. Pending writes must be flushed first.
+ */
+int io_read_block_concurrent (
+		struct bdl_io_file *file,
+		unsigned long int position,
+		char *buf,
+		unsigned long int data_length,
+		char **data
+) {
+	if (position + data_length > file->size) {
+		fprintf (stderr, "Attempted to read outside file\n");
+		return 1;
+	}
+
+	if (file->memorymap != NULL) {
+		*data = file->memorymap + position;
+		return 0;
+	}
+
+	unsigned long int done = 0;
+	while (done < data_length) {
+		ssize_t bytes = pread (fileno(file->file), buf + done, data_length - done, position + done);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf (stderr, "Error while reading area at %lu: %s\n", position + done, strerror(errno));
+			return 1;
+		}
+		if (bytes == 0) {
+			fprintf (stderr, "Unexpected end of file while reading area at %lu\n", position + done);
+			return 1;
+		}
+		done += bytes;
+	}
+
+	*data = buf;
+
+	return 0;
+}
+
 int io_read_block(struct bdl_io_file *file, unsigned long int position, char *data, unsigned long int data_length) {
 	if (io_seek (file, position) != 0) {
 		fprintf (stderr, "Error while seeking to read area at %lu\n", position);
@@ -26,10 +26,35 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "../include/bdl.h"
 
+/* Layout hints of a block device in bytes, zero if unknown */
+struct bdl_io_geometry {
+	unsigned long int physical_block_size;
+	unsigned long int optimal_io_size;
+	unsigned long int discard_granularity;
+
+	/* Start of the partition on the disk */
+	unsigned long int start_offset;
+};
+
 int io_close (struct bdl_io_file *file);
-int io_open(const char *path, struct bdl_io_file *file, int no_mmap);
+int io_open(const char *path, struct bdl_io_file *file, int no_mmap, int readonly);
 int io_sync(struct bdl_io_file *file);
+int io_sync_durable(struct bdl_io_file *file);
+int io_refresh(struct bdl_io_file *file);
 int io_write_block(struct bdl_io_file *file, unsigned long int position, const char *data, unsigned long int data_length, const char *padding, unsigned long int padding_length, int verbose);
 int io_read_block(struct bdl_io_file *file, unsigned long int position, char *data, unsigned long int data_length);
+int io_is_mapped (const struct bdl_io_file *file);
+int io_read_block_concurrent (
+		struct bdl_io_file *file,
+		unsigned long int position,
+		char *buf,
+		unsigned long int data_length,
+		char **data
+);
+int io_get_geometry(struct bdl_io_file *file, struct bdl_io_geometry *geometry);
+int io_zero(struct bdl_io_file *file, unsigned long int position, unsigned long int length);
+int io_discard(struct bdl_io_file *file, unsigned long int position, unsigned long int length);
+void io_advise_willneed(struct bdl_io_file *file, unsigned long int position, unsigned long int length);
+int io_watch (struct bdl_io_file *file, int *watch_fd);
 
 #endif
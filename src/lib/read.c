@@ -28,16 +28,122 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "io.h"
 #include "read.h"
 #include "blocks.h"
+#include "record.h"
+#include "arena.h"
+#include "scan.h"
 #include "../include/bdl.h"
 
 struct read_block_loop_data {
+	struct bdl_io_file *device;
+	struct bdl_dump_buffer dump_buffer;
 	uint64_t timestamp_gteq;
+	struct bdl_read_filter filter;
 	unsigned long int limit;
 	unsigned long int result_count;
+	struct bdl_record_state record_state;
+
+	/* Hint block of the region the record state belongs to */
+	unsigned long int region_position;
+
+	/* Set when a writer has taken over the region while we read it */
+	int region_taken_over;
+
+	/* Records are dumped to STDOUT if there is no callback */
+	int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data);
+	void *callback_arg;
 };
 
 //#define BDL_READ_DEBUG
 
+/* Returns 1 if the application data of a record matches the filter */
+int read_appdata_match (const struct read_block_loop_data *loop_data, uint64_t application_data) {
+	return (application_data & loop_data->filter.appdata_mask) == loop_data->filter.appdata_value;
+}
+
+/*
+ * Returns 1 if a block may hold records matching the application data filter. The
+ * application data of packed blocks is that of all their records OR'ed, so only bits
+ * which must be set are checked.
+ */
+int read_appdata_match_block (const struct read_block_loop_data *loop_data, const struct bdl_block_header *block) {
+	return (block->application_data & loop_data->filter.appdata_value) == loop_data->filter.appdata_value;
+}
+
+/* Returns 1 if the timestamp is at or past the upper bound */
+int read_timestamp_beyond (const struct read_block_loop_data *loop_data, uint64_t timestamp) {
+	return loop_data->filter.timestamp_lt != 0 && timestamp >= loop_data->filter.timestamp_lt;
+}
+
+/* Print a record or give it to the callback, sets BREAK when the limit is reached */
+int read_output_record (
+		struct read_block_loop_data *loop_data,
+		const struct bdl_block_header *record_header,
+		unsigned long int block_position,
+		const char *record_data,
+		int *result
+) {
+	*result = BDL_BLOCK_LOOP_OK;
+
+	loop_data->result_count++;
+
+	if (loop_data->callback == NULL) {
+		if (block_dump(&loop_data->dump_buffer, record_header, block_position, record_data) != 0) {
+			*result = BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+	}
+	else {
+		struct bdl_read_callback_data callback_data;
+		callback_data.block_position = block_position;
+		callback_data.timestamp = record_header->timestamp;
+		callback_data.application_data = record_header->application_data;
+		callback_data.flags = record_header->flags;
+		callback_data.hash = record_header->hash;
+		callback_data.data_length = record_header->data_length;
+		callback_data.data = record_data;
+
+		int ret = loop_data->callback(loop_data->callback_arg, &callback_data);
+		if (ret == BDL_READ_BREAK) {
+			*result = BDL_BLOCK_LOOP_BREAK;
+			return 0;
+		}
+		else if (ret != 0) {
+			fprintf (stderr, "Read callback returned error %i\n", ret);
+			*result = BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+	}
+
+	if (loop_data->limit != 0 && loop_data->result_count == loop_data->limit) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+	}
+
+	return 0;
+}
+
+int read_record_loop_callback(struct bdl_record_loop_callback_data *data, int *result) {
+	struct read_block_loop_data *loop_data = (struct read_block_loop_data *) data->argument_ptr;
+	const struct bdl_block_header *record_header = &data->record_header;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	if (record_header->timestamp < loop_data->timestamp_gteq) {
+		return 0;
+	}
+
+	// Records come in timestamp order, none of the following ones are inside the range
+	if (read_timestamp_beyond (loop_data, record_header->timestamp)) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+		return 0;
+	}
+
+	if (!read_appdata_match (loop_data, record_header->application_data)) {
+		return 0;
+	}
+
+	return read_output_record (loop_data, record_header, data->block_position, data->record_data, result);
+}
+
 int read_block_loop_callback(struct bdl_block_loop_callback_data *data, int *result) {
 	struct read_block_loop_data *loop_data = (struct read_block_loop_data *) data->argument_ptr;
 	const struct bdl_block_header *block_header = data->block;
@@ -46,13 +152,48 @@ int read_block_loop_callback(struct bdl_block_loop_callback_data *data, int *res
 	printf ("Check block at %lu\n", data->block_position);
 #endif
 
-	if (block_header->timestamp >= loop_data->timestamp_gteq) {
-		block_dump(block_header, data->block_position, data->block_data);
-		loop_data->result_count++;
+	*result = BDL_BLOCK_LOOP_OK;
+
+	// Chains never cross regions
+	if (data->hintblock_state->location != loop_data->region_position) {
+		record_state_reset (&loop_data->record_state);
+		loop_data->region_position = data->hintblock_state->location;
+		loop_data->region_taken_over = 0;
 	}
 
-	if (loop_data->limit != 0 && loop_data->result_count == loop_data->limit) {
-		*result = BDL_BLOCK_LOOP_BREAK;
+	/*
+	 * Blocks newer than the hint block we read were written by another process which
+	 * has taken over the region. Its records are read again when we reach the head.
+	 */
+	if (loop_data->region_taken_over || block_header->timestamp > data->hintblock_state->highest_timestamp) {
+		loop_data->region_taken_over = 1;
+		return 0;
+	}
+
+	if (block_header->timestamp < loop_data->timestamp_gteq) {
+		return 0;
+	}
+
+	// Blocks of a chain have the same application data, so whole chains are skipped
+	if (!read_appdata_match_block (loop_data, block_header)) {
+		if (read_timestamp_beyond (loop_data, block_header->timestamp)) {
+			*result = BDL_BLOCK_LOOP_BREAK;
+		}
+		return 0;
+	}
+
+	struct bdl_record_loop_callback_data callback_data;
+	callback_data.argument_int = 0;
+	callback_data.argument_ptr = (void *) loop_data;
+
+	if (record_loop_block (
+			&loop_data->record_state,
+			block_header, data->block_data, data->block_position,
+			read_record_loop_callback, &callback_data,
+			result
+	) != 0) {
+		fprintf (stderr, "Error while looping records of block at %lu\n", data->block_position);
+		return 1;
 	}
 
 	return 0;
@@ -75,9 +216,9 @@ int read_hintblock_loop_callback(
 
 	if (hintblock_state->valid != 1) {
 		#ifdef BDL_READ_DEBUG
-			printf ("- Hint block was not valid, ending here\n");
+			printf ("- Hint block was not valid, skipping it\n");
 		#endif
-		*result = BDL_BLOCK_LOOP_BREAK;
+		*result = BDL_BLOCK_LOOP_OK;
 		return 0;
 	}
 
@@ -95,24 +236,36 @@ int read_hintblock_loop_callback(
 	printf ("- Hintblock matched\n");
 #endif
 
-	char block_buf[master_header->block_size];
+	struct bdl_arena_mark mark;
+	arena_get_mark (&data->file->arena, &mark);
+
+	char *block_buf = arena_alloc (&data->file->arena, master_header->block_size);
+	if (block_buf == NULL) {
+		fprintf (stderr, "Could not allocate block buffer in hintblock loop\n");
+		*result = BDL_BLOCK_LOOP_ERR;
+		return 1;
+	}
+
 	struct bdl_block_header *block_header;
 	char *block_data;
 
 	struct bdl_block_loop_callback_data callback_data;
-	unsigned long int block_position;
 
 	callback_data.argument_int = 0;
 	callback_data.argument_ptr = (void *) loop_data;
 
-	if (block_loop_blocks(
+	int ret = block_loop_blocks(
 			data->file, master_header, hintblock_state,
 			read_block_loop_callback,
 			block_buf, master_header->block_size,
 			&block_header, &block_data,
 			&callback_data,
 			result
-	) != 0) {
+	);
+
+	arena_release (&data->file->arena, &mark);
+
+	if (ret != 0) {
 		fprintf (stderr, "Error while looping blocks in hintblock loop\n");
 		return 1;
 	}
@@ -131,33 +284,387 @@ int read_hintblock_loop_callback(
 	return 0;
 }
 
-int read_blocks (struct bdl_io_file *device, uint64_t timestamp_gteq, unsigned long int limit) {
-	struct bdl_header master_header;
-	int result;
+/*
+ * Reverse reading starts at the previous block position of the region holding
+ * the newest block and walks blocks and regions backwards. The records of one
+ * block are collected and then output newest first. For a chain, we step back
+ * to its first block and pass the blocks forward through the record loop.
+ */
+
+struct read_reverse_record {
+	struct bdl_block_header header;
+	unsigned long int block_position;
+	const char *data;
+};
+
+struct read_reverse_data {
+	struct read_reverse_record *records;
+	unsigned long int count;
+	unsigned long int size;
+};
+
+int read_reverse_collect_callback(struct bdl_record_loop_callback_data *data, int *result) {
+	struct read_reverse_data *reverse_data = (struct read_reverse_data *) data->argument_ptr;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	if (reverse_data->count == reverse_data->size) {
+		fprintf (stderr, "Bug: Too many records in one block while reading in reverse\n");
+		exit (EXIT_FAILURE);
+	}
+
+	struct read_reverse_record *record = &reverse_data->records[reverse_data->count];
+	record->header = data->record_header;
+	record->block_position = data->block_position;
+	record->data = data->record_data;
+
+	reverse_data->count++;
+
+	return 0;
+}
+
+/*
+ * Step back from the last block of a chain to its first block. If the chain is
+ * broken, complete is 0 and first_position is the block not belonging to it.
+ */
+int read_reverse_find_chain (
+		struct bdl_io_file *device,
+		const struct bdl_header *master_header,
+		const struct bdl_hintblock_state *state,
+		const struct bdl_block_header *last_header,
+		unsigned long int last_position,
+		unsigned long int *first_position,
+		int *complete
+) {
+	struct bdl_block_header block_header = *last_header;
+	unsigned long int position = last_position;
+
+	*complete = 0;
 
-	if (block_get_validate_master_header(device, &master_header, &result) != 0) {
-		fprintf (stderr, "Error while getting master header before reading\n");
+	while ((block_header.flags & BDL_BLOCK_FLAG_CHAIN_FIRST) == 0) {
+		position = block_previous_position (state, master_header, position);
+		*first_position = position;
+
+		if (position < state->blockstart_min) {
+			return 0;
+		}
+
+		if (io_read_block (device, position, (char *) &block_header, sizeof(block_header)) != 0) {
+			fprintf (stderr, "Error while reading block header at %lu\n", position);
+			return 1;
+		}
+
+		if (	(block_header.flags & BDL_BLOCK_FLAGS_CHAIN) == 0 ||
+				(block_header.flags & BDL_BLOCK_FLAG_CHAIN_LAST) != 0 ||
+				block_header.timestamp != last_header->timestamp ||
+				block_header.application_data != last_header->application_data
+		) {
+			return 0;
+		}
+	}
+
+	*first_position = position;
+	*complete = 1;
+
+	return 0;
+}
+
+/* Output the records of the block or chain ending at position newest first */
+int read_reverse_block (
+		struct read_block_loop_data *loop_data,
+		struct read_reverse_data *reverse_data,
+		const struct bdl_header *master_header,
+		const struct bdl_hintblock_state *state,
+		char *block_buf,
+		unsigned long int position,
+		unsigned long int *next_position,
+		int *result
+) {
+	struct bdl_io_file *device = loop_data->device;
+	struct bdl_block_header *block_header;
+	char *block_data;
+
+	*result = BDL_BLOCK_LOOP_OK;
+	*next_position = block_previous_position (state, master_header, position);
+
+#ifdef BDL_READ_DEBUG
+	printf ("Check block at %lu in reverse\n", position);
+#endif
+
+	if (block_get_validate_block (
+			device, position, master_header,
+			block_buf, master_header->block_size,
+			&block_header, &block_data,
+			result
+	) != 0) {
+		fprintf (stderr, "Error while getting and validating block at %lu\n", position);
 		return 1;
+	}
+
+	// Forward reading also stops at an invalid block
+	if (*result == 1) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+		return 0;
+	}
 
+	// Another process has taken over the region, the older records are gone
+	if (block_header->timestamp > state->highest_timestamp) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+		return 0;
+	}
+
+	// All blocks further back are older
+	if (block_header->timestamp < loop_data->timestamp_gteq) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+		return 0;
+	}
+
+	struct bdl_record_loop_callback_data callback_data;
+	callback_data.argument_int = 0;
+	callback_data.argument_ptr = (void *) reverse_data;
+
+	reverse_data->count = 0;
+	record_state_reset (&loop_data->record_state);
+
+	if ((block_header->flags & BDL_BLOCK_FLAGS_CHAIN) != 0) {
+		// The newest chain of a region might not be completed yet
+		if ((block_header->flags & BDL_BLOCK_FLAG_CHAIN_LAST) == 0) {
+			return 0;
+		}
+
+		unsigned long int first_position;
+		int complete;
+
+		if (read_reverse_find_chain (
+				device, master_header, state,
+				block_header, position,
+				&first_position, &complete
+		) != 0) {
+			fprintf (stderr, "Error while finding first block of chain ending at %lu\n", position);
+			*result = BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+
+		if (complete != 1) {
+			*next_position = first_position;
+			return 0;
+		}
+
+		*next_position = block_previous_position (state, master_header, first_position);
+
+		if (!read_appdata_match_block (loop_data, block_header)) {
+			return 0;
+		}
+
+		for (unsigned long int i = first_position; i <= position; i = block_next_position (state, master_header, i)) {
+			if (block_get_validate_block (
+					device, i, master_header,
+					block_buf, master_header->block_size,
+					&block_header, &block_data,
+					result
+			) != 0) {
+				fprintf (stderr, "Error while getting and validating block at %lu\n", i);
+				return 1;
+			}
+
+			if (*result == 1) {
+				*result = BDL_BLOCK_LOOP_BREAK;
+				return 0;
+			}
+
+			if (record_loop_block (
+					&loop_data->record_state,
+					block_header, block_data, i,
+					read_reverse_collect_callback, &callback_data,
+					result
+			) != 0) {
+				fprintf (stderr, "Error while looping records of block at %lu\n", i);
+				return 1;
+			}
+		}
+	}
+	else if (!read_appdata_match_block (loop_data, block_header)) {
+		return 0;
 	}
-	if (result != 0) {
-		fprintf (stderr, "Master header of device was not valid before reading\n");
+	else if (record_loop_block (
+			&loop_data->record_state,
+			block_header, block_data, position,
+			read_reverse_collect_callback, &callback_data,
+			result
+	) != 0) {
+		fprintf (stderr, "Error while looping records of block at %lu\n", position);
 		return 1;
 	}
 
-	// Find oldest hint block
-	struct bdl_block_location oldest_location;
-	if (block_find_oldest_hintblock(device, &master_header, timestamp_gteq, &oldest_location, &result) != 0) {
+	for (unsigned long int i = reverse_data->count; i > 0; i--) {
+		const struct read_reverse_record *record = &reverse_data->records[i - 1];
+
+		if (record->header.timestamp < loop_data->timestamp_gteq) {
+			*result = BDL_BLOCK_LOOP_BREAK;
+			return 0;
+		}
+
+		if (	read_timestamp_beyond (loop_data, record->header.timestamp) ||
+				!read_appdata_match (loop_data, record->header.application_data)
+		) {
+			continue;
+		}
+
+		if (read_output_record (loop_data, &record->header, record->block_position, record->data, result) != 0) {
+			return 1;
+		}
+
+		if (*result != BDL_BLOCK_LOOP_OK) {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+int read_blocks_reverse (
+		struct read_block_loop_data *loop_data,
+		const struct bdl_header *master_header,
+		const struct bdl_block_location *newest_location,
+		int *result
+) {
+	struct bdl_io_file *device = loop_data->device;
+	int ret = 0;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&device->arena, &mark);
+
+	struct read_reverse_data reverse_data;
+	reverse_data.count = 0;
+	reverse_data.size = master_header->block_size / sizeof(struct bdl_packed_record) + 1;
+	reverse_data.records = arena_alloc (&device->arena, reverse_data.size * sizeof(*reverse_data.records));
+
+	char *block_buf = arena_alloc (&device->arena, master_header->block_size);
+
+	if (block_buf == NULL || reverse_data.records == NULL) {
+		fprintf (stderr, "Could not allocate buffers for reading in reverse\n");
+		ret = 1;
+		goto out;
+	}
+
+	struct bdl_hintblock_state state = newest_location->hintblock_state;
+
+	while (state.highest_timestamp >= loop_data->timestamp_gteq) {
+		// The region before must be valid and older, or we have wrapped around to the oldest data.
+		// Regions with invalid hint blocks are skipped like the writer does.
+		struct bdl_hintblock_state previous_state;
+		unsigned long int previous = state.location;
+
+		previous_state.valid = 0;
+		while (previous_state.valid != 1) {
+			previous = block_previous_hintblock_position (device, master_header, previous);
+
+			if (previous == newest_location->hintblock_state.location) {
+				break;
+			}
+
+			if (block_get_region_state (device, previous, master_header, &previous_state) != 0) {
+				fprintf (stderr, "Error while reading hint block at %lu\n", previous);
+				ret = 1;
+				goto out;
+			}
+		}
+
+		if (previous_state.valid == 1 && previous_state.highest_timestamp >= state.highest_timestamp) {
+			previous_state.valid = 0;
+		}
+
+		// All blocks of this region are newer than the upper bound if the region before reaches it
+		if (previous_state.valid == 1 && read_timestamp_beyond (loop_data, previous_state.highest_timestamp)) {
+#ifdef BDL_READ_DEBUG
+			printf ("Skipping region of hint block at %lu outside range\n", state.location);
+#endif
+			state = previous_state;
+			continue;
+		}
+
+#ifdef BDL_READ_DEBUG
+		printf ("Reading region of hint block at %lu in reverse\n", state.location);
+#endif
+
+		unsigned long int position = state.hintblock.previous_block_pos;
+		while (position >= state.blockstart_min) {
+			if (read_reverse_block (
+					loop_data, &reverse_data,
+					master_header, &state,
+					block_buf,
+					position, &position,
+					result
+			) != 0) {
+				ret = 1;
+				goto out;
+			}
+
+			if (*result != BDL_BLOCK_LOOP_OK) {
+				goto out;
+			}
+		}
+
+		if (previous_state.valid != 1) {
+			break;
+		}
+
+		state = previous_state;
+	}
+
+	out:
+	arena_release (&device->arena, &mark);
+	return ret;
+}
+
+int read_blocks (
+		struct bdl_io_file *device,
+		const struct bdl_header *master_header,
+		uint64_t timestamp_gteq,
+		unsigned long int limit,
+		int threads,
+		int format,
+		int reverse,
+		const struct bdl_read_filter *filter
+) {
+	return read_blocks_cb (device, master_header, timestamp_gteq, limit, threads, format, reverse, filter, NULL, NULL);
+}
+
+int read_blocks_cb (
+		struct bdl_io_file *device,
+		const struct bdl_header *master_header,
+		uint64_t timestamp_gteq,
+		unsigned long int limit,
+		int threads,
+		int format,
+		int reverse,
+		const struct bdl_read_filter *filter,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+) {
+	int result;
+
+	// Find oldest hint block, or the newest one when reading in reverse
+	struct bdl_block_location first_location;
+	if (reverse) {
+		if (block_find_newest_hintblock(device, master_header, &first_location, &result) != 0) {
+			fprintf (stderr, "Error while finding newest hint block\n");
+			return 1;
+		}
+	}
+	else if (block_find_oldest_hintblock(device, master_header, timestamp_gteq, &first_location, &result) != 0) {
 		fprintf (stderr, "Error while finding oldest hint block\n");
 		return 1;
 	}
 
 #ifdef BDL_READ_DEBUG
-	if (oldest_location.hintblock_state.valid == 1) {
-		printf ("Found oldest hintblock at %lu highest timestamp %" PRIu64 "\n",
-				oldest_location.hintblock_state.location, oldest_location.hintblock_state.highest_timestamp
+	if (first_location.hintblock_state.valid == 1) {
+		printf ("Found first hintblock at %lu highest timestamp %" PRIu64 "\n",
+				first_location.hintblock_state.location, first_location.hintblock_state.highest_timestamp
 		);
-		if (oldest_location.hintblock_state.highest_timestamp == 0) {
+		if (first_location.hintblock_state.highest_timestamp == 0) {
 			fprintf (stderr, "Bug: Smallest timestamp found was zero\n");
 			exit (EXIT_FAILURE);
 
@@ -169,32 +676,188 @@ int read_blocks (struct bdl_io_file *device, uint64_t timestamp_gteq, unsigned l
 #endif
 
 	// Check if no blocks were found
-	if (oldest_location.hintblock_state.valid != 1) {
+	if (first_location.hintblock_state.valid != 1) {
 		return 0;
 	}
 
 	// Read data
 	struct read_block_loop_data loop_data;
+	loop_data.device = device;
 	loop_data.timestamp_gteq = timestamp_gteq;
+	loop_data.filter = *filter;
 	loop_data.limit = limit;
 	loop_data.result_count = 0;
+	loop_data.callback = callback;
+	loop_data.callback_arg = arg;
+	loop_data.region_position = 0;
+	loop_data.region_taken_over = 0;
+	record_state_init (&loop_data.record_state);
+
+	if (callback == NULL && block_dump_init (&loop_data.dump_buffer, fileno(stdout), format) != 0) {
+		return 1;
+	}
 
 	struct bdl_hintblock_loop_callback_data callback_data;
 	callback_data.argument_int = 0;
 	callback_data.argument_ptr = (void *) &loop_data;
 
 	struct bdl_block_location location;
+	int ret = 0;
 
-	if (block_loop_hintblocks_large_device (
-			device, &master_header,
-			&oldest_location,
+	if (reverse) {
+		if (read_blocks_reverse (&loop_data, master_header, &first_location, &result) != 0) {
+			fprintf (stderr, "Error while reading blocks in reverse\n");
+			ret = 1;
+		}
+	}
+	else if (threads > 1) {
+		struct bdl_block_loop_callback_data block_callback_data;
+		block_callback_data.argument_int = 0;
+		block_callback_data.argument_ptr = (void *) &loop_data;
+
+		if (scan_regions (
+				device, master_header,
+				&first_location,
+				timestamp_gteq,
+				loop_data.filter.timestamp_lt,
+				threads,
+				read_block_loop_callback, &block_callback_data,
+				&result
+		) != 0) {
+			fprintf (stderr, "Error while scanning regions while reading blocks\n");
+			ret = 1;
+		}
+	}
+	else if (block_loop_hintblocks_large_device (
+			device, master_header,
+			&first_location,
 			read_hintblock_loop_callback, &callback_data,
 			&location,
 			&result
 	) != 0) {
 		fprintf (stderr, "Error while looping hintblocks while reading blocks\n");
+		ret = 1;
+	}
+
+	record_state_cleanup (&loop_data.record_state);
+
+	if (callback == NULL) {
+		if (block_dump_flush (&loop_data.dump_buffer) != 0) {
+			fprintf (stderr, "Error while writing blocks\n");
+			ret = 1;
+		}
+		block_dump_cleanup (&loop_data.dump_buffer);
+	}
+
+	return ret;
+}
+
+/* Print new records or give them to the callback as they are written, using a cursor */
+int read_follow (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq,
+		int from_head,
+		unsigned long int limit,
+		int format,
+		const struct bdl_read_filter *filter,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+) {
+	struct bdl_cursor *cursor;
+	if (bdl_cursor_open (session, timestamp_gteq, &cursor) != 0) {
+		fprintf (stderr, "Could not open cursor for following device\n");
 		return 1;
 	}
 
-	return 0;
+	if (from_head && bdl_cursor_seek_head (cursor) != 0) {
+		fprintf (stderr, "Could not move cursor to the head of the device\n");
+		bdl_cursor_close (cursor);
+		return 1;
+	}
+
+	struct read_block_loop_data loop_data;
+	loop_data.device = &session->device;
+	loop_data.timestamp_gteq = timestamp_gteq;
+	loop_data.filter = *filter;
+	loop_data.limit = limit;
+	loop_data.result_count = 0;
+	loop_data.callback = callback;
+	loop_data.callback_arg = arg;
+	loop_data.region_position = 0;
+	loop_data.region_taken_over = 0;
+	record_state_init (&loop_data.record_state);
+
+	if (callback == NULL && block_dump_init (&loop_data.dump_buffer, fileno(stdout), format) != 0) {
+		bdl_cursor_close (cursor);
+		return 1;
+	}
+
+	int ret = 0;
+
+	while (1) {
+		struct bdl_read_callback_data record;
+		int result;
+
+		if (bdl_cursor_next (cursor, &record, &result) != 0) {
+			fprintf (stderr, "Error while reading next record while following device\n");
+			ret = 1;
+			break;
+		}
+
+		if (result == 1) {
+			// Let readers of our output see everything before we sleep
+			if (callback == NULL && block_dump_flush (&loop_data.dump_buffer) != 0) {
+				fprintf (stderr, "Error while writing blocks\n");
+				ret = 1;
+				break;
+			}
+
+			if (bdl_cursor_wait (cursor, 0, &result) != 0) {
+				fprintf (stderr, "Error while waiting for records while following device\n");
+				ret = 1;
+				break;
+			}
+
+			continue;
+		}
+
+		// A window which has ended gets no more records
+		if (read_timestamp_beyond (&loop_data, record.timestamp)) {
+			break;
+		}
+
+		if (!read_appdata_match (&loop_data, record.application_data)) {
+			continue;
+		}
+
+		struct bdl_block_header record_header;
+		record_header.timestamp = record.timestamp;
+		record_header.application_data = record.application_data;
+		record_header.data_length = record.data_length;
+		record_header.flags = record.flags;
+		record_header.hash = record.hash;
+
+		if (read_output_record (&loop_data, &record_header, record.block_position, record.data, &result) != 0) {
+			ret = 1;
+			break;
+		}
+
+		if (result != BDL_BLOCK_LOOP_OK) {
+			break;
+		}
+	}
+
+	record_state_cleanup (&loop_data.record_state);
+
+	if (callback == NULL) {
+		if (block_dump_flush (&loop_data.dump_buffer) != 0) {
+			fprintf (stderr, "Error while writing blocks\n");
+			ret = 1;
+		}
+		block_dump_cleanup (&loop_data.dump_buffer);
+	}
+
+	bdl_cursor_close (cursor);
+
+	return ret;
 }
@@ -27,6 +27,37 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "io.h"
 #include "../include/bdl.h"
 
-int read_blocks (struct bdl_io_file *device, uint64_t timestamp_gteq, unsigned long int limit);
+int read_blocks (
+		struct bdl_io_file *device,
+		const struct bdl_header *master_header,
+		uint64_t timestamp_gteq,
+		unsigned long int limit,
+		int threads,
+		int format,
+		int reverse,
+		const struct bdl_read_filter *filter
+);
+int read_blocks_cb (
+		struct bdl_io_file *device,
+		const struct bdl_header *master_header,
+		uint64_t timestamp_gteq,
+		unsigned long int limit,
+		int threads,
+		int format,
+		int reverse,
+		const struct bdl_read_filter *filter,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+);
+int read_follow (
+		struct bdl_session *session,
+		uint64_t timestamp_gteq,
+		int from_head,
+		unsigned long int limit,
+		int format,
+		const struct bdl_read_filter *filter,
+		int (*callback)(void *arg, const struct bdl_read_callback_data *callback_data),
+		void *arg
+);
 
 #endif
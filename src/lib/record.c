@@ -0,0 +1,340 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "record.h"
+#include "blocks.h"
+#include "compress.h"
+
+//#define BDL_DBG_RECORD
+
+void record_chain_init (struct bdl_record_chain *chain) {
+	memset (chain, '\0', sizeof(*chain));
+}
+
+void record_chain_reset (struct bdl_record_chain *chain) {
+	chain->active = 0;
+	chain->data_length = 0;
+	chain->block_count = 0;
+}
+
+void record_chain_cleanup (struct bdl_record_chain *chain) {
+	free (chain->data);
+	record_chain_init (chain);
+}
+
+void record_state_init (struct bdl_record_state *state) {
+	record_chain_init (&state->chain);
+	state->uncompressed = NULL;
+	state->uncompressed_size = 0;
+}
+
+/* Chains never cross regions, call this before looping blocks of a new region */
+void record_state_reset (struct bdl_record_state *state) {
+	record_chain_reset (&state->chain);
+}
+
+void record_state_cleanup (struct bdl_record_state *state) {
+	record_chain_cleanup (&state->chain);
+	free (state->uncompressed);
+	record_state_init (state);
+}
+
+/* Decompress data starting with a compressed header into the buffer of the state */
+int record_decompress (
+	struct bdl_record_state *state,
+	const struct bdl_block_header *block,
+	const char *data, unsigned long int data_length,
+	const char **result_data, uint64_t *result_length
+) {
+	const struct bdl_compressed_header *compressed_header = (const struct bdl_compressed_header *) data;
+
+	if ((block->flags & BDL_BLOCK_FLAGS_COMPRESSED) != BDL_BLOCK_FLAG_COMPRESSED_LZ) {
+		fprintf (stderr, "Unknown compression of record\n");
+		return 1;
+	}
+
+	if (data_length < sizeof(*compressed_header)) {
+		fprintf (stderr, "Compressed record was too short to hold a compressed header\n");
+		return 1;
+	}
+
+	if (compressed_header->data_length > state->uncompressed_size) {
+		char *new_buffer = realloc (state->uncompressed, compressed_header->data_length);
+		if (new_buffer == NULL) {
+			fprintf (stderr, "Could not allocate %u bytes for decompressed record\n", compressed_header->data_length);
+			return 1;
+		}
+
+		state->uncompressed = new_buffer;
+		state->uncompressed_size = compressed_header->data_length;
+	}
+
+	unsigned long int uncompressed_length;
+	if (decompress_lz (
+			data + sizeof(*compressed_header), data_length - sizeof(*compressed_header),
+			state->uncompressed, compressed_header->data_length,
+			&uncompressed_length
+	) != 0 || uncompressed_length != compressed_header->data_length) {
+		fprintf (stderr, "Compressed record was corrupt\n");
+		return 1;
+	}
+
+	*result_data = state->uncompressed;
+	*result_length = uncompressed_length;
+
+#ifdef BDL_DBG_RECORD
+	printf ("Decompressed %lu bytes to %lu bytes\n", data_length, uncompressed_length);
+#endif
+
+	return 0;
+}
+
+int record_chain_append (struct bdl_record_chain *chain, const char *data, unsigned long int data_length) {
+	if (chain->data_length + data_length > chain->data_size) {
+		unsigned long int new_size = (chain->data_size == 0 ? data_length : chain->data_size);
+		while (new_size < chain->data_length + data_length) {
+			new_size *= 2;
+		}
+
+		char *new_data = realloc (chain->data, new_size);
+		if (new_data == NULL) {
+			fprintf (stderr, "Could not allocate %lu bytes for chained record\n", new_size);
+			return 1;
+		}
+
+		chain->data = new_data;
+		chain->data_size = new_size;
+	}
+
+	memcpy (chain->data + chain->data_length, data, data_length);
+	chain->data_length += data_length;
+	chain->block_count++;
+
+	return 0;
+}
+
+/* Returns 0 and sets *complete to 1 when the last block of a chain was added */
+int record_chain_add_block (
+	struct bdl_record_chain *chain,
+	const struct bdl_block_header *block,
+	const char *block_data,
+	unsigned long int block_position,
+	int *complete
+) {
+	*complete = 0;
+
+	if ((block->flags & BDL_BLOCK_FLAG_CHAIN_FIRST) != 0) {
+		record_chain_reset (chain);
+		chain->active = 1;
+		chain->first_header = *block;
+		chain->first_position = block_position;
+	}
+	else if (	chain->active != 1 ||
+				block->timestamp != chain->first_header.timestamp ||
+				block->application_data != chain->first_header.application_data
+	) {
+		// Lost the beginning of this chain, skip until the next one starts
+#ifdef BDL_DBG_RECORD
+		printf ("Skipping block at %lu not belonging to any chain\n", block_position);
+#endif
+		record_chain_reset (chain);
+		return 0;
+	}
+
+	if (record_chain_append (chain, block_data, block->data_length) != 0) {
+		return 1;
+	}
+
+	if ((block->flags & BDL_BLOCK_FLAG_CHAIN_LAST) != 0) {
+		*complete = 1;
+	}
+
+	return 0;
+}
+
+int record_loop_packed (
+	struct bdl_record_state *state,
+	const struct bdl_block_header *block,
+	char *block_data,
+	int (*callback)(struct bdl_record_loop_callback_data *, int *result),
+	struct bdl_record_loop_callback_data *callback_data,
+	int *result
+) {
+	struct bdl_packed_header *packed_header = (struct bdl_packed_header *) block_data;
+
+	if (block->data_length < sizeof(*packed_header)) {
+		fprintf (stderr, "Packed block at %lu was too short to hold a packed header\n", callback_data->block_position);
+		*result = BDL_BLOCK_LOOP_ERR;
+		return 1;
+	}
+
+	uint64_t directory_length = packed_header->record_count * sizeof(struct bdl_packed_record);
+	if (sizeof(*packed_header) + directory_length > block->data_length) {
+		fprintf (stderr, "Directory of packed block at %lu was too long\n", callback_data->block_position);
+		*result = BDL_BLOCK_LOOP_ERR;
+		return 1;
+	}
+
+	struct bdl_packed_record *directory = (struct bdl_packed_record *) (block_data + sizeof(*packed_header));
+	const char *record_data = block_data + sizeof(*packed_header) + directory_length;
+	const char *record_data_end = block_data + block->data_length;
+
+	if ((block->flags & BDL_BLOCK_FLAGS_COMPRESSED) != 0) {
+		uint64_t uncompressed_length;
+		if (record_decompress (
+				state, block,
+				record_data, record_data_end - record_data,
+				&record_data, &uncompressed_length
+		) != 0) {
+			fprintf (stderr, "Could not decompress packed block at %lu\n", callback_data->block_position);
+			*result = BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+		record_data_end = record_data + uncompressed_length;
+	}
+
+	for (unsigned long int i = 0; i < packed_header->record_count; i++) {
+		struct bdl_packed_record *packed_record = &directory[i];
+
+		if (record_data + packed_record->data_length > record_data_end) {
+			fprintf (stderr, "Record %lu of packed block at %lu exceeded the block\n", i, callback_data->block_position);
+			*result = BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+
+		callback_data->record_header.timestamp = block->timestamp - packed_record->timestamp_delta;
+		callback_data->record_header.application_data = packed_record->application_data;
+		callback_data->record_header.data_length = packed_record->data_length;
+		callback_data->record_data = record_data;
+		callback_data->record_index = i;
+		callback_data->packed_record = packed_record;
+
+#ifdef BDL_DBG_RECORD
+		printf ("Packed record %lu of block at %lu length %u\n", i, callback_data->block_position, packed_record->data_length);
+#endif
+
+		if (callback (callback_data, result) != 0) {
+			fprintf (stderr, "Error in callback function while looping records of packed block\n");
+			return 1;
+		}
+
+		if (*result == BDL_BLOCK_LOOP_BREAK) {
+			break;
+		}
+		else if (*result == BDL_BLOCK_LOOP_ERR) {
+			return 1;
+		}
+
+		record_data += packed_record->data_length;
+	}
+
+	return 0;
+}
+
+int record_loop_block (
+	struct bdl_record_state *state,
+	const struct bdl_block_header *block,
+	char *block_data,
+	unsigned long int block_position,
+	int (*callback)(struct bdl_record_loop_callback_data *, int *result),
+	struct bdl_record_loop_callback_data *callback_data,
+	int *result
+) {
+	struct bdl_record_chain *chain = &state->chain;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	callback_data->block_position = block_position;
+	callback_data->block = block;
+	callback_data->block_count = 1;
+	callback_data->record_header = *block;
+	callback_data->record_data = block_data;
+	callback_data->record_index = 0;
+	callback_data->packed_record = NULL;
+
+	if ((block->flags & BDL_BLOCK_FLAGS_CHAIN) != 0) {
+		int complete;
+		if (record_chain_add_block (chain, block, block_data, block_position, &complete) != 0) {
+			fprintf (stderr, "Error while adding block at %lu to chained record\n", block_position);
+			*result = BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+
+		if (complete == 0) {
+			return 0;
+		}
+
+		callback_data->block_position = chain->first_position;
+		callback_data->block_count = chain->block_count;
+		callback_data->record_header.data_length = chain->data_length;
+		callback_data->record_data = chain->data;
+
+		int ret = 0;
+		if ((block->flags & BDL_BLOCK_FLAGS_COMPRESSED) != 0 && record_decompress (
+				state, block,
+				chain->data, chain->data_length,
+				&callback_data->record_data, &callback_data->record_header.data_length
+		) != 0) {
+			fprintf (stderr, "Could not decompress chained record at %lu\n", chain->first_position);
+			*result = BDL_BLOCK_LOOP_ERR;
+			ret = 1;
+		}
+		else if (callback (callback_data, result) != 0) {
+			fprintf (stderr, "Error in callback function while looping records of chain\n");
+			ret = 1;
+		}
+
+		record_chain_reset (chain);
+
+		return ret;
+	}
+
+	if (chain->active == 1) {
+		// Chain was not completed
+		record_chain_reset (chain);
+	}
+
+	if ((block->flags & BDL_BLOCK_FLAG_PACKED) != 0) {
+		return record_loop_packed (state, block, block_data, callback, callback_data, result);
+	}
+
+	if ((block->flags & BDL_BLOCK_FLAGS_COMPRESSED) != 0 && record_decompress (
+			state, block,
+			block_data, block->data_length,
+			&callback_data->record_data, &callback_data->record_header.data_length
+	) != 0) {
+		fprintf (stderr, "Could not decompress block at %lu\n", block_position);
+		*result = BDL_BLOCK_LOOP_ERR;
+		return 1;
+	}
+
+	if (callback (callback_data, result) != 0) {
+		fprintf (stderr, "Error in callback function while looping records of block\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_RECORD_H
+#define BDL_RECORD_H
+
+#include <stdint.h>
+
+#include "blocks.h"
+
+/*
+ * A block may contain more than one record, and a record may span more than
+ * one block. The record loop splits a block into its records and calls the
+ * callback once for every record. Blocks of a chain are collected in the
+ * chain buffer and the callback is called when the last block is found.
+ * Compressed records are decompressed into a buffer of the record state before
+ * the callback sees them.
+ */
+
+struct bdl_record_chain {
+	int active;
+	struct bdl_block_header first_header;
+	unsigned long int first_position;
+	unsigned long int block_count;
+
+	char *data;
+	unsigned long int data_length;
+	unsigned long int data_size;
+};
+
+struct bdl_record_state {
+	struct bdl_record_chain chain;
+
+	char *uncompressed;
+	unsigned long int uncompressed_size;
+};
+
+struct bdl_record_loop_callback_data {
+	// May be initialized before looping, not used by the loop
+	int argument_int;
+	void *argument_ptr;
+
+	// Initialized by the loop itself
+	unsigned long int block_position;
+	const struct bdl_block_header *block;
+
+	/* Number of blocks the record spans starting at block_position, more than one for chains */
+	unsigned long int block_count;
+
+	/* Header describing only this record, hash and flags are those of the block */
+	struct bdl_block_header record_header;
+	const char *record_data;
+
+	/*
+	 * Index and directory entry of the record in a packed block, packed_record is NULL for other
+	 * blocks. The directory is never compressed and points into the block data.
+	 */
+	unsigned long int record_index;
+	struct bdl_packed_record *packed_record;
+};
+
+void record_state_init (struct bdl_record_state *state);
+void record_state_reset (struct bdl_record_state *state);
+void record_state_cleanup (struct bdl_record_state *state);
+
+int record_loop_block (
+	struct bdl_record_state *state,
+	const struct bdl_block_header *block,
+	char *block_data,
+	unsigned long int block_position,
+	int (*callback)(struct bdl_record_loop_callback_data *, int *result),
+	struct bdl_record_loop_callback_data *callback_data,
+	int *result
+);
+
+#endif
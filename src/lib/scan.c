@@ -0,0 +1,378 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "scan.h"
+#include "blocks.h"
+#include "validate.h"
+#include "defaults.h"
+#include "io.h"
+#include "../include/bdl.h"
+
+//#define BDL_DBG_SCAN
+
+/* Read the blocks of a region and find out how many of them are valid */
+int scan_process_job (struct scan *scan, struct scan_job *job) {
+	const struct bdl_header *header = scan->header;
+	const struct bdl_hintblock_state *state = &job->state;
+
+	unsigned long int last = state->hintblock.previous_block_pos;
+	if (last > state->blockstart_max) {
+		last = state->blockstart_max;
+	}
+
+	job->valid_end = state->blockstart_min;
+	job->invalid_found = 0;
+
+	if (last < state->blockstart_min) {
+		return 0;
+	}
+
+	if (io_read_block_concurrent (
+			scan->file,
+			state->blockstart_min,
+			job->buffer,
+			last + header->block_size - state->blockstart_min,
+			&job->data
+	) != 0) {
+		fprintf (stderr, "Error while reading region before hint block at %lu\n", state->location);
+		return 1;
+	}
+
+	unsigned long int i;
+	for (i = state->blockstart_min; i <= last; i += header->block_size) {
+		if (i == state->backup_location) {
+			continue;
+		}
+
+		int result;
+		if (validate_block (job->data + (i - state->blockstart_min), header, &result) != 0) {
+			fprintf (stderr, "Error while validating block at %lu\n", i);
+			return 1;
+		}
+
+		if (result != 0) {
+			job->invalid_found = 1;
+			break;
+		}
+	}
+
+	job->valid_end = i;
+
+#ifdef BDL_DBG_SCAN
+	printf ("Scanned region before hint block at %lu, valid blocks end at %lu\n", state->location, job->valid_end);
+#endif
+
+	return 0;
+}
+
+/* Workers take the oldest queued region */
+void *scan_worker (void *arg) {
+	struct scan *scan = (struct scan *) arg;
+
+	pthread_mutex_lock (&scan->lock);
+
+	while (scan->stopping == 0) {
+		struct scan_job *job = NULL;
+
+		for (unsigned long int i = scan->consumed; i < scan->produced; i++) {
+			if (scan->jobs[i % scan->job_count].status == SCAN_JOB_QUEUED) {
+				job = &scan->jobs[i % scan->job_count];
+				break;
+			}
+		}
+
+		if (job == NULL) {
+			pthread_cond_wait (&scan->cond, &scan->lock);
+			continue;
+		}
+
+		job->status = SCAN_JOB_RUNNING;
+		pthread_mutex_unlock (&scan->lock);
+
+		int error = scan_process_job (scan, job);
+
+		pthread_mutex_lock (&scan->lock);
+		job->error = error;
+		job->status = SCAN_JOB_DONE;
+		pthread_cond_broadcast (&scan->cond);
+	}
+
+	pthread_mutex_unlock (&scan->lock);
+
+	return NULL;
+}
+
+/* Give the valid blocks of a scanned region to the callback */
+int scan_consume_job (
+	struct scan *scan,
+	struct scan_job *job,
+	int (*callback)(struct bdl_block_loop_callback_data *, int *result),
+	struct bdl_block_loop_callback_data *callback_data,
+	int *result
+) {
+	const struct bdl_hintblock_state *state = &job->state;
+
+	callback_data->file = scan->file;
+	callback_data->master_header = scan->header;
+	callback_data->hintblock_state = state;
+
+	for (unsigned long int i = state->blockstart_min; i < job->valid_end; i += scan->header->block_size) {
+		if (i == state->backup_location) {
+			continue;
+		}
+
+		char *block = job->data + (i - state->blockstart_min);
+
+		callback_data->block_position = i;
+		callback_data->block = (struct bdl_block_header *) block;
+		callback_data->block_data = block + sizeof(struct bdl_block_header);
+
+		if (callback (callback_data, result) != 0) {
+			fprintf (stderr, "Error in callback function while scanning blocks, at pos %lu\n", i);
+			return 1;
+		}
+
+		if (*result == BDL_BLOCK_LOOP_BREAK) {
+			break;
+		}
+		else if (*result == BDL_BLOCK_LOOP_ERR) {
+			return 1;
+		}
+	}
+
+	// Reading ends at an invalid block, like block_loop_blocks does
+	if (job->invalid_found == 1) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+	}
+
+	return 0;
+}
+
+/*
+ * Hint blocks are read here and not by the workers, as reading them might write a
+ * recovered hint block. The scan begins at first_location and continues until the
+ * device has been wrapped, skipping regions with invalid hint blocks.
+ */
+int scan_run (
+	struct scan *scan,
+	const struct bdl_block_location *first_location,
+	uint64_t timestamp_gteq,
+	uint64_t timestamp_lt,
+	int (*callback)(struct bdl_block_loop_callback_data *, int *result),
+	struct bdl_block_loop_callback_data *callback_data,
+	int *result
+) {
+	unsigned long int first_position = first_location->hintblock_state.location;
+	unsigned long int position = first_position;
+	int end = 0;
+
+	while (1) {
+		// Queue regions ahead of the one given to the callback
+		while (end == 0 && scan->produced < scan->consumed + scan->job_count) {
+			struct scan_job *job = &scan->jobs[scan->produced % scan->job_count];
+
+			if (block_get_region_state (scan->file, position, scan->header, &job->state) != 0) {
+				fprintf (stderr, "Error while reading hint block at %lu while scanning\n", position);
+				return 1;
+			}
+
+			// Skipped like the writer does, newer regions may follow a damaged hint block
+			if (job->state.valid != 1) {
+				position = block_next_hintblock_position (scan->file, scan->header, position);
+				if (position == first_position) {
+					end = 1;
+				}
+				continue;
+			}
+
+			job->skip = (job->state.highest_timestamp < timestamp_gteq);
+			job->error = 0;
+			job->valid_end = job->state.blockstart_min;
+			job->invalid_found = 0;
+
+			pthread_mutex_lock (&scan->lock);
+			job->status = (job->skip ? SCAN_JOB_DONE : SCAN_JOB_QUEUED);
+			scan->produced++;
+			pthread_cond_broadcast (&scan->cond);
+			pthread_mutex_unlock (&scan->lock);
+
+			position = block_next_hintblock_position (scan->file, scan->header, position);
+			if (position == first_position) {
+				end = 1;
+			}
+
+			// Regions come in timestamp order, the following ones only hold records past the bound
+			if (timestamp_lt != 0 && job->state.highest_timestamp >= timestamp_lt) {
+				end = 1;
+			}
+		}
+
+		if (scan->consumed == scan->produced) {
+			break;
+		}
+
+		struct scan_job *job = &scan->jobs[scan->consumed % scan->job_count];
+
+		pthread_mutex_lock (&scan->lock);
+		while (job->status != SCAN_JOB_DONE) {
+			pthread_cond_wait (&scan->cond, &scan->lock);
+		}
+		pthread_mutex_unlock (&scan->lock);
+
+		if (job->error != 0) {
+			fprintf (stderr, "Error while scanning region before hint block at %lu\n", job->state.location);
+			return 1;
+		}
+
+		if (job->skip == 0 && scan_consume_job (scan, job, callback, callback_data, result) != 0) {
+			return 1;
+		}
+
+		pthread_mutex_lock (&scan->lock);
+		job->status = SCAN_JOB_FREE;
+		scan->consumed++;
+		pthread_mutex_unlock (&scan->lock);
+
+		if (*result == BDL_BLOCK_LOOP_BREAK) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int scan_regions (
+	struct bdl_io_file *file,
+	const struct bdl_header *header,
+	const struct bdl_block_location *first_location,
+	uint64_t timestamp_gteq,
+	uint64_t timestamp_lt,
+	int thread_count,
+	int (*callback)(struct bdl_block_loop_callback_data *, int *result),
+	struct bdl_block_loop_callback_data *callback_data,
+	int *result
+) {
+	*result = BDL_BLOCK_LOOP_OK;
+
+	if (first_location->hintblock_state.valid != 1) {
+		fprintf (stderr, "Bug: Called scan_regions with invalid first block set\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (thread_count > BDL_SCAN_THREADS_MAX) {
+		thread_count = BDL_SCAN_THREADS_MAX;
+	}
+
+	// Workers read with their own positions
+	if (io_sync (file) != 0) {
+		fprintf (stderr, "Error while syncing before scanning\n");
+		return 1;
+	}
+
+	struct scan scan;
+	memset (&scan, '\0', sizeof(scan));
+
+	scan.file = file;
+	scan.header = header;
+	scan.job_count = thread_count * BDL_SCAN_JOBS_PER_THREAD;
+
+	// Every job has a buffer for a whole region without a memory map
+	if (!io_is_mapped (file) && scan.job_count > BDL_SCAN_BUFFER_MAX / BDL_DEFAULT_HINTBLOCK_SPACING) {
+		scan.job_count = BDL_SCAN_BUFFER_MAX / BDL_DEFAULT_HINTBLOCK_SPACING;
+		if ((unsigned long int) thread_count > scan.job_count) {
+			thread_count = scan.job_count;
+		}
+	}
+	scan.jobs = malloc (scan.job_count * sizeof(*scan.jobs));
+	scan.threads = malloc (thread_count * sizeof(*scan.threads));
+
+	int ret = 0;
+
+	if (scan.jobs == NULL || scan.threads == NULL) {
+		fprintf (stderr, "Could not allocate jobs for scanning\n");
+		ret = 1;
+		goto out_free;
+	}
+
+	memset (scan.jobs, '\0', scan.job_count * sizeof(*scan.jobs));
+
+	for (unsigned long int i = 0; i < scan.job_count; i++) {
+		scan.jobs[i].status = SCAN_JOB_FREE;
+
+		// Regions are read directly from the memory map if there is one
+		if (io_is_mapped (file)) {
+			continue;
+		}
+
+		if ((scan.jobs[i].buffer = malloc (BDL_DEFAULT_HINTBLOCK_SPACING)) == NULL) {
+			fprintf (stderr, "Could not allocate buffer for scanning\n");
+			ret = 1;
+			goto out_free;
+		}
+	}
+
+	pthread_mutex_init (&scan.lock, NULL);
+	pthread_cond_init (&scan.cond, NULL);
+
+	for (scan.thread_count = 0; scan.thread_count < thread_count; scan.thread_count++) {
+		if (pthread_create (&scan.threads[scan.thread_count], NULL, scan_worker, &scan) != 0) {
+			fprintf (stderr, "Could not start scan thread\n");
+			ret = 1;
+			goto out_stop;
+		}
+	}
+
+#ifdef BDL_DBG_SCAN
+	printf ("Scanning with %i threads and %lu jobs\n", scan.thread_count, scan.job_count);
+#endif
+
+	ret = scan_run (&scan, first_location, timestamp_gteq, timestamp_lt, callback, callback_data, result);
+
+	out_stop:
+	pthread_mutex_lock (&scan.lock);
+	scan.stopping = 1;
+	pthread_cond_broadcast (&scan.cond);
+	pthread_mutex_unlock (&scan.lock);
+
+	for (int i = 0; i < scan.thread_count; i++) {
+		pthread_join (scan.threads[i], NULL);
+	}
+
+	pthread_cond_destroy (&scan.cond);
+	pthread_mutex_destroy (&scan.lock);
+
+	out_free:
+	if (scan.jobs != NULL) {
+		for (unsigned long int i = 0; i < scan.job_count; i++) {
+			free (scan.jobs[i].buffer);
+		}
+	}
+	free (scan.jobs);
+	free (scan.threads);
+
+	return ret;
+}
@@ -0,0 +1,97 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_SCAN_H
+#define BDL_SCAN_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "blocks.h"
+#include "io.h"
+#include "../include/bdl.h"
+
+/*
+ * Parallel scan of regions. Worker threads read and validate the blocks of whole
+ * regions, while the calling thread reads hint blocks and gives the valid blocks
+ * to the callback region by region in the same order as block_loop_blocks inside
+ * block_loop_hintblocks_large_device would have. Like there, the scan ends at the
+ * first invalid block. Only a limited number of regions are read ahead of the one
+ * given to the callback. Without a memory map, each of them needs a buffer as large
+ * as a region, and their number is limited by BDL_SCAN_BUFFER_MAX.
+ */
+
+#define SCAN_JOB_FREE		0
+#define SCAN_JOB_QUEUED		1
+#define SCAN_JOB_RUNNING	2
+#define SCAN_JOB_DONE		3
+
+struct scan_job {
+	int status;
+	int error;
+
+	/* Set for regions without blocks for us, no reading is done */
+	int skip;
+
+	struct bdl_hintblock_state state;
+
+	/* Blocks from the start of the region, points into the memory map or the buffer */
+	char *buffer;
+	char *data;
+
+	/* Position after the last valid block */
+	unsigned long int valid_end;
+
+	/* Set if an invalid block was found before the one the hint block points to */
+	int invalid_found;
+};
+
+struct scan {
+	struct bdl_io_file *file;
+	const struct bdl_header *header;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stopping;
+
+	pthread_t *threads;
+	int thread_count;
+
+	/* Region number n is handled by job n % job_count */
+	struct scan_job *jobs;
+	unsigned long int job_count;
+	unsigned long int produced;
+	unsigned long int consumed;
+};
+
+int scan_regions (
+	struct bdl_io_file *file,
+	const struct bdl_header *header,
+	const struct bdl_block_location *first_location,
+	uint64_t timestamp_gteq,
+	uint64_t timestamp_lt,
+	int thread_count,
+	int (*callback)(struct bdl_block_loop_callback_data *, int *result),
+	struct bdl_block_loop_callback_data *callback_data,
+	int *result
+);
+
+#endif
@@ -22,16 +22,98 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
 
 #include "session.h"
 #include "io.h"
+#include "blocks.h"
+#include "write.h"
+#include "bdltime.h"
+#include "shared.h"
 #include "../include/bdl.h"
 
 void bdl_init_session (struct bdl_session *session) {
 	session->usercount = 0;
+	session->master_header_valid = 0;
+	session->compression = BDL_COMPRESSION_NONE;
+	time_source_init (&session->time_source);
+	session->threads = 1;
+	session->read_format = BDL_READ_FORMAT_TEXT;
+	session->read_reverse = 0;
+	memset (&session->read_filter, '\0', sizeof(session->read_filter));
 }
 
-int bdl_start_session (struct bdl_session *session, const char *device_path, int no_mmap) {
+int bdl_set_read_filter (
+		struct bdl_session *session,
+		uint64_t timestamp_lt, uint64_t appdata_mask, uint64_t appdata_value
+) {
+	if ((appdata_value & ~appdata_mask) != 0) {
+		fprintf (stderr, "Application data value %" PRIx64 " has bits outside of mask %" PRIx64 "\n", appdata_value, appdata_mask);
+		return 1;
+	}
+
+	session->read_filter.timestamp_lt = timestamp_lt;
+	session->read_filter.appdata_mask = appdata_mask;
+	session->read_filter.appdata_value = appdata_value;
+
+	return 0;
+}
+
+void bdl_set_read_reverse (struct bdl_session *session, int reverse) {
+	session->read_reverse = (reverse != 0);
+}
+
+int bdl_set_read_format (struct bdl_session *session, int format) {
+	if (format != BDL_READ_FORMAT_TEXT && format != BDL_READ_FORMAT_BINARY && format != BDL_READ_FORMAT_RAW) {
+		fprintf (stderr, "Unknown read format %i\n", format);
+		return 1;
+	}
+
+	session->read_format = format;
+
+	return 0;
+}
+
+int bdl_set_threads (struct bdl_session *session, int threads) {
+	if (threads < 1) {
+		fprintf (stderr, "Number of threads must be at least 1\n");
+		return 1;
+	}
+
+	session->threads = threads;
+
+	return 0;
+}
+
+int bdl_set_compression (struct bdl_session *session, int compression) {
+	if (compression != BDL_COMPRESSION_NONE && compression != BDL_COMPRESSION_LZ) {
+		fprintf (stderr, "Unknown compression %i\n", compression);
+		return 1;
+	}
+
+	session->compression = compression;
+
+	return 0;
+}
+
+int bdl_set_time_source (struct bdl_session *session, int clock, int nanoseconds) {
+	return time_source_set (&session->time_source, clock, nanoseconds);
+}
+
+int bdl_set_discard (struct bdl_session *session, int discard) {
+	if (session->usercount == 0) {
+		fprintf (stderr, "Session must be started before setting discard\n");
+		return 1;
+	}
+
+	session->device.discard = (discard != 0);
+
+	return 0;
+}
+
+int bdl_start_session (struct bdl_session *session, const char *device_path, int flags) {
 	if (session->usercount > 0) {
 		if (device_path != NULL) {
 			fprintf (stderr, "Device argument dev=DEVICE was given while session was already open\n");
@@ -46,16 +128,94 @@ int bdl_start_session (struct bdl_session *session, const char *device_path, int
 		return 1;
 	}
 
-	if (io_open(device_path, &session->device, no_mmap) != 0) {
+	if (io_open (
+			device_path, &session->device,
+			(flags & BDL_SESSION_NO_MMAP) != 0,
+			(flags & BDL_SESSION_READONLY) != 0
+	) != 0) {
 		fprintf (stderr, "Error while opening %s\n", device_path);
 		return 1;
 	}
 
+	if ((flags & BDL_SESSION_SHARED) != 0 && shared_open (&session->device, (flags & BDL_SESSION_READONLY) != 0) != 0) {
+		fprintf (stderr, "Error while opening shared page of %s\n", device_path);
+		io_close (&session->device);
+		return 1;
+	}
+
+	// The device might not be initialized yet, the header is validated on first use
+	session->master_header_valid = 0;
 	session->usercount = 1;
 
 	return 0;
 }
 
+/* Read and validate the master header from the device, and keep it if it's valid */
+int session_revalidate_master_header (struct bdl_session *session, int *result) {
+	session->master_header_valid = 0;
+
+	// The device might have been initialized again with another layout
+	write_head_cache_reset (&session->device);
+
+	if (block_get_validate_master_header(&session->device, &session->master_header, result) != 0) {
+		return 1;
+	}
+
+	if (*result == 0) {
+		session->master_header_valid = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Get the master header validated earlier. The hash of the header on the device is
+ * compared with the one we have to detect re-initialization by others, in which
+ * case the header is validated again.
+ */
+int session_get_master_header (struct bdl_session *session, const struct bdl_header **header, int *result) {
+	*header = NULL;
+	*result = 1;
+
+	if (session->master_header_valid == 1) {
+		uint32_t hash;
+		if (io_read_block(
+				&session->device,
+				offsetof(struct bdl_header, hash),
+				(char *) &hash, sizeof(hash)
+		) != 0) {
+			fprintf (stderr, "Error while reading hash of master header\n");
+			return 1;
+		}
+
+		if (hash == session->master_header.hash) {
+			*header = &session->master_header;
+			*result = 0;
+			return 0;
+		}
+	}
+
+	if (session_revalidate_master_header(session, result) != 0) {
+		return 1;
+	}
+
+	if (*result == 0) {
+		*header = &session->master_header;
+	}
+
+	return 0;
+}
+
+int bdl_get_shared_head (struct bdl_session *session, struct bdl_shared_head *head, int *result) {
+	memset (head, '\0', sizeof(*head));
+	*result = shared_get_head (&session->device, head);
+	return 0;
+}
+
+int bdl_revalidate_header (struct bdl_session *session, int *result) {
+	return session_revalidate_master_header(session, result);
+}
+
 void bdl_close_session (struct bdl_session *session) {
 	if (session->usercount <= 0) {
 		fprintf (stderr, "Bug: close_session called while no session was active\n");
@@ -65,6 +225,7 @@ void bdl_close_session (struct bdl_session *session) {
 	session->usercount--;
 
 	if (session->usercount == 0) {
+		shared_close(&session->device);
 		io_close(&session->device);
 	}
 
@@ -19,3 +19,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+
+#ifndef BDL_SESSION_H
+#define BDL_SESSION_H
+
+#include "../include/bdl.h"
+
+int session_revalidate_master_header (struct bdl_session *session, int *result);
+int session_get_master_header (struct bdl_session *session, const struct bdl_header **header, int *result);
+
+#endif
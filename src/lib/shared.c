@@ -0,0 +1,287 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shared.h"
+#include "defaults.h"
+#include "../include/bdl.h"
+
+//#define BDL_DBG_SHARED
+
+/*
+ * The page is named after the device and not the path it was opened with, so that
+ * all processes find the same page whichever link they use.
+ */
+int shared_get_name (struct bdl_io_file *file, char *name, unsigned long int name_length) {
+	struct stat params;
+	if (fstat (fileno(file->file), &params) != 0) {
+		fprintf (stderr, "Could not stat file/device: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (S_ISBLK(params.st_mode)) {
+		snprintf (name, name_length, "/bdl-rdev-%llx", (unsigned long long int) params.st_rdev);
+	}
+	else {
+		snprintf (name, name_length, "/bdl-%llx-%llx",
+				(unsigned long long int) params.st_dev, (unsigned long long int) params.st_ino);
+	}
+
+	return 0;
+}
+
+/*
+ * Open the shared page of the device, creating it if needed. A session which is not
+ * read-only takes the writer lock of the page and fails if another process has it.
+ * The lock is released when the descriptor is closed, also if the process dies.
+ */
+int shared_open (struct bdl_io_file *file, int readonly) {
+	char name[64];
+	int writable = 1;
+	int fd = -1;
+
+	file->shared_page = NULL;
+	file->shared_fd = -1;
+
+	if (shared_get_name (file, name, sizeof(name)) != 0) {
+		return 1;
+	}
+
+	fd = shm_open (name, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (fd < 0 && readonly && errno == EACCES) {
+		// Readers only need to see the page, another process created it
+		writable = 0;
+		fd = shm_open (name, O_RDONLY|O_CLOEXEC, 0);
+	}
+	if (fd < 0) {
+		fprintf (stderr, "Could not open shared page %s: %s\n", name, strerror(errno));
+		return 1;
+	}
+
+	unsigned long int size = (sizeof(struct bdl_shared_page) + getpagesize() - 1) & ~((unsigned long int) getpagesize() - 1);
+
+	struct stat params;
+	if (fstat (fd, &params) != 0) {
+		fprintf (stderr, "Could not stat shared page %s: %s\n", name, strerror(errno));
+		goto out_close;
+	}
+
+	if ((unsigned long int) params.st_size < size) {
+		if (!writable) {
+			fprintf (stderr, "Shared page %s is too small\n", name);
+			goto out_close;
+		}
+		if (ftruncate (fd, size) != 0) {
+			fprintf (stderr, "Could not resize shared page %s: %s\n", name, strerror(errno));
+			goto out_close;
+		}
+	}
+
+	struct bdl_shared_page *page = mmap (
+			NULL, size,
+			(writable ? PROT_READ|PROT_WRITE : PROT_READ), MAP_SHARED,
+			fd, 0
+	);
+	if (page == MAP_FAILED) {
+		fprintf (stderr, "Could not map shared page %s: %s\n", name, strerror(errno));
+		goto out_close;
+	}
+
+	// A new page is zero, and whoever opens it first fills in the magic
+	if (writable) {
+		uint64_t expected = 0;
+		__atomic_store_n (&page->version, BDL_SHARED_VERSION, __ATOMIC_RELAXED);
+		__atomic_compare_exchange_n (
+				&page->magic, &expected, BDL_SHARED_MAGIC,
+				0, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+		);
+	}
+
+	if (__atomic_load_n (&page->magic, __ATOMIC_ACQUIRE) != BDL_SHARED_MAGIC || page->version != BDL_SHARED_VERSION) {
+		fprintf (stderr, "Shared page %s has unknown contents, remove it if no process uses it\n", name);
+		goto out_unmap;
+	}
+
+	if (!readonly) {
+		if (flock (fd, LOCK_EX|LOCK_NB) != 0) {
+			if (errno == EWOULDBLOCK) {
+				fprintf (stderr, "Device is already being written by process %i\n", (int) page->writer_pid);
+			}
+			else {
+				fprintf (stderr, "Could not lock shared page %s: %s\n", name, strerror(errno));
+			}
+			goto out_unmap;
+		}
+
+		// A writer which died while publishing leaves the sequence odd
+		uint32_t sequence = __atomic_load_n (&page->sequence, __ATOMIC_RELAXED);
+		if ((sequence & 1) != 0) {
+			__atomic_store_n (&page->sequence, sequence + 1, __ATOMIC_RELEASE);
+		}
+
+		page->writer_pid = getpid();
+	}
+
+#ifdef BDL_DBG_SHARED
+	printf ("Opened shared page %s generation %u writer %i\n", name, page->generation, (int) page->writer_pid);
+#endif
+
+	file->shared_page = page;
+	file->shared_fd = fd;
+	file->shared_size = size;
+	file->shared_writer = !readonly;
+
+	return 0;
+
+	out_unmap:
+	munmap (page, size);
+
+	out_close:
+	close (fd);
+	return 1;
+}
+
+void shared_close (struct bdl_io_file *file) {
+	if (file->shared_page == NULL) {
+		return;
+	}
+
+	if (file->shared_writer) {
+		file->shared_page->writer_pid = 0;
+	}
+
+	munmap (file->shared_page, file->shared_size);
+	close (file->shared_fd);
+
+	file->shared_page = NULL;
+	file->shared_fd = -1;
+}
+
+/*
+ * Publish the head of the device after its hint block was updated, and wake the
+ * processes waiting for it. Positions of zero tell readers to search for the head
+ * themselves, like after the device was cleared.
+ */
+int shared_publish_head (
+		struct bdl_io_file *file,
+		unsigned long int hintblock_position,
+		unsigned long int block_position,
+		uint64_t timestamp
+) {
+	struct bdl_shared_page *page = file->shared_page;
+
+	if (page == NULL || !file->shared_writer) {
+		return 0;
+	}
+
+	// Processes woken below must be able to read what we wrote
+	if (file->memorymap == NULL && fflush (file->file) != 0) {
+		fprintf (stderr, "Error while flushing device before publishing head: %s\n", strerror(errno));
+		return 1;
+	}
+
+	// Only we change the sequence while we hold the writer lock
+	uint32_t sequence = page->sequence;
+
+	__atomic_store_n (&page->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	__atomic_store_n (&page->hintblock_position, hintblock_position, __ATOMIC_RELAXED);
+	__atomic_store_n (&page->block_position, block_position, __ATOMIC_RELAXED);
+	__atomic_store_n (&page->timestamp, timestamp, __ATOMIC_RELAXED);
+	__atomic_store_n (&page->generation, page->generation + 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n (&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+	syscall (SYS_futex, &page->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	return 0;
+}
+
+/*
+ * Copy the head last published. Returns 1 if there is no shared page, or if the
+ * writer kept changing it.
+ */
+int shared_get_head (const struct bdl_io_file *file, struct bdl_shared_head *head) {
+	const struct bdl_shared_page *page = file->shared_page;
+
+	if (page == NULL) {
+		return 1;
+	}
+
+	for (int i = 0; i < BDL_SHARED_READ_ATTEMPTS; i++) {
+		uint32_t before = __atomic_load_n (&page->sequence, __ATOMIC_ACQUIRE);
+		if ((before & 1) != 0) {
+			sched_yield();
+			continue;
+		}
+
+		head->generation = __atomic_load_n (&page->generation, __ATOMIC_RELAXED);
+		head->hintblock_position = __atomic_load_n (&page->hintblock_position, __ATOMIC_RELAXED);
+		head->block_position = __atomic_load_n (&page->block_position, __ATOMIC_RELAXED);
+		head->timestamp = __atomic_load_n (&page->timestamp, __ATOMIC_RELAXED);
+		head->writer_pid = __atomic_load_n (&page->writer_pid, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n (&page->sequence, __ATOMIC_RELAXED) == before) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+uint32_t shared_get_generation (const struct bdl_io_file *file) {
+	return __atomic_load_n (&file->shared_page->generation, __ATOMIC_ACQUIRE);
+}
+
+/* Sleep until the generation differs from the one given or timeout_ms passes */
+int shared_wait (const struct bdl_io_file *file, uint32_t generation, unsigned long int timeout_ms) {
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+	if (syscall (SYS_futex, &file->shared_page->generation, FUTEX_WAIT, generation, &timeout, NULL, 0) != 0) {
+		if (errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			fprintf (stderr, "Error while waiting on shared page: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_SHARED_H
+#define BDL_SHARED_H
+
+#include <stdint.h>
+
+#include "../include/bdl.h"
+
+#define BDL_SHARED_MAGIC 0x4244534841524544ULL
+#define BDL_SHARED_VERSION 1
+
+/*
+ * Page in shared memory for processes using the same device, see BDL_SESSION_SHARED.
+ * The head fields and the generation are changed by the writer only while the
+ * sequence is odd, and readers copy them again if the sequence changed meanwhile.
+ * Waiters sleep on the generation with a futex, which is why it is 32 bits.
+ */
+struct bdl_shared_page {
+	uint64_t magic;
+	uint32_t version;
+
+	uint32_t sequence;
+	uint32_t generation;
+
+	/* Process holding the writer lock, zero if none */
+	int32_t writer_pid;
+
+	uint64_t hintblock_position;
+	uint64_t block_position;
+	uint64_t timestamp;
+};
+
+int shared_open (struct bdl_io_file *file, int readonly);
+void shared_close (struct bdl_io_file *file);
+int shared_publish_head (
+		struct bdl_io_file *file,
+		unsigned long int hintblock_position,
+		unsigned long int block_position,
+		uint64_t timestamp
+);
+int shared_get_head (const struct bdl_io_file *file, struct bdl_shared_head *head);
+uint32_t shared_get_generation (const struct bdl_io_file *file);
+int shared_wait (const struct bdl_io_file *file, uint32_t generation, unsigned long int timeout_ms);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "../include/bdl.h"
+#include "io.h"
+#include "arena.h"
+#include "defaults.h"
+#include "blocks.h"
+#include "stats.h"
+
+//#define BDL_DBG_STATS
+
+struct stats_loop_data {
+	struct bdl_stats *stats;
+	int (*callback)(void *arg, const struct bdl_region_stats *region);
+	void *arg;
+
+	int oldest_found;
+	struct bdl_hintblock_state oldest_state;
+};
+
+/* Blocks written to a region, the backup hint block in the middle is not counted */
+unsigned long int stats_region_block_count (
+		const struct bdl_header *master_header,
+		const struct bdl_hintblock_state *state
+) {
+	unsigned long int count = (state->hintblock.previous_block_pos - state->blockstart_min) / master_header->block_size + 1;
+
+	if (state->hintblock.previous_block_pos > state->backup_location) {
+		count--;
+	}
+
+	return count;
+}
+
+int stats_hintblock_loop_callback (
+		struct bdl_hintblock_loop_callback_data *data,
+		int *result
+) {
+	struct stats_loop_data *loop_data = (struct stats_loop_data *) data->argument_ptr;
+	const struct bdl_hintblock_state *state = &data->location->hintblock_state;
+	struct bdl_stats *stats = loop_data->stats;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	struct bdl_region_stats region;
+	memset (&region, '\0', sizeof(region));
+
+	region.hintblock_position = data->hintblock_position;
+
+	stats->region_count++;
+
+	if (state->valid == 1) {
+		region.used = 1;
+		region.block_count = stats_region_block_count (data->master_header, state);
+		region.highest_timestamp = state->highest_timestamp;
+
+		stats->regions_used++;
+		stats->blocks_used += region.block_count;
+
+		if (state->highest_timestamp > stats->newest_timestamp) {
+			stats->newest_timestamp = state->highest_timestamp;
+			stats->head_hintblock_position = state->location;
+			stats->head_block_position = state->hintblock.previous_block_pos;
+		}
+
+		if (loop_data->oldest_found == 0 || state->highest_timestamp < loop_data->oldest_state.highest_timestamp) {
+			loop_data->oldest_state = *state;
+			loop_data->oldest_found = 1;
+		}
+	}
+	else {
+		stats->regions_free++;
+	}
+
+#ifdef BDL_DBG_STATS
+	printf ("Region at %lu used %i blocks %" PRIu64 " highest timestamp %" PRIu64 "\n",
+			data->hintblock_position, region.used, region.block_count, region.highest_timestamp);
+#endif
+
+	if (loop_data->callback != NULL && loop_data->callback(loop_data->arg, &region) != 0) {
+		fprintf (stderr, "Error from callback function while getting region statistics\n");
+		*result = BDL_BLOCK_LOOP_ERR;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The oldest record is the first one in the oldest region. Packed blocks have the
+ * timestamp of their newest record, and the oldest one comes first in the directory.
+ */
+int stats_get_oldest_timestamp (
+		struct bdl_io_file *file,
+		const struct bdl_header *master_header,
+		const struct bdl_hintblock_state *state,
+		uint64_t *timestamp
+) {
+	int ret = 0;
+
+	*timestamp = state->highest_timestamp;
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&file->arena, &mark);
+
+	char *buf = arena_alloc (&file->arena, master_header->block_size);
+	if (buf == NULL) {
+		fprintf (stderr, "Could not allocate block buffer while getting oldest timestamp\n");
+		ret = 1;
+		goto out;
+	}
+
+	int result;
+	struct bdl_block_header *block_header;
+	char *data;
+	if (block_get_validate_block (
+			file, state->blockstart_min, master_header,
+			buf, master_header->block_size,
+			&block_header, &data,
+			&result
+	) != 0) {
+		fprintf (stderr, "Error while reading first block of region at %lu\n", state->location);
+		ret = 1;
+		goto out;
+	}
+
+	if (result != 0) {
+		goto out;
+	}
+
+	*timestamp = block_header->timestamp;
+
+	if ((block_header->flags & BDL_BLOCK_FLAG_PACKED) != 0) {
+		struct bdl_packed_header *packed_header = (struct bdl_packed_header *) data;
+		struct bdl_packed_record *packed_record = (struct bdl_packed_record *) (data + sizeof(*packed_header));
+
+		if (	block_header->data_length >= sizeof(*packed_header) + sizeof(*packed_record) &&
+				packed_header->record_count > 0 &&
+				packed_record->timestamp_delta <= block_header->timestamp
+		) {
+			*timestamp = block_header->timestamp - packed_record->timestamp_delta;
+		}
+	}
+
+	out:
+	arena_release (&file->arena, &mark);
+	return ret;
+}
+
+int stats_get (
+		struct bdl_io_file *file,
+		const struct bdl_header *master_header,
+		struct bdl_stats *stats,
+		int (*callback)(void *arg, const struct bdl_region_stats *region),
+		void *arg,
+		int *result
+) {
+	struct stats_loop_data loop_data;
+	memset (&loop_data, '\0', sizeof(loop_data));
+	memset (stats, '\0', sizeof(*stats));
+
+	loop_data.stats = stats;
+	loop_data.callback = callback;
+	loop_data.arg = arg;
+
+	stats->block_size = master_header->block_size;
+	stats->region_capacity = block_region_capacity (master_header);
+
+	struct bdl_hintblock_loop_callback_data callback_data;
+	struct bdl_block_location location;
+	callback_data.argument_int = 0;
+	callback_data.argument_ptr = &loop_data;
+
+	if (block_loop_hintblocks_large_device (
+			file, master_header, NULL,
+			stats_hintblock_loop_callback, &callback_data,
+			&location,
+			result
+	) != 0) {
+		fprintf (stderr, "Error while looping hint blocks while getting statistics\n");
+		return 1;
+	}
+
+	*result = 0;
+
+	// Empty devices are written from the first region
+	if (loop_data.oldest_found == 0) {
+		stats->next_hintblock_position = master_header->header_size + BDL_DEFAULT_HINTBLOCK_SPACING;
+		return 0;
+	}
+
+	if (stats_get_oldest_timestamp (file, master_header, &loop_data.oldest_state, &stats->oldest_timestamp) != 0) {
+		return 1;
+	}
+
+	stats->next_hintblock_position = block_next_hintblock_position (file, master_header, stats->head_hintblock_position);
+
+	struct bdl_hintblock_state next_state;
+	if (block_get_region_state (file, stats->next_hintblock_position, master_header, &next_state) != 0) {
+		fprintf (stderr, "Error while reading region at %lu while getting statistics\n", (unsigned long int) stats->next_hintblock_position);
+		return 1;
+	}
+
+	stats->next_region_used = (next_state.valid == 1);
+
+	return 0;
+}
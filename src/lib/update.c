@@ -19,12 +19,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include "../include/bdl.h"
 #include "update.h"
 #include "blocks.h"
 #include "write.h"
+#include "record.h"
+#include "arena.h"
 
 struct update_block_loop_data {
 	uint64_t timestamp_gteq;
@@ -33,25 +37,104 @@ struct update_block_loop_data {
 	struct bdl_update_callback_data *update_data;
 	struct bdl_update_info (*test)(void *arg, struct bdl_update_callback_data *update_data);
 	void *test_arg;
+	struct bdl_record_state record_state;
 };
 
-int update_block_loop_callback(struct bdl_block_loop_callback_data *data, int *result) {
-	struct update_block_loop_data *loop_data = (struct update_block_loop_data *) data->argument_ptr;
-	const struct bdl_block_header *block_header = data->block;
+struct update_record_loop_data {
+	struct update_block_loop_data *loop_data;
+	struct bdl_block_header new_header;
+	int dirty;
+	unsigned long int chain_position;
+	unsigned long int chain_block_count;
+
+	/*
+	 * The hash of new_header is patched for every changed directory entry of a packed block,
+	 * patch_failed is set if the hash algorithm cannot do this and the block must be rehashed.
+	 */
+	const struct bdl_block_header *block;
+	uint8_t hash_algorithm;
+	int patch_failed;
+	unsigned long int directory_dirty_first;
+	unsigned long int directory_dirty_last;
+};
+
+/*
+ * Patch the hash of new_header after its application data has been changed from that of
+ * old_header. Returns 1 if the hash algorithm cannot do this.
+ */
+int update_patch_header_application_data (
+		const struct bdl_block_header *old_header,
+		struct bdl_block_header *new_header,
+		uint8_t hash_algorithm
+) {
+	return block_hash_patch (
+			old_header,
+			offsetof(struct bdl_block_header, application_data),
+			(const char *) &old_header->application_data,
+			(const char *) &new_header->application_data,
+			sizeof(new_header->application_data),
+			hash_algorithm,
+			&new_header->hash
+	);
+}
+
+int update_patch_directory_entry (
+		struct update_record_loop_data *record_loop_data,
+		unsigned long int index,
+		struct bdl_packed_record *packed_record,
+		uint64_t new_appdata
+) {
+	uint64_t old_appdata = packed_record->application_data;
+	packed_record->application_data = new_appdata;
+
+	if (record_loop_data->dirty == 0 || index < record_loop_data->directory_dirty_first) {
+		record_loop_data->directory_dirty_first = index;
+	}
+	if (record_loop_data->dirty == 0 || index > record_loop_data->directory_dirty_last) {
+		record_loop_data->directory_dirty_last = index;
+	}
+
+	if (record_loop_data->patch_failed == 1) {
+		return 0;
+	}
+
+	unsigned long int offset =
+			sizeof(struct bdl_block_header) +
+			sizeof(struct bdl_packed_header) +
+			index * sizeof(struct bdl_packed_record) +
+			offsetof(struct bdl_packed_record, application_data);
+
+	if (block_hash_patch (
+			record_loop_data->block,
+			offset,
+			(const char *) &old_appdata, (const char *) &new_appdata, sizeof(new_appdata),
+			record_loop_data->hash_algorithm,
+			&record_loop_data->new_header.hash
+	) != 0) {
+		record_loop_data->patch_failed = 1;
+	}
+
+	return 0;
+}
+
+int update_record_loop_callback(struct bdl_record_loop_callback_data *data, int *result) {
+	struct update_record_loop_data *record_loop_data = (struct update_record_loop_data *) data->argument_ptr;
+	struct update_block_loop_data *loop_data = record_loop_data->loop_data;
+	const struct bdl_block_header *record_header = &data->record_header;
 
 	*result = BDL_BLOCK_LOOP_OK;
 
-	if (	(block_header->timestamp < loop_data->timestamp_gteq) ||
-			(block_header->application_data & loop_data->application_data_and) == 0
+	if (	(record_header->timestamp < loop_data->timestamp_gteq) ||
+			(record_header->application_data & loop_data->application_data_and) == 0
 	) {
 		return 0;
 	}
 
 	struct bdl_update_callback_data callback_data = {
-			block_header->timestamp,
-			block_header->application_data,
-			block_header->data_length,
-			data->block_data
+			record_header->timestamp,
+			record_header->application_data,
+			record_header->data_length,
+			data->record_data
 	};
 
 	struct bdl_update_info update_info = loop_data->test (
@@ -60,10 +143,177 @@ int update_block_loop_callback(struct bdl_block_loop_callback_data *data, int *r
 	);
 
 	if (update_info.do_update == 1) {
+		// Headers and directories are never compressed, data is written back as-is
+		if (data->packed_record != NULL) {
+			update_patch_directory_entry (
+					record_loop_data,
+					data->record_index,
+					data->packed_record,
+					update_info.new_appdata
+			);
+		}
+		else {
+			record_loop_data->new_header.application_data = update_info.new_appdata;
+		}
+
+		if (data->block_count > 1) {
+			record_loop_data->chain_position = data->block_position;
+			record_loop_data->chain_block_count = data->block_count;
+		}
+
+		record_loop_data->dirty = 1;
+		loop_data->result_count++;
+	}
+
+	if (update_info.do_break == 1) {
+		*result = BDL_BLOCK_LOOP_BREAK;
+	}
+
+	return 0;
+}
+
+int update_rewrite_chain (
+		struct bdl_block_loop_callback_data *data,
+		unsigned long int first_position,
+		unsigned long int block_count,
+		uint64_t new_appdata
+) {
+	const struct bdl_header *master_header = data->master_header;
+	int ret = 0;
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&data->file->arena, &mark);
+
+	char *block_buf = arena_alloc (&data->file->arena, master_header->block_size);
+	if (block_buf == NULL) {
+		fprintf (stderr, "Could not allocate block buffer while updating chained record\n");
+		return 1;
+	}
+
+	struct bdl_block_header *block_header;
+	char *block_data;
+	int result;
+
+	unsigned long int position = first_position;
+	for (unsigned long int i = 0; i < block_count; i++) {
+		if (block_get_validate_block (
+				data->file, position, master_header,
+				block_buf, master_header->block_size,
+				&block_header, &block_data,
+				&result
+		) != 0 || result != 0) {
+			fprintf (stderr, "Could not read back block at %lu while updating chained record\n", position);
+			ret = 1;
+			break;
+		}
+
 		struct bdl_block_header new_header = *block_header;
-		new_header.application_data = update_info.new_appdata;
-		if (write_checksum_and_put_block(
+		new_header.application_data = new_appdata;
+
+		// Only the header changes, patch the hash and write the header if possible
+		if (update_patch_header_application_data (block_header, &new_header, master_header->default_hash_algorithm) == 0) {
+			if (write_patch_block (data->file, position, 0, (const char *) &new_header, sizeof(new_header)) != 0) {
+				ret = 1;
+				break;
+			}
+		}
+		else if (write_checksum_and_put_block(
 			&new_header,
+			block_header->data_length, block_data,
+			master_header,
+			position,
+			data->file
+		) != 0) {
+			ret = 1;
+			break;
+		}
+
+		position = block_next_position(data->hintblock_state, master_header, position);
+	}
+
+	arena_release (&data->file->arena, &mark);
+
+	return ret;
+}
+
+int update_block_loop_callback(struct bdl_block_loop_callback_data *data, int *result) {
+	struct update_block_loop_data *loop_data = (struct update_block_loop_data *) data->argument_ptr;
+	const struct bdl_block_header *block_header = data->block;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	if (block_header->timestamp < loop_data->timestamp_gteq) {
+		return 0;
+	}
+
+	struct update_record_loop_data record_loop_data;
+	record_loop_data.loop_data = loop_data;
+	record_loop_data.new_header = *block_header;
+	record_loop_data.dirty = 0;
+	record_loop_data.chain_position = 0;
+	record_loop_data.chain_block_count = 0;
+	record_loop_data.block = block_header;
+	record_loop_data.hash_algorithm = data->master_header->default_hash_algorithm;
+	record_loop_data.patch_failed = 0;
+	record_loop_data.directory_dirty_first = 0;
+	record_loop_data.directory_dirty_last = 0;
+
+	struct bdl_record_loop_callback_data callback_data;
+	callback_data.argument_int = 0;
+	callback_data.argument_ptr = (void *) &record_loop_data;
+
+	if (record_loop_block (
+			&loop_data->record_state,
+			block_header, data->block_data, data->block_position,
+			update_record_loop_callback, &callback_data,
+			result
+	) != 0) {
+		fprintf (stderr, "Error while looping records of block at %lu\n", data->block_position);
+		return 1;
+	}
+
+	if (record_loop_data.dirty == 0) {
+		return 0;
+	}
+
+	// All blocks of a chain carry the application data of the record
+	if (record_loop_data.chain_block_count > 0) {
+		if (update_rewrite_chain (
+				data,
+				record_loop_data.chain_position,
+				record_loop_data.chain_block_count,
+				record_loop_data.new_header.application_data
+		) != 0) {
+			*result =  BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// The application data of a packed block is the application data of all its records
+	if ((block_header->flags & BDL_BLOCK_FLAG_PACKED) != 0) {
+		const struct bdl_packed_header *packed_header = (const struct bdl_packed_header *) data->block_data;
+		const struct bdl_packed_record *directory = (const struct bdl_packed_record *) (data->block_data + sizeof(*packed_header));
+
+		record_loop_data.new_header.application_data = 0;
+		for (unsigned long int i = 0; i < packed_header->record_count; i++) {
+			record_loop_data.new_header.application_data |= directory[i].application_data;
+		}
+	}
+
+	if (record_loop_data.patch_failed == 0) {
+		record_loop_data.patch_failed = update_patch_header_application_data (
+				block_header,
+				&record_loop_data.new_header,
+				record_loop_data.hash_algorithm
+		);
+	}
+
+	// Hash algorithm has no patch support, rehash and write the whole block
+	if (record_loop_data.patch_failed != 0) {
+		if (write_checksum_and_put_block(
+			&record_loop_data.new_header,
 			block_header->data_length, data->block_data,
 			data->master_header,
 			data->block_position,
@@ -73,11 +323,39 @@ int update_block_loop_callback(struct bdl_block_loop_callback_data *data, int *r
 			return 1;
 		}
 
-		loop_data->result_count++;
+		return 0;
 	}
 
-	if (update_info.do_break == 1) {
-		*result = BDL_BLOCK_LOOP_BREAK;
+	// Write changed directory entries followed by the header with the patched hash
+	if ((block_header->flags & BDL_BLOCK_FLAG_PACKED) != 0) {
+		unsigned long int directory_offset =
+				sizeof(struct bdl_packed_header) +
+				record_loop_data.directory_dirty_first * sizeof(struct bdl_packed_record);
+		unsigned long int directory_length =
+				(record_loop_data.directory_dirty_last - record_loop_data.directory_dirty_first + 1) *
+				sizeof(struct bdl_packed_record);
+
+		if (write_patch_block (
+				data->file,
+				data->block_position,
+				sizeof(*block_header) + directory_offset,
+				data->block_data + directory_offset,
+				directory_length
+		) != 0) {
+			*result =  BDL_BLOCK_LOOP_ERR;
+			return 1;
+		}
+	}
+
+	if (write_patch_block (
+			data->file,
+			data->block_position,
+			0,
+			(const char *) &record_loop_data.new_header,
+			sizeof(record_loop_data.new_header)
+	) != 0) {
+		*result =  BDL_BLOCK_LOOP_ERR;
+		return 1;
 	}
 
 	return 0;
@@ -92,7 +370,7 @@ int update_hintblock_loop_callback(
 	const struct bdl_header *master_header = data->master_header;
 
 	if (hintblock_state->valid != 1) {
-		*result = BDL_BLOCK_LOOP_BREAK;
+		*result = BDL_BLOCK_LOOP_OK;
 		return 0;
 	}
 
@@ -103,24 +381,39 @@ int update_hintblock_loop_callback(
 
 	*result = BDL_BLOCK_LOOP_OK;
 
-	char block_buf[master_header->block_size];
+	struct bdl_arena_mark mark;
+	arena_get_mark (&data->file->arena, &mark);
+
+	char *block_buf = arena_alloc (&data->file->arena, master_header->block_size);
+	if (block_buf == NULL) {
+		fprintf (stderr, "Could not allocate block buffer in hintblock loop\n");
+		*result = BDL_BLOCK_LOOP_ERR;
+		return 1;
+	}
+
 	struct bdl_block_header *block_header;
 	char *block_data;
 
 	struct bdl_block_loop_callback_data callback_data;
-	unsigned long int block_position;
 
 	callback_data.argument_int = 0;
 	callback_data.argument_ptr = (void *) loop_data;
 
-	if (block_loop_blocks(
+	// Chains never cross regions
+	record_state_reset (&loop_data->record_state);
+
+	int ret = block_loop_blocks(
 			data->file, master_header, hintblock_state,
 			update_block_loop_callback,
 			block_buf, master_header->block_size,
 			&block_header, &block_data,
 			&callback_data,
 			result
-	) != 0) {
+	);
+
+	arena_release (&data->file->arena, &mark);
+
+	if (ret != 0) {
 		fprintf (stderr, "Error while looping blocks in hintblock loop\n");
 		return 1;
 	}
@@ -130,30 +423,19 @@ int update_hintblock_loop_callback(
 
 int update_application_data (
 	struct bdl_io_file *session_file,
+	const struct bdl_header *header,
 	uint64_t timestamp_min,
 	uint64_t application_data_and,
 	struct bdl_update_info (*test)(void *arg, struct bdl_update_callback_data *update_data),
 	void *arg,
 	int *result_final
 ) {
-	struct bdl_header header;
 	int result;
 	*result_final = 0;
 
-	// Read master header
-	if (block_get_validate_master_header(session_file, &header, &result) != 0) {
-		fprintf (stderr, "Could not get header from device while writing new data block\n");
-		return BDL_WRITE_ERR_IO;
-	}
-
-	if (result != 0) {
-		fprintf (stderr, "Invalid header of device while writing new data block\n");
-		return BDL_WRITE_ERR_CORRUPT;
-	}
-
 	// Find oldest hint block
 	struct bdl_block_location oldest_location;
-	if (block_find_oldest_hintblock(session_file, &header, timestamp_min, &oldest_location, &result) != 0) {
+	if (block_find_oldest_hintblock(session_file, header, timestamp_min, &oldest_location, &result) != 0) {
 		fprintf (stderr, "Error while finding oldest hint block\n");
 		return 1;
 	}
@@ -170,25 +452,29 @@ int update_application_data (
 	loop_data.result_count = 0;
 	loop_data.test = test;
 	loop_data.test_arg = arg;
+	record_state_init (&loop_data.record_state);
 
 	struct bdl_hintblock_loop_callback_data callback_data;
 	callback_data.argument_int = 0;
 	callback_data.argument_ptr = (void *) &loop_data;
 
 	struct bdl_block_location location;
+	int ret = 0;
 
 	if (block_loop_hintblocks_large_device (
-			session_file, &header,
+			session_file, header,
 			&oldest_location,
 			update_hintblock_loop_callback, &callback_data,
 			&location,
 			&result
 	) != 0) {
 		fprintf (stderr, "Error while looping hintblocks while updating blocks\n");
-		return 1;
+		ret = 1;
 	}
 
+	record_state_cleanup (&loop_data.record_state);
+
 	*result_final = loop_data.result_count;
 
-	return 0;
+	return ret;
 }
@@ -25,6 +25,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 int update_application_data (
 	struct bdl_io_file *session_file,
+	const struct bdl_header *header,
 	uint64_t timestamp_min,
 	uint64_t application_data_and,
 	struct bdl_update_info (*test)(void *arg, struct bdl_update_callback_data *update_data),
@@ -42,24 +42,33 @@ int validate_block(const char *all_data, const struct bdl_header *master_header,
 		return 0;
 	}
 
-	uint32_t hash_orig = header->hash;
+	if ((header->flags & ~BDL_BLOCK_FLAGS_ALL) != 0) {
+		*result = 1;
+		return 0;
+	}
 
-	char buf[total_size];
-	memcpy (buf, all_data, total_size);
-	struct bdl_block_header *header_copy = (struct bdl_block_header *) buf;
-	header_copy->hash = 0;
+	uint32_t chain_flags = header->flags & BDL_BLOCK_FLAGS_CHAIN;
+	if (chain_flags != 0 && (
+			(chain_flags & (chain_flags - 1)) != 0 ||
+			(header->flags & BDL_BLOCK_FLAG_PACKED) != 0
+	)) {
+		*result = 1;
+		return 0;
+	}
 
-	if (crypt_check_hash(
-			buf,
-			total_size,
+	uint32_t hash;
+	if (block_hash (
+			header,
+			all_data + sizeof(*header), header->data_length,
 			master_header->default_hash_algorithm,
-			hash_orig,
-			result) != 0
-	) {
+			&hash
+	) != 0) {
 		fprintf (stderr, "Error while checking hash for block\n");
 		return 1;
 	}
 
+	*result = (hash == header->hash ? 0 : 1);
+
 	return 0;
 }
 
@@ -151,16 +160,9 @@ int validate_header (const struct bdl_header *header, int file_size, int *result
 		fprintf (stderr, "The block size defined in the header (%" PRIu64 ") was not dividable with %d\n", header->block_size, BDL_BLOCKSIZE_DIVISOR);
 		*result = 1;
 	}
-
-	return 0;
-}
-
-int validate_dev (struct bdl_io_file *session_file, int *result) {
-	struct bdl_header header;
-
-	if (block_get_validate_master_header(session_file, &header, result) != 0) {
-		fprintf (stderr, "Could not get header from device while writing new data block\n");
-		return 1;
+	else if ((BDL_DEFAULT_HINTBLOCK_SPACING / 2) % header->block_size != 0) {
+		fprintf (stderr, "The block size defined in the header (%" PRIu64 ") does not divide %d\n", header->block_size, BDL_DEFAULT_HINTBLOCK_SPACING / 2);
+		*result = 1;
 	}
 
 	return 0;
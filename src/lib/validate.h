@@ -23,7 +23,6 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "io.h"
 #include "../include/bdl.h"
 
-int validate_dev (struct bdl_io_file *session_file, int *result);
 int validate_hintblock (
 		const struct bdl_hint_block *header_orig,
 		unsigned long int position,
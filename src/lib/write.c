@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -26,12 +27,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <inttypes.h>
 
 #include "write.h"
+#include "arena.h"
 #include "blocks.h"
 #include "defaults.h"
 #include "io.h"
 #include "crypt.h"
 #include "validate.h"
 #include "bdltime.h"
+#include "compress.h"
+#include "shared.h"
 #include "../include/bdl.h"
 
 //#define BDL_DBG_WRITE
@@ -47,6 +51,7 @@ int write_find_location_small(struct bdl_io_file *file, const struct bdl_header
 
 int write_check_free_hintblock (
 		const struct bdl_header *master_header,
+		unsigned long int blocks_needed,
 		struct bdl_block_location *location,
 		int *result
 ) {
@@ -64,86 +69,197 @@ int write_check_free_hintblock (
 		location->block_location = state->blockstart_min;
 
 		*result = 0;
+
+		return 0;
 	}
-	else {
-		if (state->hintblock.previous_block_pos + master_header->block_size <= state->blockstart_max) {
+
+	unsigned long int first_position = block_next_position(state, master_header, state->hintblock.previous_block_pos);
+	unsigned long int last_position = first_position;
+	for (unsigned long int i = 1; i < blocks_needed; i++) {
+		last_position = block_next_position(state, master_header, last_position);
+	}
+
+	if (last_position <= state->blockstart_max) {
 
 #ifdef BDL_DBG_WRITE
-			printf ("Hint block has free room\n");
+		printf ("Hint block has free room\n");
 #endif
 
-			location->block_location = state->hintblock.previous_block_pos + master_header->block_size;
+		location->block_location = first_position;
 
-			if (location->block_location == state->backup_location) {
-				location->block_location += master_header->block_size;
-			}
-
-			*result = 0;
-		}
-		else {
+		*result = 0;
+	}
+	else {
 
 #ifdef BDL_DBG_WRITE
-			printf ("Hint block is full\n");
+		printf ("Hint block is full\n");
 #endif
 
-			location->block_location = state->blockstart_min;
+		location->block_location = state->blockstart_min;
 
-			*result = 1;
-		}
+		*result = 1;
 	}
 
 	return 0;
 }
 
-struct hintblock_timestamp {
-	struct bdl_hintblock_state state;
-	int initialized;
-	uint64_t min_timestamp;
-};
+/*
+ * The head region is kept in the file after each write so that the next write does
+ * not need to search all hint blocks. Before it is used, the cached head and the
+ * region following it are read again. If the head is no longer valid, for instance
+ * after a clear, or if the following region has newer blocks because somebody else
+ * wrote to the device, all hint blocks are searched like before.
+ */
+void write_head_cache_reset (struct bdl_io_file *file) {
+	file->head_cache.valid = 0;
+	file->head_cache.prepared_position = 0;
+}
 
-int write_hintblock_check_timestamps (struct bdl_hintblock_loop_callback_data *data, int *result) {
-	struct hintblock_timestamp *timestamp = (struct hintblock_timestamp *) data->argument_ptr;
-	const struct bdl_hintblock_state *state = &data->location->hintblock_state;
+void write_head_cache_set (struct bdl_io_file *file, unsigned long int hintblock_position) {
+	file->head_cache.valid = 1;
+	file->head_cache.hintblock_position = hintblock_position;
+}
 
-	if (state->highest_timestamp < timestamp->min_timestamp) {
-		timestamp->min_timestamp = state->highest_timestamp;
-		timestamp->state = *state;
-		timestamp->initialized = 1;
+/*
+ * Read the hint blocks and the start of the region following the head in the background
+ * while the head still has room. The region is not invalidated before we actually write
+ * to it, as that would make its records unreadable while there is still room elsewhere.
+ */
+void write_prepare_next_region (struct bdl_io_file *file, const struct bdl_header *header) {
+	struct bdl_head_cache *cache = &file->head_cache;
+
+	if (cache->valid != 1 || cache->prepared_position == cache->hintblock_position) {
+		return;
 	}
 
-	*result = BDL_BLOCK_LOOP_OK;
+	unsigned long int next_position = block_next_hintblock_position (file, header, cache->hintblock_position);
 
-	return 0;
+#ifdef BDL_DBG_WRITE
+	printf ("Preparing region at %lu following head at %lu\n", next_position, cache->hintblock_position);
+#endif
+
+	io_advise_willneed (file, next_position - BDL_DEFAULT_HINTBLOCK_SPACING + header->block_size, BDL_WRITE_PREPARE_SIZE);
+	io_advise_willneed (file, next_position + BDL_HINTBLOCK_BACKUP_POSITION, header->block_size);
+	io_advise_willneed (file, next_position, header->block_size);
+
+	cache->prepared_position = cache->hintblock_position;
 }
 
-int write_hintblock_check_free_callback (struct bdl_hintblock_loop_callback_data *data, int *result) {
-	*result = BDL_BLOCK_LOOP_ERR;
+/* Sets *result to 1 if the cached head could not be used */
+int write_find_location_cached (
+		struct bdl_io_file *file,
+		const struct bdl_header *header,
+		unsigned long int blocks_needed,
+		struct bdl_block_location *location,
+		uint64_t *highest_timestamp,
+		int *result
+) {
+	*result = 1;
+
+	unsigned long int head_position = file->head_cache.hintblock_position;
+	unsigned long int next_position = block_next_hintblock_position (file, header, head_position);
 
-	if (write_check_free_hintblock (
-			data->master_header,
-			data->location,
-			result
-			) != 0
+	struct bdl_hintblock_state head_state;
+	struct bdl_hintblock_state next_state;
+
+	if (	block_get_region_state (file, head_position, header, &head_state) != 0 ||
+			block_get_region_state (file, next_position, header, &next_state) != 0
 	) {
+		fprintf (stderr, "Error while reading cached head region at %lu\n", head_position);
+		return 1;
+	}
+
+	if (head_state.valid != 1 || (
+			next_state.valid == 1 &&
+			next_state.highest_timestamp > head_state.highest_timestamp
+	)) {
+#ifdef BDL_DBG_WRITE
+		printf ("Cached head region at %lu was outdated\n", head_position);
+#endif
+		write_head_cache_reset (file);
+		return 0;
+	}
+
+	*highest_timestamp = head_state.highest_timestamp;
+	location->hintblock_state = head_state;
+
+	int full;
+	if (write_check_free_hintblock (header, blocks_needed, location, &full) != 0) {
 		fprintf (stderr, "Error while checking for free hintblock\n");
 		return 1;
 	}
 
-	if (*result == 0) {
-		// Hint block has free room
-		*result = BDL_BLOCK_LOOP_BREAK;
-		data->argument_int = 0;
+	if (full == 0) {
+		if (head_state.blockstart_max - location->block_location < BDL_WRITE_PREPARE_REMAINING) {
+			write_prepare_next_region (file, header);
+		}
 	}
-	else if (*result == 1) {
-		// Hint block is full
-		*result = BDL_BLOCK_LOOP_OK;
-		data->argument_int = 1;
+	else {
+		location->hintblock_state = next_state;
+		location->block_location = next_state.blockstart_min;
 	}
 
+	*result = 0;
+
 	return 0;
 }
 
-int write_find_location(struct bdl_io_file *file, const struct bdl_header *header, struct bdl_block_location *location) {
+/*
+ * The head is the region with the newest block. We write to the head if it has
+ * room, or else to the region following it. Regions with invalid hint blocks are
+ * skipped, as a damaged hint block in the middle must not make the newer regions
+ * after it look unused.
+ */
+struct write_find_head_loop_data {
+	int head_found;
+	struct bdl_hintblock_state head_state;
+
+	int first_found;
+	struct bdl_hintblock_state first_state;
+
+	int next_pending;
+	int next_found;
+	struct bdl_hintblock_state next_state;
+};
+
+int write_find_head_callback (struct bdl_hintblock_loop_callback_data *data, int *result) {
+	struct write_find_head_loop_data *loop_data = (struct write_find_head_loop_data *) data->argument_ptr;
+	const struct bdl_hintblock_state *state = &data->location->hintblock_state;
+
+	*result = BDL_BLOCK_LOOP_OK;
+
+	if (loop_data->first_found == 0) {
+		loop_data->first_state = *state;
+		loop_data->first_found = 1;
+	}
+
+	if (loop_data->next_pending == 1) {
+		loop_data->next_state = *state;
+		loop_data->next_found = 1;
+		loop_data->next_pending = 0;
+	}
+
+	if (state->valid != 1) {
+		return 0;
+	}
+
+	if (loop_data->head_found == 0 || state->highest_timestamp > loop_data->head_state.highest_timestamp) {
+		loop_data->head_state = *state;
+		loop_data->head_found = 1;
+		loop_data->next_pending = 1;
+		loop_data->next_found = 0;
+	}
+
+	return 0;
+}
+
+int write_find_location (
+		struct bdl_io_file *file,
+		const struct bdl_header *header,
+		unsigned long int blocks_needed,
+		struct bdl_block_location *location,
+		uint64_t *highest_timestamp
+) {
 	if (file->size < BDL_SMALL_SIZE_THRESHOLD) {
 #ifdef BDL_DBG_WRITE
 		printf ("Finding new write location for small device\n");
@@ -151,16 +267,28 @@ int write_find_location(struct bdl_io_file *file, const struct bdl_header *heade
 		return write_find_location_small(file, header, location);
 	}
 
-	// Search for hint blocks
+	int result;
+
+	if (file->head_cache.valid == 1) {
+		if (write_find_location_cached (file, header, blocks_needed, location, highest_timestamp, &result) != 0) {
+			return 1;
+		}
+		if (result == 0) {
+			return 0;
+		}
+	}
+
+	struct write_find_head_loop_data loop_data;
+	memset (&loop_data, '\0', sizeof(loop_data));
+
 	struct bdl_hintblock_loop_callback_data callback_data;
 	memset (&callback_data, '\0', sizeof(callback_data));
+	callback_data.argument_ptr = &loop_data;
 
-	// Attempt to find a hint block with free room
-	int result;
 	if (block_loop_hintblocks_large_device (
 			file, header,
 			NULL,
-			write_hintblock_check_free_callback, &callback_data,
+			write_find_head_callback, &callback_data,
 			location,
 			&result
 	) != 0) {
@@ -168,52 +296,76 @@ int write_find_location(struct bdl_io_file *file, const struct bdl_header *heade
 		return 1;
 	}
 
-	if (callback_data.argument_int == 0) {
-		// Hint block with free room found
+	if (loop_data.first_found == 0) {
+		fprintf (stderr, "Bug: No hint blocks found in write_find_location()\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Empty device, start at the beginning
+	if (loop_data.head_found == 0) {
+		*highest_timestamp = 0;
+		location->hintblock_state = loop_data.first_state;
+		location->block_location = loop_data.first_state.blockstart_min;
 		return 0;
 	}
 
-	// Find hint block with lowest time stamp and invalidate
-	struct hintblock_timestamp timestamp;
-	timestamp.initialized = 0;
-	timestamp.min_timestamp = 0xffffffffffffffff;
+	*highest_timestamp = loop_data.head_state.highest_timestamp;
+	location->hintblock_state = loop_data.head_state;
 
-	memset (&callback_data, '\0', sizeof(callback_data));
-	callback_data.argument_ptr = &timestamp;
+	write_head_cache_set (file, loop_data.head_state.location);
 
-	if (block_loop_hintblocks_large_device (
-			file, header,
-			NULL,
-			write_hintblock_check_timestamps, &callback_data,
-			location,
-			&result
-	) != 0) {
-		fprintf (stderr, "Error while looping hint blocks in write operation to find timestamps\n");
+	if (write_check_free_hintblock (header, blocks_needed, location, &result) != 0) {
+		fprintf (stderr, "Error while checking for free hintblock\n");
 		return 1;
 	}
 
-	if (timestamp.initialized == 1) {
-		location->block_location = timestamp.state.blockstart_min;
-		location->hintblock_state = timestamp.state;
+	if (result == 0) {
+		// Head has free room
 		return 0;
 	}
 
-	fprintf (stderr, "Bug: Reached end of write_find_location()\n");
-	exit(EXIT_FAILURE);
+	// Continue in the next region, overwriting it if it's used. Wrap to the beginning if
+	// the head was the last region.
+	location->hintblock_state = (loop_data.next_found == 1 ? loop_data.next_state : loop_data.first_state);
+	location->block_location = location->hintblock_state.blockstart_min;
+
+#ifdef BDL_DBG_WRITE
+	printf ("Head region at %lu is full, continuing in region at %lu\n",
+			loop_data.head_state.location, location->hintblock_state.location
+	);
+#endif
+
+	return 0;
 }
 
-int write_put_and_pad_block (struct bdl_io_file *file, int pos, const char *data, int data_length, char pad, int total_size) {
-	int padding_length = total_size - data_length;
+int write_put_and_pad_block (
+		struct bdl_io_file *file,
+		unsigned long int pos,
+		const char *data, unsigned long int data_length,
+		char pad, unsigned long int total_size
+) {
+	unsigned long int padding_length = total_size - data_length;
+	int ret = 0;
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&file->arena, &mark);
+
+	char *padding = arena_alloc (&file->arena, padding_length);
+	if (padding == NULL) {
+		fprintf (stderr, "Could not allocate padding while writing to location %lu\n", pos);
+		return 1;
+	}
 
-	char padding[padding_length];
 	memset (padding, pad, padding_length);
 
 	if (io_write_block(file, pos, data, data_length, padding, padding_length, 1) != 0) {
-		fprintf (stderr, "Error while writing data and padding to location %i\n", pos);
-		return 1;
+		fprintf (stderr, "Error while writing data and padding to location %lu\n", pos);
+		ret = 1;
 	}
 
-	return 0;
+	arena_release (&file->arena, &mark);
+
+	return ret;
 }
 
 int write_update_hintblock (
@@ -287,35 +439,40 @@ int write_checksum_and_put_block(
 	const struct bdl_block_header* block_header,
 	unsigned long int data_length, const char* data,
 	const struct bdl_header* header,
-	unsigned int block_position,
+	unsigned long int block_position,
 	struct bdl_io_file* session_file
 ) {
-	// Checksum and write the block
-	unsigned long int block_total_size = sizeof(*block_header) + data_length;
-	char hash_data[block_total_size];
-	memcpy(hash_data, block_header, sizeof(*block_header));
-	memcpy(hash_data + sizeof(*block_header), data, data_length);
-
-	struct bdl_block_header *new_header = (struct bdl_block_header *) hash_data;
-	new_header->hash = 0;
+	// Hash header and data in place, the hash field is zeroed by block_hash
+	struct bdl_block_header new_header = *block_header;
 
-	if (crypt_hash_data(
-			hash_data,
-			block_total_size,
+	if (block_hash (
+			&new_header,
+			data, data_length,
 			header->default_hash_algorithm,
-			&new_header->hash
+			&new_header.hash
 	) != 0) {
 		fprintf(stderr, "Error while hashing block\n");
 		return 1;
 	}
 
-	if (write_put_and_pad_block(
+	if (io_write_block (
 			session_file,
 			block_position,
-			hash_data,
-			block_total_size,
+			(const char *) &new_header, sizeof(new_header),
+			NULL, 0,
+			1
+	) != 0) {
+		fprintf(stderr, "Error while putting block header\n");
+		return 1;
+	}
+
+	if (write_put_and_pad_block(
+			session_file,
+			block_position + sizeof(new_header),
+			data,
+			data_length,
 			header->pad_character,
-			header->block_size
+			header->block_size - sizeof(new_header)
 	) != 0) {
 		fprintf(stderr, "Error while putting block\n");
 		return 1;
@@ -324,110 +481,706 @@ int write_checksum_and_put_block(
 	return 0;
 }
 
-int write_put_block (
-		struct bdl_io_file *session_file,
-		const char *data, unsigned long int data_length,
-		uint64_t appdata,
-		uint64_t timestamp,
-		unsigned long int faketimestamp
+/*
+ * Overwrite length bytes at offset inside a block which is already written, offset counts
+ * from the start of the block header. The caller must make sure the hash stays correct.
+ */
+int write_patch_block (
+	struct bdl_io_file *session_file,
+	unsigned long int block_position,
+	unsigned long int offset,
+	const char *data, unsigned long int length
 ) {
-	struct bdl_header header;
-	int result;
-
-	// Read master header
-	if (block_get_validate_master_header(session_file, &header, &result) != 0) {
-		fprintf (stderr, "Could not get header from device while writing new data block\n");
-		return BDL_WRITE_ERR_IO;
+	if (io_write_block (session_file, block_position + offset, data, length, NULL, 0, 1) != 0) {
+		fprintf(stderr, "Error while patching block at %lu\n", block_position);
+		return 1;
 	}
 
-	if (result != 0) {
-		fprintf (stderr, "Invalid header of device while writing new data block\n");
-		return BDL_WRITE_ERR_CORRUPT;
+	return 0;
+}
+
+int write_check_timestamp (
+		uint64_t highest_timestamp,
+		uint64_t *timestamp,
+		unsigned long int faketimestamp
+) {
+	if (highest_timestamp < *timestamp) {
+		return 0;
 	}
 
-	// Find write location
-	struct bdl_block_location location;
-	if (write_find_location (session_file, &header, &location) != 0) {
-		fprintf (stderr, "Error while finding write location for device\n");
+	if (faketimestamp == 0) {
+		fprintf (stderr, "Cannot insert element with earlier or equal timestamp than the latest block already in place. Check your clock or consider using faketimestamp.\n");
 		return 1;
 	}
+	else if (highest_timestamp - *timestamp > faketimestamp) {
+		fprintf (stderr, "Faketimestamp limit exceeded, check your clock or consider increasing it.\n");
+		return BDL_WRITE_ERR_TIMESTAMP;
+	}
 
-	// Work on data block
-	struct bdl_block_header block_header;
-	memset (&block_header, '\0', sizeof(block_header));
-	block_header.data_length = data_length;
-	block_header.timestamp = (timestamp == 0 ? time_get_64() : timestamp);
-	block_header.application_data = appdata;
+	*timestamp = highest_timestamp + 1;
 
 #ifdef BDL_DBG_WRITE
-	printf ("Writing new block at location %lu with hintblock at %lu timestamp %" PRIu64 "\n",
-			location.block_location, location.hintblock_state.location, block_header.timestamp
-	);
+	printf ("Timestamp corrected to %" PRIu64 "\n", *timestamp);
 #endif
 
-	// Check timestamp
-	if (location.hintblock_state.highest_timestamp >= block_header.timestamp) {
-		if (faketimestamp == 0) {
-			fprintf (stderr, "Cannot insert element with earlier or equal timestamp than the latest block already in place. Check your clock or consider using faketimestamp.\n");
-			return 1;
-		}
-		else if (location.hintblock_state.highest_timestamp - block_header.timestamp > faketimestamp) {
-			fprintf (stderr, "Faketimestamp limit exceeded, check your clock or consider increasing it.\n");
-			return BDL_WRITE_ERR_TIMESTAMP;
-		}
-		block_header.timestamp = location.hintblock_state.highest_timestamp + 1;
-#ifdef BDL_DBG_WRITE
-		printf ("Timestamp corrected to %" PRIu64 "\n",
-				block_header.timestamp
-		);
-#endif
-	}
+	return 0;
+}
 
-	// Check data length
-	if (data_length > header.block_size - sizeof(block_header)) {
-		fprintf(stderr, "Length of data was to large to fit inside a block, length was %lu while maximum size is %" PRIu64 "\n",
-			data_length, (header.block_size - sizeof(block_header))
-		);
-		return BDL_WRITE_ERR_SIZE;
+/* Number of blocks needed to store data, more than one means that the record is chained */
+unsigned long int write_count_blocks_needed (const struct bdl_header *header, unsigned long int data_length) {
+	unsigned long int max_length = header->block_size - sizeof(struct bdl_block_header);
+
+	if (data_length <= max_length) {
+		return 1;
 	}
 
+	return (data_length + max_length - 1) / max_length;
+}
+
+/* Write the blocks of a record without updating the hint block, *last_position is set to the last block written */
+int write_put_record_blocks (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_block_location *location,
+		const struct bdl_block_header *record_header,
+		const char *data,
+		unsigned long int *last_position
+) {
+#ifdef BDL_DBG_WRITE
+	printf ("Writing new record at location %lu with hintblock at %lu timestamp %" PRIu64 "\n",
+			location->block_location, location->hintblock_state.location, record_header->timestamp
+	);
+#endif
+
 	// Check for funny write locations
-	if (location.block_location < header.header_size) {
+	if (location->block_location < header->header_size) {
 		fprintf (stderr, "Bug: Block location was inside header on write\n");
 		exit (EXIT_FAILURE);
 	}
 
-	if (location.hintblock_state.location < header.header_size + header.block_size) {
+	if (location->hintblock_state.location < header->header_size + header->block_size) {
 		fprintf (stderr, "Bug: Hint block location was too early on write\n");
 		exit (EXIT_FAILURE);
 	}
 
-	if (location.block_location == location.hintblock_state.backup_location) {
+	if (location->block_location == location->hintblock_state.backup_location) {
 		fprintf (stderr, "Bug: Attempted to place block on hintblock backup location\n");
 		exit (EXIT_FAILURE);
 	}
 
-	// Checksum and write the block
-	if (write_checksum_and_put_block(
-			&block_header,
-			data_length, data,
-			&header, location.block_location,
-			session_file
-	) != 0) {
+	unsigned long int max_length = header->block_size - sizeof(struct bdl_block_header);
+	unsigned long int block_count = write_count_blocks_needed(header, record_header->data_length);
+	unsigned long int remaining = record_header->data_length;
+	unsigned long int position = location->block_location;
+
+	// Checksum and write the blocks, only one unless the record is chained
+	for (unsigned long int i = 0; i < block_count; i++) {
+		struct bdl_block_header block_header = *record_header;
+
+		if (block_count > 1) {
+			block_header.data_length = (remaining > max_length ? max_length : remaining);
+			block_header.flags |= (
+					i == 0 ? BDL_BLOCK_FLAG_CHAIN_FIRST :
+					i == block_count - 1 ? BDL_BLOCK_FLAG_CHAIN_LAST :
+					BDL_BLOCK_FLAG_CHAIN_CONTINUE
+			);
+		}
+
+		if (position > location->hintblock_state.blockstart_max) {
+			fprintf (stderr, "Bug: Chained record exceeded region on write\n");
+			exit (EXIT_FAILURE);
+		}
+
+		if (write_checksum_and_put_block(
+				&block_header,
+				block_header.data_length, data,
+				header, position,
+				session_file
+		) != 0) {
+			return 1;
+		}
+
+		data += block_header.data_length;
+		remaining -= block_header.data_length;
+		*last_position = position;
+		position = block_next_position(&location->hintblock_state, header, position);
+	}
+
+	return 0;
+}
+
+/*
+ * Discard the blocks of a region following last_position once the hint block points
+ * to last_position, as they are unreachable then. The backup hint block is kept. The
+ * hint block must be on the device before the blocks it used to point to are gone, or
+ * else a crash could leave an old hint block pointing into discarded space.
+ */
+void write_discard_region (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_hintblock_state *state,
+		unsigned long int last_position
+) {
+	if (session_file->discard == 0) {
+		return;
+	}
+
+	if (io_sync_durable (session_file) != 0) {
+		fprintf (stderr, "Warning: Could not sync device, region at %lu was not discarded\n", state->location);
+		return;
+	}
+
+	write_discard_region_synced (session_file, header, state->location, last_position);
+}
+
+/* Like write_discard_region, for callers which synced the hint block themselves */
+void write_discard_region_synced (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		unsigned long int hintblock_position,
+		unsigned long int last_position
+) {
+	if (session_file->discard == 0) {
+		return;
+	}
+
+	unsigned long int backup_location = hintblock_position + BDL_HINTBLOCK_BACKUP_POSITION;
+	unsigned long int begin = last_position + header->block_size;
+	int ret = 0;
+
+	if (begin < backup_location) {
+		ret |= io_discard (session_file, begin, backup_location - begin);
+	}
+	if (begin <= backup_location) {
+		begin = backup_location + header->block_size;
+	}
+	if (begin < hintblock_position) {
+		ret |= io_discard (session_file, begin, hintblock_position - begin);
+	}
+
+	if (ret != 0) {
+		fprintf (stderr, "Warning: Discard failed, not discarding anymore in this session\n");
+		session_file->discard = 0;
+	}
+}
+
+int write_put_record_at_location (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_block_location *location,
+		const struct bdl_block_header *record_header,
+		const char *data
+) {
+	unsigned long int last_position;
+
+	if (write_put_record_blocks (session_file, header, location, record_header, data, &last_position) != 0) {
 		return 1;
 	}
 
 	// Update hintblock
 	if (write_update_hintblock(
 			session_file,
-			location.block_location, 0,
-			location.hintblock_state.location, location.hintblock_state.backup_location,
-			&header
+			last_position, 0,
+			location->hintblock_state.location, location->hintblock_state.backup_location,
+			header
 	) != 0) {
 		fprintf (stderr, "Error while updating hintblock while writing new block\n");
 		return 1;
 	}
 
+	write_head_cache_set (session_file, location->hintblock_state.location);
+
+	if (shared_publish_head (
+			session_file,
+			location->hintblock_state.location, last_position,
+			record_header->timestamp
+	) != 0) {
+		return 1;
+	}
+
+	// The region was taken over by this record
+	if (location->block_location == location->hintblock_state.blockstart_min) {
+		write_discard_region (session_file, header, &location->hintblock_state, last_position);
+	}
+
 	return 0;
 }
 
+/*
+ * Move location past a block written without updating the hint block. Sets *result to
+ * 1 if the region is full, in which case the hint block must be updated before a new
+ * location is searched for.
+ */
+int write_advance_location (
+		const struct bdl_header *header,
+		struct bdl_block_location *location,
+		unsigned long int last_position,
+		uint64_t timestamp,
+		int *result
+) {
+	struct bdl_hintblock_state *state = &location->hintblock_state;
+
+	state->valid = 1;
+	state->hintblock.previous_block_pos = last_position;
+	state->highest_timestamp = timestamp;
+
+	return write_check_free_hintblock (header, 1, location, result);
+}
+
+/*
+ * Compress data of a record into a buffer from the arena. Data and length are
+ * left untouched if compression is off or the data does not get smaller, or else
+ * the compressed flag is set. The arena must be released after writing.
+ */
+int write_compress_record (
+		struct bdl_io_file *file,
+		int compression,
+		const char **data, unsigned long int *data_length,
+		uint32_t *flags
+) {
+	if (	compression == BDL_COMPRESSION_NONE ||
+			*data_length < BDL_COMPRESS_MINIMUM_LENGTH ||
+			*data_length > UINT32_MAX
+	) {
+		return 0;
+	}
+
+	char *buf = arena_alloc (&file->arena, *data_length);
+	if (buf == NULL) {
+		fprintf (stderr, "Could not allocate buffer while compressing record\n");
+		return 1;
+	}
+
+	struct bdl_compressed_header *compressed_header = (struct bdl_compressed_header *) buf;
+	compressed_header->data_length = *data_length;
+	compressed_header->pad = 0;
+
+	unsigned long int compressed_length;
+	if (compress_lz (
+			*data, *data_length,
+			buf + sizeof(*compressed_header), *data_length - sizeof(*compressed_header) - 1,
+			&compressed_length
+	) != 0) {
+#ifdef BDL_DBG_WRITE
+		printf ("Record of %lu bytes did not compress\n", *data_length);
+#endif
+		return 0;
+	}
+
+	*data = buf;
+	*data_length = sizeof(*compressed_header) + compressed_length;
+	*flags |= BDL_BLOCK_FLAG_COMPRESSED_LZ;
+
+	return 0;
+}
+
+int write_put_block (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const char *data, unsigned long int data_length,
+		uint64_t appdata,
+		uint64_t timestamp,
+		unsigned long int faketimestamp,
+		int compression,
+		struct bdl_time_source *time_source
+) {
+	// Work on data block
+	struct bdl_block_header block_header;
+	memset (&block_header, '\0', sizeof(block_header));
+
+	int ret = 0;
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&session_file->arena, &mark);
+
+	if (write_compress_record (session_file, compression, &data, &data_length, &block_header.flags) != 0) {
+		ret = 1;
+		goto out;
+	}
+
+	// Check data length, large records are chained but must fit inside one region
+	unsigned long int blocks_needed = write_count_blocks_needed(header, data_length);
+	if (blocks_needed > block_region_capacity(header)) {
+		fprintf(stderr, "Length of data was to large to fit inside a region, length was %lu while maximum size is %" PRIu64 "\n",
+			data_length, (header->block_size - sizeof(struct bdl_block_header)) * block_region_capacity(header)
+		);
+		ret = BDL_WRITE_ERR_SIZE;
+		goto out;
+	}
+
+	// Find write location
+	struct bdl_block_location location;
+	uint64_t highest_timestamp;
+	if (write_find_location (session_file, header, blocks_needed, &location, &highest_timestamp) != 0) {
+		fprintf (stderr, "Error while finding write location for device\n");
+		ret = 1;
+		goto out;
+	}
+
+	block_header.data_length = data_length;
+	block_header.timestamp = (timestamp == 0 ? time_source_get(time_source, 1, highest_timestamp) : timestamp);
+	block_header.application_data = appdata;
+
+	// Check timestamp
+	if ((ret = write_check_timestamp (
+			highest_timestamp,
+			&block_header.timestamp,
+			faketimestamp
+	)) != 0) {
+		goto out;
+	}
+
+	ret = write_put_record_at_location (session_file, header, &location, &block_header, data);
+
+	if (ret == 0) {
+		time_source_update (time_source, block_header.timestamp);
+	}
+
+	out:
+	arena_release (&session_file->arena, &mark);
+	return ret;
+}
+
+/* Update the hint block of location if blocks were written since the last update */
+int write_flush_hintblock (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_block_location *location,
+		unsigned long int *pending_position
+) {
+	if (*pending_position == 0) {
+		return 0;
+	}
+
+	if (write_update_hintblock(
+			session_file,
+			*pending_position, 0,
+			location->hintblock_state.location, location->hintblock_state.backup_location,
+			header
+	) != 0) {
+		fprintf (stderr, "Error while updating hintblock while writing packed blocks\n");
+		return 1;
+	}
+
+	write_head_cache_set (session_file, location->hintblock_state.location);
+
+	if (session_file->shared_page != NULL) {
+		// Packed blocks have the timestamp of their newest record
+		uint64_t timestamp;
+		if (io_read_block (
+				session_file,
+				*pending_position + offsetof(struct bdl_block_header, timestamp),
+				(char *) &timestamp, sizeof(timestamp)
+		) != 0) {
+			fprintf (stderr, "Error while reading timestamp of block before publishing head\n");
+			return 1;
+		}
+
+		if (shared_publish_head (
+				session_file,
+				location->hintblock_state.location, *pending_position,
+				timestamp
+		) != 0) {
+			return 1;
+		}
+	}
+
+	*pending_position = 0;
+
+	return 0;
+}
+
+int write_put_packed_blocks (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_write_entry *entries, unsigned long int entry_count,
+		unsigned long int faketimestamp,
+		int compression,
+		struct bdl_time_source *time_source
+) {
+	int result;
+	int ret = 0;
+
+	unsigned long int max_length = header->block_size - sizeof(struct bdl_block_header);
+
+	// Compressed blocks may hold more record data than what fits uncompressed
+	unsigned long int records_size = (compression != BDL_COMPRESSION_NONE ? max_length * BDL_COMPRESS_PACK_FACTOR : max_length);
+
+	// The hint block is only updated when a region is full and after the last block
+	struct bdl_block_location location;
+	uint64_t location_timestamp = 0;
+	int location_found = 0;
+	unsigned long int hintblock_pending_position = 0;
+
+	// Records without timestamp are stamped from one read of the clock
+	uint64_t now = 0;
+	unsigned long int unstamped_count = 0;
+	for (unsigned long int j = 0; j < entry_count; j++) {
+		if (entries[j].timestamp == 0) {
+			unstamped_count++;
+		}
+	}
+
+	struct bdl_arena_mark mark;
+	arena_get_mark (&session_file->arena, &mark);
+
+	char *block_data = arena_alloc (&session_file->arena, max_length);
+	char *records = (compression != BDL_COMPRESSION_NONE ? arena_alloc (&session_file->arena, records_size) : block_data);
+	if (block_data == NULL || records == NULL) {
+		fprintf (stderr, "Could not allocate block buffer while writing packed blocks\n");
+		ret = 1;
+		goto out;
+	}
+
+	struct bdl_packed_header *packed_header = (struct bdl_packed_header *) block_data;
+	struct bdl_packed_record *directory = (struct bdl_packed_record *) (block_data + sizeof(*packed_header));
+
+	unsigned long int i = 0;
+	while (i < entry_count) {
+		if (location_found == 0) {
+			if (write_find_location (session_file, header, 1, &location, &location_timestamp) != 0) {
+				fprintf (stderr, "Error while finding write location for device\n");
+				ret = 1;
+				goto out;
+			}
+			location_found = 1;
+		}
+
+		if (now == 0 && unstamped_count > 0) {
+			now = time_source_get (time_source, unstamped_count, location_timestamp);
+		}
+
+		int region_taken_over = (location.block_location == location.hintblock_state.blockstart_min);
+
+		uint64_t previous_timestamp = 0;
+		uint64_t first_timestamp = 0;
+		uint64_t entry_timestamp = 0;
+
+		unsigned long int count = 0;
+		unsigned long int records_length = 0;
+		unsigned long int records_limit = records_size;
+		unsigned long int directory_length = 0;
+		unsigned long int compressed_length = 0;
+
+		// Find out how many records fit inside this block. When compressing, retry with
+		// less data until the compressed records fit.
+		for (;;) {
+			previous_timestamp = location_timestamp;
+			first_timestamp = 0;
+			entry_timestamp = 0;
+			count = 0;
+			records_length = 0;
+			compressed_length = 0;
+
+			for (; i + count < entry_count; count++) {
+				const struct bdl_write_entry *entry = &entries[i + count];
+
+				entry_timestamp = entry->timestamp;
+				if (entry_timestamp == 0) {
+					entry_timestamp = (now > previous_timestamp ? now : previous_timestamp + 1);
+				}
+				else if ((ret = write_check_timestamp(previous_timestamp, &entry_timestamp, faketimestamp)) != 0) {
+					goto out;
+				}
+
+				if (count == 0) {
+					first_timestamp = entry_timestamp;
+				}
+				else if (entry_timestamp - first_timestamp > UINT32_MAX) {
+					break;
+				}
+
+				directory_length = sizeof(*packed_header) + (count + 1) * sizeof(struct bdl_packed_record);
+
+				if (	directory_length + sizeof(struct bdl_compressed_header) > max_length ||
+						directory_length + records_length + entry->data_length > records_limit
+				) {
+					break;
+				}
+
+				directory[count].timestamp_delta = entry_timestamp - first_timestamp;
+				directory[count].data_length = entry->data_length;
+				directory[count].application_data = entry->appdata;
+
+				records_length += entry->data_length;
+				previous_timestamp = entry_timestamp;
+			}
+
+			directory_length = sizeof(*packed_header) + count * sizeof(struct bdl_packed_record);
+
+			if (compression == BDL_COMPRESSION_NONE || count <= 1) {
+				break;
+			}
+
+			char *record_data = records;
+			for (unsigned long int j = 0; j < count; j++) {
+				memcpy (record_data, entries[i + j].data, entries[i + j].data_length);
+				record_data += entries[i + j].data_length;
+			}
+
+			// Compressed data must fit in the block and be smaller than the records
+			unsigned long int room = max_length - directory_length - sizeof(struct bdl_compressed_header);
+			if (room >= records_length) {
+				room = records_length - 1;
+			}
+
+			if (compress_lz (
+					records, records_length,
+					block_data + directory_length + sizeof(struct bdl_compressed_header), room,
+					&compressed_length
+			) == 0) {
+				break;
+			}
+
+			compressed_length = 0;
+
+			// Store the records uncompressed if they fit anyway
+			if (directory_length + records_length <= max_length) {
+				break;
+			}
+
+			records_limit = (records_limit / 2 > max_length ? records_limit / 2 : max_length);
+
+#ifdef BDL_DBG_WRITE
+			printf ("%lu records did not compress enough, retrying with %lu bytes\n", count, records_limit);
+#endif
+		}
+
+		struct bdl_block_header block_header;
+		memset (&block_header, '\0', sizeof(block_header));
+
+		// Single records are written as normal blocks
+		if (count <= 1) {
+			const struct bdl_write_entry *entry = &entries[i];
+
+			block_header.timestamp = (count == 1 ? first_timestamp : entry_timestamp);
+
+			// Large records need a location with room for a chain
+			if (entry->data_length > max_length) {
+				if (write_flush_hintblock (session_file, header, &location, &hintblock_pending_position) != 0) {
+					ret = 1;
+					goto out;
+				}
+				location_found = 0;
+
+				if ((ret = write_put_block (
+						session_file,
+						header,
+						entry->data, entry->data_length,
+						entry->appdata,
+						block_header.timestamp,
+						faketimestamp,
+						compression,
+						time_source
+				)) != 0) {
+					goto out;
+				}
+
+				i++;
+				continue;
+			}
+
+			const char *data = entry->data;
+			unsigned long int data_length = entry->data_length;
+
+			struct bdl_arena_mark record_mark;
+			arena_get_mark (&session_file->arena, &record_mark);
+
+			if (write_compress_record (session_file, compression, &data, &data_length, &block_header.flags) != 0) {
+				ret = 1;
+				goto out;
+			}
+
+			block_header.application_data = entry->appdata;
+			block_header.data_length = data_length;
+
+			ret = write_put_record_blocks (session_file, header, &location, &block_header, data, &hintblock_pending_position);
+
+			arena_release (&session_file->arena, &record_mark);
+
+			if (ret != 0) {
+				goto out;
+			}
+
+			i++;
+		}
+		else {
+			uint64_t last_timestamp = previous_timestamp;
+
+			packed_header->record_count = count;
+			packed_header->pad = 0;
+
+			char *record_data = block_data + directory_length;
+			for (unsigned long int j = 0; j < count; j++) {
+				const struct bdl_write_entry *entry = &entries[i + j];
+
+				directory[j].timestamp_delta = (last_timestamp - first_timestamp) - directory[j].timestamp_delta;
+				block_header.application_data |= entry->appdata;
+
+				if (compressed_length == 0) {
+					memcpy (record_data, entry->data, entry->data_length);
+					record_data += entry->data_length;
+				}
+			}
+
+			block_header.flags = BDL_BLOCK_FLAG_PACKED;
+
+			if (compressed_length > 0) {
+				struct bdl_compressed_header *compressed_header = (struct bdl_compressed_header *) record_data;
+				compressed_header->data_length = records_length;
+				compressed_header->pad = 0;
+
+				record_data += sizeof(*compressed_header) + compressed_length;
+				block_header.flags |= BDL_BLOCK_FLAG_COMPRESSED_LZ;
+			}
+
+			block_header.timestamp = last_timestamp;
+			block_header.data_length = record_data - block_data;
+
+#ifdef BDL_DBG_WRITE
+			printf ("Packed %lu records of %lu bytes into block of %" PRIu64 " bytes\n", count, records_length, block_header.data_length);
+#endif
+
+			if (write_put_record_blocks (session_file, header, &location, &block_header, block_data, &hintblock_pending_position) != 0) {
+				ret = 1;
+				goto out;
+			}
+
+			i += count;
+		}
+
+		location_timestamp = block_header.timestamp;
+		time_source_update (time_source, location_timestamp);
+		if (write_advance_location (header, &location, hintblock_pending_position, location_timestamp, &result) != 0) {
+			ret = 1;
+			goto out;
+		}
+
+		// The hint block must point to the new block before the rest of the region is discarded
+		if (region_taken_over == 1 && session_file->discard == 1 && hintblock_pending_position != 0) {
+			unsigned long int last_position = hintblock_pending_position;
+
+			if (write_flush_hintblock (session_file, header, &location, &hintblock_pending_position) != 0) {
+				ret = 1;
+				goto out;
+			}
+
+			write_discard_region (session_file, header, &location.hintblock_state, last_position);
+		}
+
+		if (result != 0) {
+			if (write_flush_hintblock (session_file, header, &location, &hintblock_pending_position) != 0) {
+				ret = 1;
+				goto out;
+			}
+			location_found = 0;
+		}
+	}
+
+	out:
+	if (write_flush_hintblock (session_file, header, &location, &hintblock_pending_position) != 0) {
+		ret = 1;
+	}
+	arena_release (&session_file->arena, &mark);
+	return ret;
+}
@@ -28,12 +28,46 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "blocks.h"
 #include "../include/bdl.h"
 
+void write_head_cache_reset (struct bdl_io_file *file);
+void write_prepare_next_region (struct bdl_io_file *file, const struct bdl_header *header);
+int write_find_location (
+		struct bdl_io_file *file,
+		const struct bdl_header *header,
+		unsigned long int blocks_needed,
+		struct bdl_block_location *location,
+		uint64_t *highest_timestamp
+);
+void write_discard_region (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_hintblock_state *state,
+		unsigned long int last_position
+);
+void write_discard_region_synced (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		unsigned long int hintblock_position,
+		unsigned long int last_position
+);
+
 int write_put_block (
 		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
 		const char *data, unsigned long int data_length,
 		uint64_t appdata,
 		uint64_t timestamp,
-		unsigned long int faketimestamp
+		unsigned long int faketimestamp,
+		int compression,
+		struct bdl_time_source *time_source
+);
+
+int write_put_packed_blocks (
+		struct bdl_io_file *session_file,
+		const struct bdl_header *header,
+		const struct bdl_write_entry *entries, unsigned long int entry_count,
+		unsigned long int faketimestamp,
+		int compression,
+		struct bdl_time_source *time_source
 );
 
 int write_update_hintblock (
@@ -47,17 +81,24 @@ int write_update_hintblock (
 
 int write_put_and_pad_block (
 		struct bdl_io_file *file,
-		int pos,
-		const char *data, int data_length,
-		char pad, int total_size
+		unsigned long int pos,
+		const char *data, unsigned long int data_length,
+		char pad, unsigned long int total_size
 );
 
 int write_checksum_and_put_block(
 	const struct bdl_block_header* block_header,
 	unsigned long int data_length, const char* data,
 	const struct bdl_header* header,
-	unsigned int block_position,
+	unsigned long int block_position,
 	struct bdl_io_file* session_file
 );
 
+int write_patch_block (
+	struct bdl_io_file *session_file,
+	unsigned long int block_position,
+	unsigned long int offset,
+	const char *data, unsigned long int length
+);
+
 #endif
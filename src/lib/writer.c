@@ -0,0 +1,295 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "writer.h"
+#include "write.h"
+#include "session.h"
+#include "defaults.h"
+#include "io.h"
+#include "../include/bdl.h"
+
+//#define BDL_DBG_WRITER
+
+void writer_push (struct bdl_writer *writer, struct writer_node *node) {
+	atomic_store_explicit (&node->next, NULL, memory_order_relaxed);
+
+	// Sequentially consistent, writer_sleep must not miss it while we miss its sleeping flag
+	struct writer_node *previous = atomic_exchange_explicit (&writer->head, node, memory_order_seq_cst);
+
+	// Consumer can't see the node before this, it waits if head and tail disagree
+	atomic_store_explicit (&previous->next, node, memory_order_release);
+}
+
+/* Returns NULL if the queue is empty. The returned node must be freed after the next pop. */
+struct writer_node *writer_pop (struct bdl_writer *writer) {
+	struct writer_node *tail = writer->tail;
+	struct writer_node *next = atomic_load_explicit (&tail->next, memory_order_acquire);
+
+	while (next == NULL) {
+		if (atomic_load_explicit (&writer->head, memory_order_acquire) == tail) {
+			return NULL;
+		}
+
+		// A producer is between exchange and linking
+		sched_yield();
+		next = atomic_load_explicit (&tail->next, memory_order_acquire);
+	}
+
+	writer->tail = next;
+
+	return next;
+}
+
+/* Loads head after the store of sleeping in writer_sleep, both must be sequentially consistent */
+int writer_is_empty (struct bdl_writer *writer) {
+	return atomic_load_explicit (&writer->head, memory_order_seq_cst) == writer->tail;
+}
+
+void writer_wake (struct bdl_writer *writer) {
+	if (atomic_exchange (&writer->sleeping, 0) == 1) {
+		sem_post (&writer->wakeup);
+	}
+}
+
+/* Sleep until a producer wakes us, returns immediately if there is something to do */
+void writer_sleep (struct bdl_writer *writer) {
+	atomic_store (&writer->sleeping, 1);
+
+	if (writer_is_empty (writer) && atomic_load (&writer->stopping) == 0) {
+		while (sem_wait (&writer->wakeup) != 0) {
+			// Interrupted
+		}
+		return;
+	}
+
+	// Somebody might already have cleared the flag and posted
+	if (atomic_exchange (&writer->sleeping, 0) == 0) {
+		while (sem_wait (&writer->wakeup) != 0) {
+			// Interrupted
+		}
+	}
+}
+
+/*
+ * Nodes stay in the queue until the next pop, so the node of the last entry in a
+ * batch is freed by the next batch.
+ */
+void *writer_thread (void *arg) {
+	struct bdl_writer *writer = (struct bdl_writer *) arg;
+	struct bdl_session *session = writer->session;
+
+	struct bdl_write_entry *entries = malloc (BDL_WRITER_BATCH_SIZE * sizeof(*entries));
+	struct writer_node **nodes = malloc (BDL_WRITER_BATCH_SIZE * sizeof(*nodes));
+	if (entries == NULL || nodes == NULL) {
+		fprintf (stderr, "Could not allocate batch for writer thread\n");
+		atomic_store (&writer->error, 1);
+		goto out;
+	}
+
+	struct writer_node *previous_tail = NULL;
+
+	while (1) {
+		unsigned long int count = 0;
+		struct writer_node *node;
+
+		while (count < BDL_WRITER_BATCH_SIZE && (node = writer_pop (writer)) != NULL) {
+			entries[count].data = node->data;
+			entries[count].data_length = node->data_length;
+			entries[count].appdata = node->appdata;
+			entries[count].timestamp = 0;
+
+			// Nodes before the new tail are not referenced by the queue anymore
+			nodes[count] = previous_tail;
+			previous_tail = node;
+			count++;
+		}
+
+		if (count == 0) {
+			if (atomic_load (&writer->stopping) == 1) {
+				break;
+			}
+
+			// Nothing to write, get the region after the head ready for when it's needed
+			if (session->master_header_valid == 1 && atomic_load (&writer->error) == 0) {
+				write_prepare_next_region (&session->device, &session->master_header);
+			}
+
+			writer_sleep (writer);
+			continue;
+		}
+
+#ifdef BDL_DBG_WRITER
+		printf ("Writer thread writing batch of %lu records\n", count);
+#endif
+
+		const struct bdl_header *header;
+		int result;
+		if (atomic_load (&writer->error) == 0 && (
+				session_get_master_header (session, &header, &result) != 0 ||
+				result != 0
+		)) {
+			fprintf (stderr, "Master header was not valid in writer thread\n");
+			atomic_store (&writer->error, BDL_WRITE_ERR_CORRUPT);
+		}
+
+		if (atomic_load (&writer->error) == 0) {
+			int ret = write_put_packed_blocks (
+					&session->device,
+					header,
+					entries, count,
+					0,
+					session->compression,
+					&session->time_source
+			);
+
+			if (ret != 0) {
+				fprintf (stderr, "Error while writing batch in writer thread\n");
+				atomic_store (&writer->error, ret);
+			}
+			else {
+				io_sync (&session->device);
+			}
+		}
+
+		for (unsigned long int i = 0; i < count; i++) {
+			if (nodes[i] != writer->stub) {
+				free (nodes[i]);
+			}
+		}
+	}
+
+	// Producers have stopped, nobody references the tail anymore
+	if (previous_tail != NULL && previous_tail != writer->stub) {
+		free (previous_tail);
+	}
+
+	out:
+	free (entries);
+	free (nodes);
+	return NULL;
+}
+
+int bdl_writer_start (struct bdl_session *session, struct bdl_writer **result) {
+	*result = NULL;
+
+	struct bdl_writer *writer = malloc (sizeof(*writer));
+	if (writer == NULL) {
+		fprintf (stderr, "Could not allocate writer\n");
+		return 1;
+	}
+
+	memset (writer, '\0', sizeof(*writer));
+
+	writer->stub = malloc (sizeof(*writer->stub));
+	if (writer->stub == NULL) {
+		fprintf (stderr, "Could not allocate queue stub for writer\n");
+		free (writer);
+		return 1;
+	}
+
+	writer->session = session;
+	atomic_store (&writer->stub->next, NULL);
+	atomic_store (&writer->head, writer->stub);
+	writer->tail = writer->stub;
+	atomic_store (&writer->sleeping, 0);
+	atomic_store (&writer->stopping, 0);
+	atomic_store (&writer->error, 0);
+
+	if (sem_init (&writer->wakeup, 0, 0) != 0) {
+		fprintf (stderr, "Could not initialize semaphore for writer\n");
+		free (writer->stub);
+		free (writer);
+		return 1;
+	}
+
+	// Keep the device open while the writer runs
+	if (bdl_start_session (session, NULL, 0) != 0) {
+		fprintf (stderr, "A session must be started before starting a writer\n");
+		sem_destroy (&writer->wakeup);
+		free (writer->stub);
+		free (writer);
+		return 1;
+	}
+
+	if (pthread_create (&writer->thread, NULL, writer_thread, writer) != 0) {
+		fprintf (stderr, "Could not start writer thread\n");
+		bdl_close_session (session);
+		sem_destroy (&writer->wakeup);
+		free (writer->stub);
+		free (writer);
+		return 1;
+	}
+
+	*result = writer;
+
+	return 0;
+}
+
+int bdl_writer_submit (
+		struct bdl_writer *writer,
+		const char *data, unsigned long int data_length,
+		uint64_t appdata
+) {
+	int ret;
+	if ((ret = atomic_load (&writer->error)) != 0) {
+		return ret;
+	}
+
+	struct writer_node *node = malloc (sizeof(*node) + data_length);
+	if (node == NULL) {
+		fprintf (stderr, "Could not allocate %lu bytes for record in writer queue\n", data_length);
+		return BDL_WRITE_ERR;
+	}
+
+	node->data_length = data_length;
+	node->appdata = appdata;
+	memcpy (node->data, data, data_length);
+
+	writer_push (writer, node);
+	writer_wake (writer);
+
+	return 0;
+}
+
+int bdl_writer_stop (struct bdl_writer *writer) {
+	atomic_store (&writer->stopping, 1);
+	writer_wake (writer);
+
+	if (pthread_join (writer->thread, NULL) != 0) {
+		fprintf (stderr, "Bug: Could not join writer thread\n");
+		exit (EXIT_FAILURE);
+	}
+
+	int ret = atomic_load (&writer->error);
+
+	bdl_close_session (writer->session);
+	sem_destroy (&writer->wakeup);
+	free (writer->stub);
+	free (writer);
+
+	return ret;
+}
@@ -0,0 +1,64 @@
+/*
+
+Block Device Logger
+
+Copyright (C) 2018 Atle Solbakken atle@goliathdns.no
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef BDL_WRITER_H
+#define BDL_WRITER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "../include/bdl.h"
+
+/*
+ * Producers push records onto an intrusive MPSC queue (Vyukov) with a single
+ * atomic exchange, and the writer thread pops them in order from the other end.
+ * The queue always holds at least the stub node or the last popped node.
+ */
+
+struct writer_node {
+	_Atomic(struct writer_node *) next;
+	unsigned long int data_length;
+	uint64_t appdata;
+	char data[];
+};
+
+struct bdl_writer {
+	struct bdl_session *session;
+	pthread_t thread;
+
+	/* Producers push to head, the writer pops from tail */
+	_Atomic(struct writer_node *) head;
+	struct writer_node *tail;
+
+	/* Allocated by itself, as a node ends with the data of its record */
+	struct writer_node *stub;
+
+	/* Set by the writer before it waits, producers post the semaphore if it's set */
+	atomic_int sleeping;
+	sem_t wakeup;
+
+	atomic_int stopping;
+	atomic_int error;
+};
+
+#endif